@@ -0,0 +1,426 @@
+#define TEST
+#include "ribezal.c"
+
+#define BENCH_REQUESTS 1024
+#define BENCH_UPDATES 1000
+#define BENCH_ROUNDS 200
+
+uint64_t bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The makefile links build/bench with --wrap for these, so every allocation of ribezal (and of the arenas) is counted.
+// Allocations inside libcurl and libc itself are not.
+size_t bench_allocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    bench_allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    bench_allocs++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    bench_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+typedef struct {
+    uint64_t start_ns;
+    size_t start_allocs;
+} Bench_Clock;
+
+Bench_Clock bench_start() {
+    Bench_Clock c = {
+        .start_allocs = bench_allocs,
+        .start_ns = bench_now_ns(),
+    };
+    return c;
+}
+
+void bench_stop(Bench_Clock c, const char *name, size_t ops) {
+    uint64_t elapsed = bench_now_ns() - c.start_ns;
+    size_t allocs = bench_allocs - c.start_allocs;
+    printf("[BENCH] %-24s %10.1f ns/op %8.2f allocs/op\n", name, (double) elapsed / ops, (double) allocs / ops);
+}
+
+// Runs op once to warm up caches and the task pools and then rounds times on the clock
+void bench_run(const char *name, void (*op)(void *), void *arg, size_t rounds) {
+    op(arg);
+    Bench_Clock c = bench_start();
+    for (size_t i=0; i<rounds; i++) op(arg);
+    bench_stop(c, name, rounds);
+}
+
+size_t bench_used_blocks(Task_Size_Class class) {
+    return task_pool[class].live;
+}
+
+// The trees are built like command_execute builds them for the commands
+Task *bench_build_getme(size_t i) {
+    UNUSED(i);
+    String_View url = string_view_from_char_ptr("https://api.telegram.org/bot/getMe");
+    return task_timeout(task_call_getme(url), 1000 * TG_CALL_TIMEOUT_SECS);
+}
+
+Task *bench_build_poller(size_t i) {
+    // one poller per token is allowed
+    char token[32];
+    snprintf(token, sizeof(token), "%zu:BENCH", i);
+    Tg_Poller *p = tg_poller_new(token, TG_POLL_TIMEOUT_SECS, false);
+    assert(p != NULL);
+    return task_tg_poll_updates(p);
+}
+
+// Pool blocks taken by BENCH_REQUESTS trees that are in flight at the same time
+void bench_task_memory_report(const char *name, Task *(*build)(size_t)) {
+    static Task *requests[BENCH_REQUESTS];
+    size_t before[TASK_SIZE_CLASS_COUNT];
+    for (size_t i=0; i<TASK_SIZE_CLASS_COUNT; i++) before[i] = bench_used_blocks(i);
+    for (size_t i=0; i<BENCH_REQUESTS; i++) {
+        requests[i] = build(i);
+    }
+    size_t used[TASK_SIZE_CLASS_COUNT];
+    size_t tasks = 0;
+    size_t bytes = 0;
+    for (size_t i=0; i<TASK_SIZE_CLASS_COUNT; i++) {
+        used[i] = bench_used_blocks(i) - before[i];
+        tasks += used[i];
+        bytes += used[i] * task_pool[i].block_size;
+    }
+    printf("[BENCH] %d in-flight %s: %zu small + %zu large tasks\n",
+            BENCH_REQUESTS, name, used[TASK_SIZE_CLASS_SMALL], used[TASK_SIZE_CLASS_LARGE]);
+    printf("[BENCH] tasks per request: %.2f\n", (double) tasks / BENCH_REQUESTS);
+    printf("[BENCH] bytes per request with size classes: %.1f\n", (double) bytes / BENCH_REQUESTS);
+    printf("[BENCH] bytes per request with one class:    %.1f\n", (double) (tasks * sizeof(Task)) / BENCH_REQUESTS);
+    for (size_t i=0; i<BENCH_REQUESTS; i++) {
+        task_destroy(requests[i]);
+    }
+    // the pollers outlive their tasks, tg_poll_finish frees them when they stop
+    while (tg_pollers != NULL) tg_poller_free(tg_pollers);
+}
+
+void bench_task_memory() {
+    printf("[BENCH] sizeof(Task) = %zu, small class = %zu bytes\n", sizeof(Task), (size_t) TASK_SMALL_SIZE);
+    bench_task_memory_report("getMe requests", bench_build_getme);
+    bench_task_memory_report("pollers", bench_build_poller);
+}
+
+// one update as it was recorded from getUpdates, the ids are filled in
+#define BENCH_UPDATE_FMT \
+    "{\"update_id\":%d,\n\"message\":{\"message_id\":%d,\"from\":{\"id\":123456789,\"is_bot\":false,\"first_name\":\"Ren\\u00e9\"," \
+    "\"last_name\":\"Example\",\"username\":\"rene_example\",\"language_code\":\"de\"},\"chat\":{\"id\":123456789,\"first_name\":\"Ren\\u00e9\"," \
+    "\"last_name\":\"Example\",\"username\":\"rene_example\",\"type\":\"private\"},\"date\":1718000000,\"text\":\"/start hello there \\ud83d\\udc4d\"," \
+    "\"entities\":[{\"offset\":0,\"length\":6,\"type\":\"bot_command\"}]}}"
+
+String_View bench_get_updates_payload(Arena *a, size_t n) {
+    Arena_String_Builder sb = arena_string_builder_init(a);
+    arena_sb_append_cstr(a, &sb, "{\"ok\":true,\"result\":[");
+    for (size_t i=0; i<n; i++) {
+        if (i > 0) arena_sb_append_cstr(a, &sb, ",");
+        arena_sb_append_cstr(a, &sb, arena_sprintf(a, BENCH_UPDATE_FMT, (int) (1000 + i), (int) i));
+    }
+    arena_sb_append_cstr(a, &sb, "]}");
+    return string_view_from_arena_string_builder(sb);
+}
+
+// the path before tg_decode: a json.h DOM that is walked by as_tg_update
+size_t bench_decode_dom(Arena *a, String_View src) {
+    json_value_t *root = json_parse_ex(src.str, src.count, json_parse_flags_default, json_parse_cb, a, NULL);
+    Result r = unpack_tg_response(result_json_value(root));
+    json_array_t *array = json_value_as_array(r.json_value);
+    size_t count = 0;
+    for (json_array_element_t *elem = array->start; elem != NULL; elem = elem->next) {
+        if (as_tg_update(a, elem->value) != NULL) count++;
+    }
+    return count;
+}
+
+// tg_decode without the structural index, byte by byte
+size_t bench_decode_scalar(Arena *a, String_View src) {
+    Tg_Decoder d = tg_decoder_init(a, src, NULL);
+    Result r = tg_decode_get_updates(&d);
+    assert(r.state == STATE_DONE);
+    return r.tg_update_list->count;
+}
+
+size_t bench_decode_indexed(Arena *a, String_View src) {
+    Result r = tg_decode_get_updates_response(a, src);
+    assert(r.state == STATE_DONE);
+    return r.tg_update_list->count;
+}
+
+// only stage 1, the count is faked so it passes the check in bench_decode_report
+size_t bench_json_index(Arena *a, String_View src) {
+    Json_Index index;
+    bool closed = json_index_build(a, src, &index);
+    return closed ? BENCH_UPDATES : 0;
+}
+
+void bench_decode_report(const char *name, size_t (*decode)(Arena *, String_View), String_View src) {
+    Arena a = {0};
+    size_t start_allocs = bench_allocs;
+    uint64_t start = bench_now_ns();
+    for (size_t i=0; i<BENCH_ROUNDS; i++) {
+        size_t count = decode(&a, src);
+        assert(count == BENCH_UPDATES);
+        UNUSED(count);
+        arena_reset(&a);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    size_t allocs = bench_allocs - start_allocs;
+    arena_free(&a);
+    double secs = elapsed / 1e9;
+    printf("[BENCH] %-6s %8.1f MB/s %8.1f ns/update %8.2f allocs/round\n",
+            name,
+            (double) src.count * BENCH_ROUNDS / secs / 1e6,
+            (double) elapsed / (BENCH_ROUNDS * BENCH_UPDATES),
+            (double) allocs / BENCH_ROUNDS);
+}
+
+void bench_decode() {
+    Arena a = {0};
+    String_View src = bench_get_updates_payload(&a, BENCH_UPDATES);
+    printf("[BENCH] decoding getUpdates with %d updates (%zu bytes) %d times\n", BENCH_UPDATES, src.count, BENCH_ROUNDS);
+    bench_decode_report("dom", bench_decode_dom, src);
+    bench_decode_report("scalar", bench_decode_scalar, src);
+    bench_decode_report("index", bench_json_index, src);
+    bench_decode_report("simd", bench_decode_indexed, src);
+    arena_free(&a);
+}
+
+#define BENCH_LOOKUP_ROUNDS 1000000
+
+// the lookup before command_hash.h, kept for comparison
+bool bench_command_lookup_linear(String_View token, Command *result) {
+    for (Command i=0; i<COMMAND_COUNT; i++) {
+        if (strncmp(token.str, command_keyword[i], token.count) == 0) {
+            *result = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void bench_lookup_report(const char *name, bool (*lookup)(String_View, Command *)) {
+    // what a session typically sends: keywords, numbers that never reach the lookup and bot tokens
+    String_View tokens[] = {
+        string_view_from_char_ptr("tg-getMe"),
+        string_view_from_char_ptr("123456:ABC-DEF1234ghIkl-zyx57W2v1u123ew11"),
+        string_view_from_char_ptr("tg-pollUpdatesPipelined"),
+        string_view_from_char_ptr("+"),
+        string_view_from_char_ptr("print"),
+        string_view_from_char_ptr("hello"),
+        string_view_from_char_ptr("quit"),
+        string_view_from_char_ptr("tg-getUpdates"),
+    };
+    size_t token_count = sizeof(tokens) / sizeof(tokens[0]);
+    size_t matched = 0;
+    uint64_t start = bench_now_ns();
+    for (size_t i=0; i<BENCH_LOOKUP_ROUNDS; i++) {
+        Command c;
+        if (lookup(tokens[i % token_count], &c)) matched += c;
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    printf("[BENCH] %-6s %8.1f M tokens/s (checksum %zu)\n", name, BENCH_LOOKUP_ROUNDS / (elapsed / 1e9) / 1e6, matched);
+}
+
+void bench_command_lookup() {
+    printf("[BENCH] looking up %d tokens\n", BENCH_LOOKUP_ROUNDS);
+    bench_lookup_report("linear", bench_command_lookup_linear);
+    bench_lookup_report("hash", command_lookup);
+}
+
+#define BENCH_EXECUTE_ROUNDS 200000
+
+// what a session typically sends that does not start a request
+char *bench_execute_lines[] = {
+    "1 2 + 3 * 4 - 5 / drop 6 7 8 9 + + + drop",
+    "12 34 + drop",
+    "hello world clear",
+    "123456:ABC-DEF1234ghIkl-zyx57W2v1u123ew11 drop",
+};
+#define BENCH_EXECUTE_LINE_COUNT (sizeof(bench_execute_lines) / sizeof(bench_execute_lines[0]))
+
+void bench_execute_compile(void *arg) {
+    String_View *line = arg;
+    Program *p = program_compile(*line);
+    program_run(p);
+    free(p);
+}
+
+void bench_execute_cached(void *arg) {
+    String_View *line = arg;
+    execute(*line);
+}
+
+void bench_execute() {
+    printf("[BENCH] executing typical lines %d times\n", BENCH_EXECUTE_ROUNDS);
+    for (size_t i=0; i<BENCH_EXECUTE_LINE_COUNT; i++) {
+        String_View line = string_view_from_char_ptr(bench_execute_lines[i]);
+        printf("[BENCH] '%s'\n", bench_execute_lines[i]);
+        bench_run("compile", bench_execute_compile, &line, BENCH_EXECUTE_ROUNDS);
+        bench_run("cached", bench_execute_cached, &line, BENCH_EXECUTE_ROUNDS);
+        assert(session->stack_count == 0);
+    }
+    program_cache_free_all();
+}
+
+#define BENCH_TOKENIZE_ROUNDS 1000000
+
+// splits the line the way program_compile does and counts the tokens that are numbers
+void bench_tokenize(void *arg) {
+    String_View rest = *(String_View *) arg;
+    size_t numbers = 0;
+    rest = string_view_drop_ws(rest);
+    while (rest.count > 0) {
+        String_View token = string_view_take_non_ws(rest);
+        int x;
+        if (string_view_try_parse_int(token, &x)) numbers++;
+        rest = string_view_drop_ws(string_view_drop_non_ws(rest));
+    }
+    assert(numbers == 9);
+}
+
+void bench_string_view() {
+    String_View line = string_view_from_char_ptr(bench_execute_lines[0]);
+    printf("[BENCH] tokenizing '%s' %d times\n", bench_execute_lines[0], BENCH_TOKENIZE_ROUNDS);
+    bench_run("tokenize", bench_tokenize, &line, BENCH_TOKENIZE_ROUNDS);
+}
+
+#define BENCH_CHURN_ROUNDS 100000
+#define BENCH_CHURN_BATCH 64
+
+// allocates a batch of tasks and gives them back in a different order than they were allocated
+void bench_task_churn(void *arg) {
+    Task_Kind kind = *(Task_Kind *) arg;
+    Task *batch[BENCH_CHURN_BATCH];
+    for (size_t i=0; i<BENCH_CHURN_BATCH; i++) batch[i] = task_alloc(kind);
+    for (size_t i=0; i<BENCH_CHURN_BATCH; i+=2) task_free(batch[i]);
+    for (size_t i=1; i<BENCH_CHURN_BATCH; i+=2) task_free(batch[i]);
+}
+
+void bench_task_alloc() {
+    printf("[BENCH] allocating and freeing %d tasks %d times, one op is one batch\n", BENCH_CHURN_BATCH, BENCH_CHURN_ROUNDS);
+    Task_Kind small = TASK_KIND_AND;
+    Task_Kind large = TASK_KIND_SEQUENCE;
+    assert(task_kind_size_class(small) == TASK_SIZE_CLASS_SMALL);
+    assert(task_kind_size_class(large) == TASK_SIZE_CLASS_LARGE);
+    bench_run("churn small", bench_task_churn, &small, BENCH_CHURN_ROUNDS);
+    bench_run("churn large", bench_task_churn, &large, BENCH_CHURN_ROUNDS);
+}
+
+#define BENCH_TREE_ROUNDS 100000
+#define BENCH_TREE_WIDTH 8
+
+Task *bench_then_const(Result r, void *data) {
+    UNUSED(data);
+    return task_const(r);
+}
+
+Task *bench_then_recover(Result r, void *data) {
+    UNUSED(r);
+    UNUSED(data);
+    return task_const(result_int(1));
+}
+
+// polls a tree of tasks that never wait on the reactor until it is done and destroys it
+void bench_tree_run(Task *t) {
+    Context ctx = context_new();
+    Result r = task_poll(t, &ctx);
+    while (r.state == STATE_PENDING) r = task_poll(t, &ctx);
+    assert(r.state == STATE_DONE);
+    task_destroy(t);
+}
+
+Task *bench_tree_and() {
+    Task *t = task_const(result_int(0));
+    for (size_t i=0; i<BENCH_TREE_WIDTH; i++) t = task_and(t, bench_then_const, NULL);
+    return t;
+}
+
+// every fallback fails again until the outermost one
+Task *bench_tree_or() {
+    Task *t = task_const(RESULT_ERROR);
+    for (size_t i=1; i<BENCH_TREE_WIDTH; i++) t = task_or(t, bench_then_const, NULL);
+    return task_or(t, bench_then_recover, NULL);
+}
+
+Task *bench_tree_parallel() {
+    Task *p = task_parallel();
+    for (size_t i=0; i<BENCH_TREE_WIDTH; i++) task_par_append(p, task_and(task_const(result_int(i)), bench_then_const, NULL));
+    return p;
+}
+
+void bench_tree(void *arg) {
+    Task *(*build)() = arg;
+    bench_tree_run(build());
+}
+
+void bench_task_poll() {
+    printf("[BENCH] building, polling and destroying trees of %d tasks %d times\n", BENCH_TREE_WIDTH, BENCH_TREE_ROUNDS);
+    bench_run("and chain", bench_tree, bench_tree_and, BENCH_TREE_ROUNDS);
+    bench_run("or chain", bench_tree, bench_tree_or, BENCH_TREE_ROUNDS);
+    bench_run("parallel of and", bench_tree, bench_tree_parallel, BENCH_TREE_ROUNDS);
+}
+
+#define BENCH_URL_ROUNDS 200000
+#define BENCH_BOT_TOKEN "123456:ABC-DEF1234ghIkl-zyx57W2v1u123ew11"
+
+typedef struct {
+    Arena arena;
+    Tg_Method_Call call;
+    // the lengths of the results are summed up so the calls are not optimized away with NDEBUG
+    size_t bytes;
+} Bench_Url;
+
+void bench_build_url(void *arg) {
+    Bench_Url *b = arg;
+    String_View url = build_url(&b->arena, &b->call);
+    assert(url.count > 0);
+    b->bytes += url.count;
+    arena_reset(&b->arena);
+}
+
+void bench_percent_encode(void *arg) {
+    Bench_Url *b = arg;
+    String_View enc = percent_encode(&b->arena, string_view_from_char_ptr(b->call.text));
+    assert(enc.count > 0);
+    b->bytes += enc.count;
+    arena_reset(&b->arena);
+}
+
+void bench_url() {
+    printf("[BENCH] building urls %d times\n", BENCH_URL_ROUNDS);
+    Tg_Chat chat = { .id = 123456789 };
+    Bench_Url b = {0};
+    b.call = new_tg_api_call_get_me(BENCH_BOT_TOKEN);
+    bench_run("build_url getMe", bench_build_url, &b, BENCH_URL_ROUNDS);
+    b.call = new_tg_api_call_get_updates_long_poll(BENCH_BOT_TOKEN, 1000, 30);
+    bench_run("build_url getUpdates", bench_build_url, &b, BENCH_URL_ROUNDS);
+    b.call = new_tg_api_call_send_message(BENCH_BOT_TOKEN, &chat, "hello there from ribezal");
+    bench_run("build_url sendMessage", bench_build_url, &b, BENCH_URL_ROUNDS);
+    bench_run("percent_encode", bench_percent_encode, &b, BENCH_URL_ROUNDS);
+    arena_free(&b.arena);
+}
+
+int main() {
+    bench_task_memory();
+    bench_task_alloc();
+    bench_task_poll();
+    bench_decode();
+    bench_command_lookup();
+    bench_string_view();
+    bench_execute();
+    bench_url();
+    return 0;
+}
@@ -2,6 +2,9 @@
 #define COMMAND_H
 
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 typedef enum {
     HELP,
@@ -15,6 +18,10 @@ typedef enum {
     DIVIDE,
     TG_GETME,
     TG_GETUPDATES,
+    TG_POLLUPDATES,
+    TG_POLLUPDATES_PIPELINED,
+    STATS,
+    TRACE,
     COMMAND_COUNT,
 } Command;
 
@@ -30,6 +37,10 @@ const char *command_keyword[] = {
     [DIVIDE]        = "/",
     [TG_GETME]      = "tg-getMe",
     [TG_GETUPDATES] = "tg-getUpdates",
+    [TG_POLLUPDATES] = "tg-pollUpdates",
+    [TG_POLLUPDATES_PIPELINED] = "tg-pollUpdatesPipelined",
+    [STATS]         = "stats",
+    [TRACE]         = "trace",
 };
 static_assert(sizeof(command_keyword) / sizeof(command_keyword[0]) == COMMAND_COUNT);
 
@@ -45,6 +56,10 @@ const char *command_stack_config[] = {
     [DIVIDE]        = "(int int -> int)",
     [TG_GETME]      = "(string ->)",
     [TG_GETUPDATES] = "(string ->)",
+    [TG_POLLUPDATES] = "(string ->)",
+    [TG_POLLUPDATES_PIPELINED] = "(string ->)",
+    [STATS]         = "(->)",
+    [TRACE]         = "(->)",
 };
 static_assert(sizeof(command_stack_config) / sizeof(command_stack_config[0]) == COMMAND_COUNT);
 
@@ -60,7 +75,32 @@ const char *command_description[] = {
     [DIVIDE]        = "Divides one number by the other.",
     [TG_GETME]      = "Takes a bot token, performs a 'getMe' call to the telegram api and gives some informative output.",
     [TG_GETUPDATES] = "Takes a bot token, performs a 'getUpdates' call to the telegram api and gives some informative output.",
+    [TG_POLLUPDATES] = "Takes a bot token and keeps long polling 'getUpdates' for it until the repl is closed. Every update is printed once.",
+    [TG_POLLUPDATES_PIPELINED] = "Like 'tg-pollUpdates' but the next 'getUpdates' call is sent while the previous updates are still processed.",
+    [STATS]         = "Prints counters of the server: tasks, memory, transfers, commands, time spent in the main loop and latency of the telegram api.",
+    [TRACE]         = "Starts recording what happens to tasks (allocation, polls, completion, destruction), run again to write the latest events to 'ribezal-trace.json' in the Chrome trace event format. RIBEZAL_TRACE in the environment starts recording right away.",
 };
 static_assert(sizeof(command_description) / sizeof(command_description[0]) == COMMAND_COUNT);
 
+// FNV-1a with the seed mixed into the offset basis.
+// generate-command-hash.c searches a seed for which the keywords do not collide, see command_hash.h
+uint32_t command_hash(const char *str, size_t count, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i=0; i<count; i++) {
+        h ^= (unsigned char) str[i];
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+// Hash of all keywords in their order, command_hash.h records it to tell whether it is outdated
+uint32_t command_keywords_hash() {
+    uint32_t h = 0;
+    for (Command c=0; c<COMMAND_COUNT; c++) {
+        // with the terminating null as separator "ab" "c" and "a" "bc" differ
+        h = command_hash(command_keyword[c], strlen(command_keyword[c]) + 1, h);
+    }
+    return h;
+}
+
 #endif // COMMAND_H
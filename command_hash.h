@@ -0,0 +1,40 @@
+// Generated by generate-command-hash.c from command.h, do not edit
+#ifndef COMMAND_HASH_H
+#define COMMAND_HASH_H
+
+#include "command.h"
+
+#define COMMAND_HASH_SEED 8963u
+#define COMMAND_HASH_SIZE 16
+#define COMMAND_HASH_COUNT 15
+static_assert(COMMAND_HASH_COUNT == COMMAND_COUNT, "command_hash.h is outdated, run 'make command_hash.h'");
+// the count is checked at compile time, renamed keywords are only caught by comparing
+// command_keywords_hash() with this at startup
+#define COMMAND_HASH_KEYWORDS 0x7ba25820u
+
+typedef struct {
+    // -1 if no keyword hashes to this slot
+    int command;
+    size_t length;
+} Command_Hash_Slot;
+
+const Command_Hash_Slot command_hash_table[COMMAND_HASH_SIZE] = {
+    [0] = { .command = 6, .length = 1 }, // -
+    [1] = { .command = -1, .length = 0 },
+    [2] = { .command = 11, .length = 14 }, // tg-pollUpdates
+    [3] = { .command = 1, .length = 4 }, // quit
+    [4] = { .command = 4, .length = 5 }, // clear
+    [5] = { .command = 7, .length = 1 }, // *
+    [6] = { .command = 5, .length = 1 }, // +
+    [7] = { .command = 13, .length = 5 }, // stats
+    [8] = { .command = 10, .length = 13 }, // tg-getUpdates
+    [9] = { .command = 12, .length = 23 }, // tg-pollUpdatesPipelined
+    [10] = { .command = 8, .length = 1 }, // /
+    [11] = { .command = 2, .length = 5 }, // print
+    [12] = { .command = 3, .length = 4 }, // drop
+    [13] = { .command = 14, .length = 5 }, // trace
+    [14] = { .command = 9, .length = 8 }, // tg-getMe
+    [15] = { .command = 0, .length = 4 }, // help
+};
+
+#endif // COMMAND_HASH_H
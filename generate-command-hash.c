@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "command.h"
+
+#define FILE_NAME "command_hash.h"
+#define MAX_SEED 1000000
+#define MAX_TABLE_SIZE 1024
+
+int table[MAX_TABLE_SIZE];
+
+// Tries to place every keyword in its own slot of a table with the given size
+bool try_seed(uint32_t seed, size_t size) {
+    for (size_t i=0; i<size; i++) table[i] = -1;
+    for (Command c=0; c<COMMAND_COUNT; c++) {
+        const char *keyword = command_keyword[c];
+        uint32_t slot = command_hash(keyword, strlen(keyword), seed) & (size - 1);
+        if (table[slot] >= 0) return false;
+        table[slot] = c;
+    }
+    return true;
+}
+
+int main() {
+    size_t size = 1;
+    while (size < COMMAND_COUNT) size *= 2;
+
+    uint32_t seed = 0;
+    bool found = false;
+    for (; size <= MAX_TABLE_SIZE && !found; size *= 2) {
+        for (seed = 0; seed < MAX_SEED; seed++) {
+            if (try_seed(seed, size)) {
+                found = true;
+                break;
+            }
+        }
+        if (found) break;
+    }
+    if (!found) {
+        printf("[ERROR] Couldn't find a perfect hash for %d keywords\n", COMMAND_COUNT);
+        exit(1);
+    }
+
+    FILE *f = fopen(FILE_NAME, "w");
+    if (!f) {
+        printf("[ERROR] Couldn't open file '%s': %s\n", FILE_NAME, strerror(errno));
+        exit(1);
+    }
+
+    fprintf(f, "// Generated by generate-command-hash.c from command.h, do not edit\n");
+    fprintf(f, "#ifndef COMMAND_HASH_H\n");
+    fprintf(f, "#define COMMAND_HASH_H\n");
+    fprintf(f, "\n");
+    fprintf(f, "#include \"command.h\"\n");
+    fprintf(f, "\n");
+    fprintf(f, "#define COMMAND_HASH_SEED %uu\n", seed);
+    fprintf(f, "#define COMMAND_HASH_SIZE %zu\n", size);
+    fprintf(f, "#define COMMAND_HASH_COUNT %d\n", COMMAND_COUNT);
+    fprintf(f, "static_assert(COMMAND_HASH_COUNT == COMMAND_COUNT, \"command_hash.h is outdated, run 'make command_hash.h'\");\n");
+    fprintf(f, "// the count is checked at compile time, renamed keywords are only caught by comparing\n");
+    fprintf(f, "// command_keywords_hash() with this at startup\n");
+    fprintf(f, "#define COMMAND_HASH_KEYWORDS 0x%08xu\n", command_keywords_hash());
+    fprintf(f, "\n");
+    fprintf(f, "typedef struct {\n");
+    fprintf(f, "    // -1 if no keyword hashes to this slot\n");
+    fprintf(f, "    int command;\n");
+    fprintf(f, "    size_t length;\n");
+    fprintf(f, "} Command_Hash_Slot;\n");
+    fprintf(f, "\n");
+    fprintf(f, "const Command_Hash_Slot command_hash_table[COMMAND_HASH_SIZE] = {\n");
+    for (size_t i=0; i<size; i++) {
+        if (table[i] < 0) {
+            fprintf(f, "    [%zu] = { .command = -1, .length = 0 },\n", i);
+        } else {
+            const char *keyword = command_keyword[table[i]];
+            fprintf(f, "    [%zu] = { .command = %d, .length = %zu }, // %s\n", i, table[i], strlen(keyword), keyword);
+        }
+    }
+    fprintf(f, "};\n");
+    fprintf(f, "\n");
+    fprintf(f, "#endif // COMMAND_HASH_H\n");
+
+    int r = fclose(f);
+    if (r != 0) {
+        printf("[ERROR] Couldn't close file '%s': %s\n", FILE_NAME, strerror(errno));
+        exit(1);
+    }
+}
@@ -46,6 +46,18 @@ const char *readme_pre_doc[] = {
 #define README_PRE_DOC_COUNT (sizeof(readme_pre_doc) / sizeof(readme_pre_doc[0]))
 
 const char *readme_post_doc[] = {
+    "",
+    "## Load testing",
+    "",
+    "`build/mock-tg` is a local stand-in for the telegram bot api with configurable latency, errors and `429` responses",
+    "(see `./build/mock-tg -h`).",
+    "The environment variable `RIBEZAL_API_URL` replaces the base url of the api:",
+    "",
+    "```console",
+    "$ make build/mock-tg",
+    "$ ./build/mock-tg -l 50 -j 200 -e 1 -r 1 &",
+    "$ RIBEZAL_API_URL=http://127.0.0.1:8089/bot ./build/ribezal &",
+    "```",
     "",
     "## References",
     "",
@@ -0,0 +1,598 @@
+// A local stand-in for the telegram bot api to load test ribezal without the real service.
+// It implements getMe, getUpdates (with offset and long polling), sendMessage and setMessageReaction
+// for every bot token and produces synthetic updates at a fixed rate.
+// Point ribezal at it with
+//     $ ./build/mock-tg -l 50 -e 1 -r 1 &
+//     $ RIBEZAL_API_URL=http://127.0.0.1:8089/bot ./build/ribezal
+// The server prints a summary of the requests it answered when it receives SIGINT or SIGTERM.
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "devutils.h"
+#include "tgapi.h"
+
+#define MOCK_DEFAULT_PORT 8089
+#define MOCK_MAX_CONNECTIONS 1024
+#define MOCK_REQUEST_CAPACITY 8192
+// telegram never answers getUpdates with more than 100 updates
+#define MOCK_MAX_UPDATES_PER_RESPONSE 100
+#define MOCK_CHAT_COUNT 8
+#define MOCK_BOT_ID 1000
+
+typedef struct {
+    uint16_t port;
+    int latency_ms;
+    int jitter_ms;
+    // in percent of all requests
+    double error_rate;
+    double too_many_requests_rate;
+    int retry_after;
+    double updates_per_sec;
+    unsigned int seed;
+} Mock_Config;
+
+Mock_Config config = {
+    .port = MOCK_DEFAULT_PORT,
+    .retry_after = 1,
+    .updates_per_sec = 1,
+    .seed = 1,
+};
+
+/******************************
+ * time and updates           *
+ ******************************/
+
+uint64_t time_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t start_ms;
+
+// Updates are not stored, the content of an update follows from its id.
+// Every id below first_unconfirmed was confirmed by a getUpdates call with a higher offset.
+int64_t first_unconfirmed = 1;
+
+// the id the next update will get, updates are produced from start_ms on at config.updates_per_sec
+int64_t updates_produced() {
+    if (config.updates_per_sec <= 0) return 1;
+    return 1 + (int64_t) ((time_now_ms() - start_ms) * config.updates_per_sec / 1000);
+}
+
+uint64_t next_update_ms() {
+    if (config.updates_per_sec <= 0) return UINT64_MAX;
+    return start_ms + (uint64_t) (updates_produced() * 1000 / config.updates_per_sec) + 1;
+}
+
+/******************************
+ * responses                  *
+ ******************************/
+
+typedef struct {
+    char *items;
+    size_t count;
+    size_t capacity;
+} Buffer;
+
+CHECK_PRINTF_FMT(2, 3) void buffer_printf(Buffer *b, const char *fmt, ...) {
+    for (;;) {
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(b->items + b->count, b->capacity - b->count, fmt, args);
+        va_end(args);
+        assert(n >= 0);
+        if (b->count + n < b->capacity) {
+            b->count += n;
+            return;
+        }
+        b->capacity = b->capacity == 0 ? 1024 : 2*b->capacity;
+        while (b->capacity <= b->count + n) b->capacity *= 2;
+        b->items = realloc(b->items, b->capacity);
+        assert(b->items != NULL);
+    }
+}
+
+void buffer_append_json_string(Buffer *b, const char *s) {
+    buffer_printf(b, "\"");
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            buffer_printf(b, "\\%c", c);
+        } else if (c < 0x20) {
+            buffer_printf(b, "\\u%04x", c);
+        } else {
+            buffer_printf(b, "%c", c);
+        }
+    }
+    buffer_printf(b, "\"");
+}
+
+void buffer_append_update(Buffer *b, int64_t id) {
+    int64_t chat_id = 42 + id % MOCK_CHAT_COUNT;
+    buffer_printf(b,
+            "{\"update_id\":%ld,\"message\":{\"message_id\":%ld,"
+            "\"from\":{\"id\":%ld,\"is_bot\":false,\"first_name\":\"Load\"},"
+            "\"chat\":{\"id\":%ld,\"first_name\":\"Load\",\"type\":\"private\"},"
+            "\"date\":%ld,\"text\":\"message %ld\"}}",
+            id, id, chat_id, chat_id, (int64_t) time(NULL), id);
+}
+
+typedef struct {
+    bool valid;
+    // TG_METHOD_COUNT if the method is unknown
+    Tg_Method method;
+    int64_t offset;
+    int timeout;
+    int64_t chat_id;
+    int64_t message_id;
+    char text[1024];
+} Mock_Request;
+
+int hex_value(char c) {
+    if ('0' <= c && c <= '9') return c - '0';
+    if ('a' <= c && c <= 'f') return c - 'a' + 10;
+    if ('A' <= c && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+void percent_decode(const char *in, size_t n, char *out, size_t capacity) {
+    size_t j = 0;
+    for (size_t i=0; i<n && j+1<capacity; i++) {
+        if (in[i] == '%' && i+2 < n && hex_value(in[i+1]) >= 0 && hex_value(in[i+2]) >= 0) {
+            out[j++] = (char) (hex_value(in[i+1])*16 + hex_value(in[i+2]));
+            i += 2;
+        } else if (in[i] == '+') {
+            out[j++] = ' ';
+        } else {
+            out[j++] = in[i];
+        }
+    }
+    out[j] = '\0';
+}
+
+// Parses the request line "GET /bot<token>/<method>?<query> HTTP/1.1", the headers are ignored
+Mock_Request parse_request(const char *line, size_t n) {
+    Mock_Request req = { .method = TG_METHOD_COUNT };
+    const char *end = line + n;
+    const char *path = memchr(line, ' ', n);
+    if (path == NULL) return req;
+    path++;
+    const char *path_end = memchr(path, ' ', end - path);
+    if (path_end == NULL) path_end = end;
+    if (path_end - path < 4 || strncmp(path, "/bot", 4) != 0) return req;
+    const char *token = path + 4;
+    const char *slash = memchr(token, '/', path_end - token);
+    if (slash == NULL || slash == token) return req;
+    req.valid = true;
+
+    const char *method = slash + 1;
+    const char *query = memchr(method, '?', path_end - method);
+    const char *method_end = query == NULL ? path_end : query;
+    for (Tg_Method m=0; m<TG_METHOD_COUNT; m++) {
+        size_t len = strlen(tg_method_name[m]);
+        if ((size_t) (method_end - method) == len && strncmp(method, tg_method_name[m], len) == 0) req.method = m;
+    }
+    if (query == NULL) return req;
+
+    const char *cur = query + 1;
+    while (cur < path_end) {
+        const char *amp = memchr(cur, '&', path_end - cur);
+        if (amp == NULL) amp = path_end;
+        const char *eq = memchr(cur, '=', amp - cur);
+        if (eq != NULL) {
+            char value[sizeof(req.text)];
+            percent_decode(eq + 1, amp - eq - 1, value, sizeof(value));
+            size_t key_len = eq - cur;
+#define KEY_IS(k) (key_len == strlen(k) && strncmp(cur, k, key_len) == 0)
+            if (KEY_IS("offset")) req.offset = strtoll(value, NULL, 10);
+            else if (KEY_IS("timeout")) req.timeout = atoi(value);
+            else if (KEY_IS("chat_id")) req.chat_id = strtoll(value, NULL, 10);
+            else if (KEY_IS("message_id")) req.message_id = strtoll(value, NULL, 10);
+            else if (KEY_IS("text")) memcpy(req.text, value, sizeof(value));
+#undef KEY_IS
+        }
+        cur = amp + 1;
+    }
+    return req;
+}
+
+/******************************
+ * connections                *
+ ******************************/
+
+typedef enum {
+    CONN_READING,
+    // the response is held back until due_ms, either for the latency or for a long poll
+    CONN_WAITING,
+    CONN_WRITING,
+} Conn_State;
+
+typedef struct {
+    int fd;
+    Conn_State state;
+    char in[MOCK_REQUEST_CAPACITY];
+    size_t in_count;
+    Mock_Request req;
+    // the status of the response that was decided when the request arrived, 0 for a regular answer
+    int forced_status;
+    uint64_t due_ms;
+    // a long poll ends at this point in time even without updates
+    uint64_t poll_deadline_ms;
+    Buffer out;
+    size_t out_sent;
+} Conn;
+
+Conn conns[MOCK_MAX_CONNECTIONS];
+size_t conn_count = 0;
+
+typedef struct {
+    size_t requests[TG_METHOD_COUNT + 1];
+    size_t status_2xx;
+    size_t status_4xx;
+    size_t status_429;
+    size_t status_5xx;
+    size_t updates_delivered;
+} Mock_Stats;
+
+Mock_Stats stats = {0};
+
+volatile sig_atomic_t stop_requested = 0;
+
+void handle_stop(int sig) {
+    UNUSED(sig);
+    stop_requested = 1;
+}
+
+bool roll(double percent) {
+    return percent > 0 && rand() % 10000 < percent * 100;
+}
+
+void conn_respond(Conn *c, int status, const char *reason, Buffer *body) {
+    if (status < 300) stats.status_2xx++;
+    else if (status == 429) stats.status_429++;
+    else if (status < 500) stats.status_4xx++;
+    else stats.status_5xx++;
+
+    c->out.count = 0;
+    c->out_sent = 0;
+    buffer_printf(&c->out,
+            "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n%.*s",
+            status, reason, body->count, (int) body->count, body->items);
+    c->state = CONN_WRITING;
+}
+
+void conn_respond_error(Conn *c, int status, const char *reason, const char *description) {
+    Buffer body = {0};
+    buffer_printf(&body, "{\"ok\":false,\"error_code\":%d,\"description\":\"%s\"", status, description);
+    if (status == 429) buffer_printf(&body, ",\"parameters\":{\"retry_after\":%d}", config.retry_after);
+    buffer_printf(&body, "}");
+    conn_respond(c, status, reason, &body);
+    free(body.items);
+}
+
+// Decides what happens with a complete request, the answer is sent once it is due
+void conn_accept_request(Conn *c) {
+    uint64_t now = time_now_ms();
+    c->forced_status = 0;
+    if (!c->req.valid) {
+        c->forced_status = 401;
+    } else if (c->req.method == TG_METHOD_COUNT) {
+        c->forced_status = 404;
+    } else if (roll(config.too_many_requests_rate)) {
+        c->forced_status = 429;
+    } else if (roll(config.error_rate)) {
+        c->forced_status = 500;
+    }
+    stats.requests[c->req.method]++;
+
+    int latency = config.latency_ms;
+    if (config.jitter_ms > 0) latency += rand() % (config.jitter_ms + 1);
+    c->due_ms = now + latency;
+    c->poll_deadline_ms = 0;
+    if (c->forced_status == 0 && c->req.method == GET_UPDATES && c->req.timeout > 0) {
+        c->poll_deadline_ms = now + (uint64_t) c->req.timeout * 1000;
+    }
+    c->state = CONN_WAITING;
+}
+
+// Returns false if the response has to wait for updates of a long poll
+bool conn_try_answer(Conn *c, uint64_t now) {
+    switch (c->forced_status) {
+        case 0:
+            break;
+        case 401:
+            conn_respond_error(c, 401, "Unauthorized", "Unauthorized");
+            return true;
+        case 404:
+            conn_respond_error(c, 404, "Not Found", "Not Found");
+            return true;
+        case 429:
+            conn_respond_error(c, 429, "Too Many Requests", "Too Many Requests: retry later");
+            return true;
+        case 500:
+            conn_respond_error(c, 500, "Internal Server Error", "Internal Server Error");
+            return true;
+        default:
+            UNREACHABLE("invalid forced status");
+    }
+
+    Mock_Request *req = &c->req;
+    Buffer body = {0};
+    buffer_printf(&body, "{\"ok\":true,\"result\":");
+    switch (req->method) {
+        case GET_ME:
+            buffer_printf(&body, "{\"id\":%d,\"is_bot\":true,\"first_name\":\"Mock\",\"username\":\"mock_bot\"}", MOCK_BOT_ID);
+            break;
+        case GET_UPDATES:
+            {
+                int64_t produced = updates_produced();
+                if (req->offset > first_unconfirmed) {
+                    first_unconfirmed = req->offset < produced ? req->offset : produced;
+                }
+                int64_t first = req->offset > first_unconfirmed ? req->offset : first_unconfirmed;
+                if (first >= produced && now < c->poll_deadline_ms) {
+                    free(body.items);
+                    return false;
+                }
+                buffer_printf(&body, "[");
+                for (int64_t id=first; id<produced && id<first+MOCK_MAX_UPDATES_PER_RESPONSE; id++) {
+                    if (id > first) buffer_printf(&body, ",");
+                    buffer_append_update(&body, id);
+                    stats.updates_delivered++;
+                }
+                buffer_printf(&body, "]");
+                break;
+            }
+        case SEND_MESSAGE:
+            {
+                static int64_t next_message_id = 1;
+                buffer_printf(&body,
+                        "{\"message_id\":%ld,\"from\":{\"id\":%d,\"is_bot\":true,\"first_name\":\"Mock\"},"
+                        "\"chat\":{\"id\":%ld,\"type\":\"private\"},\"date\":%ld,\"text\":",
+                        next_message_id++, MOCK_BOT_ID, req->chat_id, (int64_t) time(NULL));
+                buffer_append_json_string(&body, req->text);
+                buffer_printf(&body, "}");
+                break;
+            }
+        case SET_MESSAGE_REACTION:
+            buffer_printf(&body, "true");
+            break;
+        case TG_METHOD_COUNT:
+            UNREACHABLE("unknown methods are answered with 404");
+    }
+    buffer_printf(&body, "}");
+    conn_respond(c, 200, "OK", &body);
+    free(body.items);
+    return true;
+}
+
+char *find(char *haystack, size_t n, const char *needle) {
+    size_t len = strlen(needle);
+    for (size_t i=0; i+len<=n; i++) {
+        if (memcmp(haystack + i, needle, len) == 0) return haystack + i;
+    }
+    return NULL;
+}
+
+// Looks for a complete request in the input, a body (Content-Length) is not expected and skipped if present
+bool conn_take_request(Conn *c) {
+    char *header_end = find(c->in, c->in_count, "\r\n\r\n");
+    if (header_end == NULL) return false;
+    size_t header_count = header_end + 4 - c->in;
+    size_t content_length = 0;
+    char *cl = find(c->in, header_count, "Content-Length:");
+    if (cl != NULL) content_length = strtoul(cl + 15, NULL, 10);
+    if (header_count + content_length > c->in_count) return false;
+
+    char *line_end = find(c->in, header_count, "\r\n");
+    c->req = parse_request(c->in, line_end - c->in);
+    size_t consumed = header_count + content_length;
+    memmove(c->in, c->in + consumed, c->in_count - consumed);
+    c->in_count -= consumed;
+    conn_accept_request(c);
+    return true;
+}
+
+void conn_close(size_t i) {
+    close(conns[i].fd);
+    free(conns[i].out.items);
+    conn_count--;
+    if (i < conn_count) conns[i] = conns[conn_count];
+}
+
+// Returns false if the connection is done
+bool conn_read(Conn *c) {
+    for (;;) {
+        size_t space = MOCK_REQUEST_CAPACITY - c->in_count;
+        if (space == 0) return false;
+        ssize_t n = read(c->fd, c->in + c->in_count, space);
+        if (n == 0) return false;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->in_count += n;
+        if (c->state == CONN_READING) conn_take_request(c);
+    }
+}
+
+bool conn_write(Conn *c) {
+    while (c->out_sent < c->out.count) {
+        ssize_t n = write(c->fd, c->out.items + c->out_sent, c->out.count - c->out_sent);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->out_sent += n;
+    }
+    // keep-alive: the next request may already be waiting in the buffer
+    c->state = CONN_READING;
+    conn_take_request(c);
+    return true;
+}
+
+/******************************
+ * main                       *
+ ******************************/
+
+int listen_open(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        printf("[ERROR] Could not create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+        printf("[ERROR] Could not listen on port %d: %s\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+void accept_all(int listen_fd) {
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) return;
+        if (conn_count == MOCK_MAX_CONNECTIONS) {
+            printf("[WARNING] Too many connections, one is dropped\n");
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        Conn *c = &conns[conn_count++];
+        *c = (Conn) { .fd = fd, .state = CONN_READING };
+    }
+}
+
+void print_stats() {
+    double secs = (time_now_ms() - start_ms) / 1000.0;
+    size_t total = 0;
+    for (size_t m=0; m<=TG_METHOD_COUNT; m++) total += stats.requests[m];
+    printf("[INFO] answered %zu requests in %.1f s (%.1f/s)\n", total, secs, total / secs);
+    for (Tg_Method m=0; m<TG_METHOD_COUNT; m++) {
+        printf("[INFO]     %-20s %zu\n", tg_method_name[m], stats.requests[m]);
+    }
+    printf("[INFO]     %-20s %zu\n", "unknown", stats.requests[TG_METHOD_COUNT]);
+    printf("[INFO] responses: %zu ok, %zu 429, %zu other 4xx, %zu 5xx\n",
+            stats.status_2xx, stats.status_429, stats.status_4xx, stats.status_5xx);
+    printf("[INFO] updates delivered: %zu, last update id %ld\n", stats.updates_delivered, updates_produced() - 1);
+}
+
+void usage(const char *program) {
+    printf("Usage: %s [options]\n", program);
+    printf("    -p <port>     port on 127.0.0.1 (default %d)\n", MOCK_DEFAULT_PORT);
+    printf("    -l <ms>       latency of every response (default 0)\n");
+    printf("    -j <ms>       random additional latency up to ms (default 0)\n");
+    printf("    -e <percent>  requests that fail with 500 (default 0)\n");
+    printf("    -r <percent>  requests that fail with 429 Too Many Requests (default 0)\n");
+    printf("    -a <secs>     retry_after of a 429 response (default 1)\n");
+    printf("    -u <rate>     updates produced per second (default 1)\n");
+    printf("    -s <seed>     seed of the error rolls (default 1)\n");
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:l:j:e:r:a:u:s:h")) != -1) {
+        switch (opt) {
+            case 'p': config.port = atoi(optarg); break;
+            case 'l': config.latency_ms = atoi(optarg); break;
+            case 'j': config.jitter_ms = atoi(optarg); break;
+            case 'e': config.error_rate = atof(optarg); break;
+            case 'r': config.too_many_requests_rate = atof(optarg); break;
+            case 'a': config.retry_after = atoi(optarg); break;
+            case 'u': config.updates_per_sec = atof(optarg); break;
+            case 's': config.seed = strtoul(optarg, NULL, 10); break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    srand(config.seed);
+
+    int listen_fd = listen_open(config.port);
+    if (listen_fd < 0) return 1;
+    struct sigaction sa = { .sa_handler = handle_stop };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    start_ms = time_now_ms();
+    printf("[INFO] mock telegram api on http://127.0.0.1:%d/bot\n", config.port);
+    fflush(stdout);
+
+    static struct pollfd fds[MOCK_MAX_CONNECTIONS + 1];
+    while (!stop_requested) {
+        uint64_t now = time_now_ms();
+        uint64_t wake_ms = UINT64_MAX;
+        for (size_t i=0; i<conn_count; i++) {
+            Conn *c = &conns[i];
+            if (c->state != CONN_WAITING) continue;
+            if (now >= c->due_ms && conn_try_answer(c, now)) continue;
+            uint64_t due = c->due_ms;
+            if (now >= due) {
+                // a long poll without updates, it is answered with the next update or at its deadline
+                due = next_update_ms();
+                if (c->poll_deadline_ms < due) due = c->poll_deadline_ms;
+            }
+            if (due < wake_ms) wake_ms = due;
+        }
+
+        fds[0] = (struct pollfd) { .fd = listen_fd, .events = POLLIN };
+        for (size_t i=0; i<conn_count; i++) {
+            short events = conns[i].state == CONN_WRITING ? POLLOUT : POLLIN;
+            fds[i+1] = (struct pollfd) { .fd = conns[i].fd, .events = events };
+        }
+        int timeout = -1;
+        if (wake_ms != UINT64_MAX) timeout = wake_ms > now ? (int) (wake_ms - now) : 0;
+        int n = poll(fds, conn_count + 1, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            printf("[ERROR] poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        // connections that are closed are replaced by the last one, so go backwards to visit each once
+        size_t polled = conn_count;
+        for (size_t i=polled; i>0; i--) {
+            Conn *c = &conns[i-1];
+            short revents = fds[i].revents;
+            if (revents == 0) continue;
+            bool alive = true;
+            if (revents & (POLLERR | POLLHUP)) alive = false;
+            else if (revents & POLLIN) alive = conn_read(c);
+            else if (revents & POLLOUT) alive = conn_write(c);
+            if (!alive) conn_close(i-1);
+        }
+        if (fds[0].revents & POLLIN) accept_all(listen_fd);
+    }
+
+    print_stats();
+    for (size_t i=conn_count; i>0; i--) conn_close(i-1);
+    close(listen_fd);
+    return 0;
+}
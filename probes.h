@@ -0,0 +1,33 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT probes of the provider "ribezal" for tracing tools like bpftrace, perf or systemtap, e.g.
+//     bpftrace -e 'usdt:./build/ribezal:ribezal:task__poll__exit { @[arg1] = count(); }'
+// A probe is a single nop in the binary until a tracer attaches, so they stay enabled in production.
+// Without <sys/sdt.h> (or with -DNO_PROBES) the probes compile to nothing.
+//
+// task__alloc(id, kind)                 a task was allocated
+// task__free(id, kind)                  a task was given back to the pool
+// task__poll__entry(id, kind)           task_poll starts
+// task__poll__exit(id, kind, state)     task_poll returns with a State
+// curl__transfer__start(id, handle)     a transfer of the easy handle is added to the multi handle or performed
+// curl__transfer__finish(id, code, n)   the transfer ended with a CURLcode after n bytes were received
+// json__parse__start(id, n)             decoding of n bytes of json starts
+// json__parse__finish(id, n, ok)        the decoding ended, ok is 0 if it failed
+
+#if defined(__has_include) && !defined(NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBES_ENABLED
+#endif // __has_include(<sys/sdt.h>)
+#endif // defined(__has_include) && !defined(NO_PROBES)
+
+#ifdef PROBES_ENABLED
+#define PROBE2(name, a, b)    DTRACE_PROBE2(ribezal, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(ribezal, name, a, b, c)
+#else
+#define PROBE2(name, a, b)    do { (void) (a); (void) (b); } while (0)
+#define PROBE3(name, a, b, c) do { (void) (a); (void) (b); (void) (c); } while (0)
+#endif // PROBES_ENABLED
+
+#endif // PROBES_H
@@ -6,15 +6,29 @@
 #include <assert.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
 
 #include "devutils.h"
+#include "probes.h"
 #include "tgapi.h"
 #include "command.h"
+#include "command_hash.h"
 
 // thirdparty
 #include <curl/curl.h>
@@ -60,10 +74,6 @@ typedef struct {
 } Stack_Value;
 
 #define MAX_STACK_SIZE 8
-Stack_Value stack[MAX_STACK_SIZE];
-size_t stack_count = 0;
-
-#define STACK_TOP (stack[stack_count-1])
 
 typedef enum {
     STATE_DONE,
@@ -77,16 +87,43 @@ typedef enum {
     RESULT_KIND_INT,
     RESULT_KIND_STRING_VIEW,
     RESULT_KIND_JSON_VALUE,
+    RESULT_KIND_TG_POLLER,
+    RESULT_KIND_TG_UPDATE_LIST,
+    // the error of a TASK_KIND_TIMEOUT whose body did not finish in time
+    RESULT_KIND_TIMEOUT,
 } Result_Kind;
 
+// State of the long polling loop for one bot token, see task_tg_poll_updates
+typedef struct Tg_Poller Tg_Poller;
+struct Tg_Poller {
+    char *bot_token;
+    // id of the next update to request, all updates before it are confirmed to telegram
+    update_id_t offset;
+    // seconds telegram holds a getUpdates request open when there are no updates
+    int timeout;
+    // number of getUpdates calls in a row that failed
+    unsigned int error_count;
+    // the loop ends, a getUpdates call or backoff that is under way is cancelled
+    bool stopped;
+    // the next getUpdates call goes out before the updates of the current one are processed
+    bool pipelined;
+    // the TASK_KIND_CONTEXT of the current iteration, it is woken when the poller is stopped
+    struct Task *task;
+    Tg_Poller *next;
+};
+
 typedef struct {
     State state;
     Result_Kind kind;
     // possible values
-    bool bool_val;
-    int x;
-    String_View string_view;
-    json_value_t *json_value;
+    union {
+        bool bool_val;
+        int x;
+        String_View string_view;
+        json_value_t *json_value;
+        Tg_Poller *tg_poller;
+        Tg_Update_List *tg_update_list;
+    };
 } Result;
 
 typedef enum {
@@ -94,7 +131,7 @@ typedef enum {
     CONTEXT_KIND_ARENA,
     CONTEXT_KIND_CURL_GLOBAL,
     CONTEXT_KIND_CURL_MULTI,
-    CONTEXT_KIND_CURL_EASY,
+    CONTEXT_KIND_TG_POLLER,
     CONTEXT_KIND_COUNT,
 } Context_Kind;
 
@@ -102,8 +139,10 @@ typedef struct {
     bool flag[CONTEXT_KIND_COUNT];
     Arena *arena;
     CURLM *multi_handle;
-    CURL *easy_handle;
+    // the timer slot of the multi handle, see Waker
+    uint32_t *multi_timer_slot;
     int file_descriptor;
+    Tg_Poller *tg_poller;
 } Context;
 
 typedef enum {
@@ -114,23 +153,131 @@ typedef enum {
     TASK_KIND_OR,
     TASK_KIND_ITERATE,
     TASK_KIND_WAIT,
+    TASK_KIND_TIMEOUT,
     TASK_KIND_FIFO_REPL,
+    TASK_KIND_SESSION,
+    TASK_KIND_LISTEN,
+    TASK_KIND_METRICS_HTTP,
     TASK_KIND_CONTEXT,
-    TASK_KIND_CURL_PERFORM,
-    TASK_KIND_CURL_SETUP,
-    TASK_KIND_PARSE_JSON_VALUE,
-    TASK_KIND_GET_TG_UPDATE_LIST,
+    TASK_KIND_TG_CALL,
+    TASK_KIND_METRICS_DUMP,
+    TASK_KIND_COUNT,
 } Task_Kind;
 
+const char *task_kind_name[] = {
+    [TASK_KIND_PURE]               = "pure",
+    [TASK_KIND_SEQUENCE]           = "sequence",
+    [TASK_KIND_PARALLEL]           = "parallel",
+    [TASK_KIND_AND]                = "and",
+    [TASK_KIND_OR]                 = "or",
+    [TASK_KIND_ITERATE]            = "iterate",
+    [TASK_KIND_WAIT]               = "wait",
+    [TASK_KIND_TIMEOUT]            = "timeout",
+    [TASK_KIND_FIFO_REPL]          = "fifo_repl",
+    [TASK_KIND_SESSION]            = "session",
+    [TASK_KIND_LISTEN]             = "listen",
+    [TASK_KIND_METRICS_HTTP]       = "metrics_http",
+    [TASK_KIND_CONTEXT]            = "context",
+    [TASK_KIND_TG_CALL]            = "tg_call",
+    [TASK_KIND_METRICS_DUMP]       = "metrics_dump",
+};
+static_assert(sizeof(task_kind_name) / sizeof(task_kind_name[0]) == TASK_KIND_COUNT);
+
 typedef struct Task Task;
-typedef Task *(*Then_Function)(Result);
+// Continuations get the Result of the task before and the user data they were created with.
+// The data is not owned by the task, usually it lives in the arena of a surrounding context.
+typedef Task *(*Then_Function)(Result, void *);
 typedef Result (*Result_Function)(Result);
+// Turns the body of a response of the telegram api into the Result of a TASK_KIND_TG_CALL, see task_tg_call.
+// Everything the Result refers to has to live in the arena.
+typedef Result (*Tg_Response_Decoder)(Arena *, String_View, Context *, void *);
 
 #define MAX_SEQ_COUNT 4
-#define MAX_PAR_COUNT 4
+#define PAR_INITIAL_CAPACITY 4
+
+// Intrusive FIFO of tasks that were woken, linked via Task.next_ready
+typedef struct {
+    Task *head;
+    Task *tail;
+} Task_Queue;
+
+typedef struct {
+    Task *task;
+    Context ctx;
+} Par_Entry;
+
+// State of a transfer of TASK_KIND_TG_CALL, it lives in the arena of the request
+typedef struct {
+    // woken when the transfer is finished
+    Task *task;
+    Arena_String_Builder sb;
+    // set while the easy handle is added to the multi handle
+    CURLM *multi_handle;
+    CURL *easy_handle;
+    bool started;
+    bool done;
+    CURLcode code;
+} Curl_Transfer;
+
+// Input of TASK_KIND_FIFO_REPL that is not executed yet.
+// The bytes in [head, count) are a partial line that is carried over to the next read.
+typedef struct {
+    char *items;
+    size_t head;
+    size_t count;
+    size_t capacity;
+    // the rest of a line that was too long is dropped up to the next newline
+    bool discard;
+} Line_Buffer;
+
+// What a reader of the metrics saw at its last report. Every reader keeps its own,
+// so the rates one of them reports do not depend on how often the others read.
+typedef struct {
+    // 0 before the first report
+    uint64_t ms;
+    uint64_t commands;
+} Metrics_Report;
+
+// A client of the repl, either the fifo or a connection to the control socket.
+// Every session has its own stack so clients can not get in the way of each other.
+typedef struct Session Session;
+struct Session {
+    Stack_Value stack[MAX_STACK_SIZE];
+    size_t stack_count;
+    Line_Buffer input;
+    // output of print, help and errors that is not written to fd yet, see session_printf
+    char *reply;
+    size_t reply_count;
+    size_t reply_capacity;
+    // connection of the client, -1 for the fifo whose replies go to stdout
+    int fd;
+    // the task that reads the input, it is woken when the sessions are stopped
+    Task *task;
+    // for the rates of the stats command
+    Metrics_Report stats_report;
+    Session *next;
+};
 
+// Tasks of most kinds only use the first TASK_SMALL_SIZE bytes and are allocated with this size,
+// see task_kind_size_class. Large payloads are kept out of line so the common kinds fit in one cache line.
 struct Task {
-    Task_Kind kind;
+    // a single byte so the flags and the timer slot still fit in front of the payload
+    Task_Kind kind : 8;
+    // the task has to be polled because it is new or something it waits for happened
+    bool woken;
+    // the task is a root of the executor
+    bool spawned;
+    // for the trace: the task was polled at least once
+    bool polled;
+    // index of the task in the subtasks of its parent if that is of kind PARALLEL
+    uint32_t par_slot;
+    // scheduling
+    Task *parent;
+    Task *next_ready;
+    // a number that is unique for the run, for the trace and the probes
+    uint32_t id;
+    // index+1 of the timer of the task in reactor.timers, 0 if it has none
+    uint32_t timer_slot;
     union {
         // TASK_KIND_PURE
         struct {
@@ -139,22 +286,25 @@ struct Task {
         };
         // TASK_KIND_SEQUENCE
         struct {
-            size_t seq_count;
-            size_t seq_index;
+            uint32_t seq_count;
+            uint32_t seq_index;
             Task *seq[MAX_SEQ_COUNT];
         };
         // TASK_KIND_PARALLEL
         struct {
-            size_t par_count;
-            size_t par_index;
-            Task *par[MAX_PAR_COUNT];
-            Context sub_ctx[MAX_PAR_COUNT];
+            uint32_t par_count;
+            uint32_t par_capacity;
+            // each subtask with its own copy of the context
+            Par_Entry *par;
+            // subtasks that were woken since they were polled last
+            Task_Queue par_ready;
         };
         // TASK_KIND_THEN, TASK_KIND_AND, TASK_KIND_OR
         struct {
             Task *fst;
             Task *snd;
             Then_Function then;
+            void *then_data;
         };
         // TASK_KIND_ITERATE
         struct {
@@ -164,6 +314,8 @@ struct Task {
             Result last;
             Then_Function iter_next;
             Then_Function iter_build_condition;
+            // given to both iter_next and iter_build_condition
+            void *iter_data;
         };
         // TASK_KIND_LOG
         struct {
@@ -173,48 +325,340 @@ struct Task {
         struct {
             double duration;
             bool started;
-            time_t start;
+            // point in time on the monotonic clock in milliseconds
+            uint64_t deadline;
         };
-        // TASK_KIND_CONTEXT
+        // TASK_KIND_TIMEOUT
         struct {
-            Context_Kind context_kind;
-            Task *context_body;
-            // Only used if context_kind == CONTEXT_KIND_ARENA
-            Arena context_arena;
+            Task *timeout_body;
+            uint64_t timeout_ms;
+            // point in time on the monotonic clock in milliseconds, 0 until the first poll
+            uint64_t timeout_deadline;
         };
-        // TASK_KIND_CURL_SETUP
+        // TASK_KIND_FIFO_REPL, TASK_KIND_SESSION, TASK_KIND_METRICS_HTTP
         struct {
-            String_View url_setup;
+            Session *repl_session;
+            // events that are registered with the reactor for repl_fd, 0 if none
+            uint32_t repl_events;
+            int repl_fd;
         };
-        // TASK_KIND_CURL_PERFORM
+        // TASK_KIND_LISTEN
         struct {
-            Arena_String_Builder curl_perform_sb;
+            int listen_fd;
+            bool listen_watched;
+            // serves an accepted connection: TASK_KIND_SESSION or TASK_KIND_METRICS_HTTP
+            Task_Kind listen_client_kind;
+            // unix domain socket that is removed at the end, NULL for other sockets
+            const char *listen_path;
+        };
+        // TASK_KIND_CONTEXT
+        struct {
+            Context_Kind context_kind;
+            Task *context_body;
+            union {
+                // Only used if context_kind == CONTEXT_KIND_ARENA
+                Arena context_arena;
+                // Only used if context_kind == CONTEXT_KIND_TG_POLLER
+                Tg_Poller *context_tg_poller;
+            };
         };
-        // TASK_KIND_PARSE_JSON_VALUE
+        // TASK_KIND_TG_CALL
         struct {
-            String_View json_source_str;
+            // owns the url, the transfer, the response and the decoded Result
+            Arena tg_call_arena;
+            String_View tg_call_url;
+            // taken from the pool on the first poll and given back when the transfer is finished
+            CURL *tg_call_easy;
+            // NULL until the first poll
+            Curl_Transfer *tg_call_transfer;
+            Tg_Response_Decoder tg_call_decode;
+            void *tg_call_data;
         };
-        // TASK_KIND_GET_TG_*
+        // TASK_KIND_METRICS_DUMP
         struct {
-            json_value_t *json_root;
+            // point in time on the monotonic clock in milliseconds
+            uint64_t dump_deadline;
+            Metrics_Report dump_report;
         };
     };
 };
 
+#define TASK_SMALL_SIZE 64
+#define TASK_FITS_SMALL(field) static_assert(offsetof(Task, field) + sizeof(((Task *) NULL)->field) <= TASK_SMALL_SIZE, #field)
+TASK_FITS_SMALL(pure_function);
+TASK_FITS_SMALL(par_ready);
+TASK_FITS_SMALL(then_data);
+TASK_FITS_SMALL(deadline);
+TASK_FITS_SMALL(timeout_deadline);
+TASK_FITS_SMALL(repl_events);
+TASK_FITS_SMALL(listen_path);
+TASK_FITS_SMALL(context_arena);
+TASK_FITS_SMALL(dump_deadline);
+TASK_FITS_SMALL(dump_report);
+
+typedef enum {
+    TASK_SIZE_CLASS_SMALL,
+    TASK_SIZE_CLASS_LARGE,
+    TASK_SIZE_CLASS_COUNT,
+} Task_Size_Class;
+
 typedef enum {
     REPLY_CLOSE,
     REPLY_ACK,
     REPLY_ERROR,
+    // the command failed and replied why itself, so retrying is no use
+    REPLY_REFUSED,
 } Reply_Kind;
 
-#define TASK_POOL_CAPACITY 24
-Task task_pool[TASK_POOL_CAPACITY];
+// A task pool is a slab allocator for one size class. It grows by pages of TASK_POOL_PAGE_SIZE bytes that are
+// aligned to their size, so the page of a block is found by masking its address.
+// Each page has its own free list and counts its live blocks. The pages with free blocks are kept in a list,
+// and a page that becomes empty is given back unless the pool would keep fewer free blocks than one page holds.
+#define TASK_POOL_PAGE_SIZE 8192
 typedef struct Task_Free_Node Task_Free_Node;
 struct Task_Free_Node {
     Task_Free_Node *next;
 };
-static_assert(sizeof(Task_Free_Node) <= sizeof(Task));
-Task_Free_Node *task_pool_head = NULL;
+static_assert(sizeof(Task_Free_Node) <= TASK_SMALL_SIZE);
+static_assert(TASK_SMALL_SIZE % _Alignof(Task) == 0);
+typedef struct Task_Pool_Page Task_Pool_Page;
+struct Task_Pool_Page {
+    // all pages of the pool
+    Task_Pool_Page *next;
+    Task_Pool_Page *prev;
+    // pages that have free blocks
+    Task_Pool_Page *next_partial;
+    Task_Pool_Page *prev_partial;
+    // blocks that were given back, the blocks from index fresh on were never handed out
+    Task_Free_Node *head;
+    uint32_t fresh;
+    uint32_t live;
+    // page_capacity blocks of block_size bytes
+    _Alignas(Task) unsigned char blocks[];
+};
+typedef struct {
+    size_t block_size;
+    size_t page_capacity;
+    Task_Pool_Page *pages;
+    Task_Pool_Page *partial;
+    size_t page_count;
+    // blocks that hold a task and the most that did at the same time
+    size_t live;
+    size_t peak;
+    // all pages lie in [lo, hi), see task_in_pool
+    uintptr_t lo;
+    uintptr_t hi;
+} Task_Pool;
+
+#define TASK_POOL_INIT(size) { .block_size = (size), .page_capacity = (TASK_POOL_PAGE_SIZE - sizeof(Task_Pool_Page)) / (size) }
+Task_Pool task_pool[TASK_SIZE_CLASS_COUNT] = {
+    [TASK_SIZE_CLASS_SMALL] = TASK_POOL_INIT(TASK_SMALL_SIZE),
+    [TASK_SIZE_CLASS_LARGE] = TASK_POOL_INIT(sizeof(Task)),
+};
+const char *task_size_class_name[] = {
+    [TASK_SIZE_CLASS_SMALL] = "small",
+    [TASK_SIZE_CLASS_LARGE] = "large",
+};
+static_assert(sizeof(task_size_class_name) / sizeof(task_size_class_name[0]) == TASK_SIZE_CLASS_COUNT);
+
+// Idle easy handles that are kept for the next transfer.
+// curl_easy_reset keeps the connections, the DNS cache and the TLS session cache of a handle,
+// so a reused handle does not have to do the handshakes again.
+#define CURL_EASY_POOL_CAPACITY 16
+typedef struct {
+    CURL *items[CURL_EASY_POOL_CAPACITY];
+    size_t count;
+    // number of acquires that could reuse a handle and that had to create a new one
+    size_t hits;
+    size_t misses;
+} Curl_Easy_Pool;
+
+Curl_Easy_Pool curl_easy_pool = {0};
+
+// Root tasks that were woken and have to be polled by the main loop
+Task_Queue executor_ready = {0};
+
+typedef enum {
+    WAKER_KIND_NONE,
+    WAKER_KIND_TASK,
+    WAKER_KIND_CURL_MULTI,
+} Waker_Kind;
+
+// What the reactor does when a file descriptor becomes ready or a timer expires
+typedef struct {
+    Waker_Kind kind;
+    union {
+        // WAKER_KIND_TASK: the task is woken
+        Task *task;
+        // WAKER_KIND_CURL_MULTI: the transfers of the multi handle are driven with curl_multi_socket_action
+        struct {
+            CURLM *multi_handle;
+            // where the index+1 of its timer is kept, only needed for timers, see context_add_curl_multi
+            uint32_t *multi_timer_slot;
+        };
+    };
+} Waker;
+
+typedef struct {
+    // point in time on the monotonic clock in milliseconds
+    uint64_t deadline;
+    Waker waker;
+} Reactor_Timer;
+
+// The reactor is the place where tasks register what they are waiting for (file descriptors and deadlines).
+// When one of these happens the respective waker fires.
+typedef struct {
+    int epoll_fd;
+    // indexed by file descriptor
+    Waker *watch;
+    size_t watch_capacity;
+    // binary min-heap ordered by deadline
+    Reactor_Timer *timers;
+    size_t timer_count;
+    size_t timer_capacity;
+} Reactor;
+
+Reactor reactor = {
+    .epoll_fd = -1,
+};
+
+typedef enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_COUNT,
+} Log_Level;
+
+const char *log_level_prefix[LOG_LEVEL_COUNT] = {
+    [LOG_LEVEL_DEBUG] = "[DEBUG] ",
+    [LOG_LEVEL_INFO]  = "[INFO] ",
+    [LOG_LEVEL_ERROR] = "[ERROR] ",
+};
+
+// Log lines are collected in memory and written in batches when the main loop has nothing else to do,
+// so tasks never wait for stdout. The server runs on one thread, the ring needs no locking.
+#define LOG_RING_CAPACITY (64*1024)
+static_assert((LOG_RING_CAPACITY & (LOG_RING_CAPACITY - 1)) == 0);
+#define LOG_LINE_MAX_LENGTH 1024
+// DEBUG lines are dropped while more than this many bytes wait to be written,
+// define it as LOG_RING_CAPACITY to keep them as long as there is space
+#ifndef LOG_DEBUG_WATERMARK
+#define LOG_DEBUG_WATERMARK (LOG_RING_CAPACITY / 2)
+#endif // LOG_DEBUG_WATERMARK
+typedef struct {
+    char items[LOG_RING_CAPACITY];
+    // the bytes in [tail, head) are not written yet, both only grow and are taken modulo the capacity
+    size_t head;
+    size_t tail;
+    // number of lines that did not fit since the last flush
+    size_t dropped;
+    int fd;
+    // lines of a lower level are not logged
+    Log_Level level;
+} Log_Ring;
+
+Log_Ring log_ring = {
+    .fd = STDOUT_FILENO,
+    .level = LOG_LEVEL_DEBUG,
+};
+
+// Histograms have buckets for powers of two, so they are cheap to update and cover any range
+#define HISTOGRAM_BUCKET_COUNT 32
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    // buckets[i] counts the values v with 2^(i-1) < v <= 2^i, the last one also all larger values
+    uint64_t buckets[HISTOGRAM_BUCKET_COUNT];
+} Histogram;
+
+// Counters of the runtime, see the stats command.
+// Gauges that are cheap to compute on demand (like the usage of the task pool) are not stored here.
+typedef struct {
+    // tasks that are allocated and their maximum since the start by Task_Kind
+    size_t task_live[TASK_KIND_COUNT];
+    size_t task_peak[TASK_KIND_COUNT];
+    // transfers that are added to a multi handle
+    size_t curl_in_flight;
+    // commands that were executed in all sessions
+    uint64_t commands;
+    // iterations of the main loop and the time it spent polling tasks and waiting for events in microseconds
+    uint64_t loop_iterations;
+    uint64_t poll_us;
+    uint64_t wait_us;
+    // microseconds per poll of the root task
+    Histogram poll_duration;
+    // microseconds per transfer and failed transfers by Tg_Method, the last one is for other urls
+    Histogram http_latency[TG_METHOD_COUNT + 1];
+    uint64_t http_errors[TG_METHOD_COUNT + 1];
+    // microseconds from sending a message to processing its update, telegram only gives seconds
+    Histogram update_lag;
+    // lines that were logged by Log_Level, including the dropped ones
+    uint64_t log_lines[LOG_LEVEL_COUNT];
+    // for the uptime and the rates of the first report, the counters above only grow
+    uint64_t start_ms;
+} Metrics;
+
+Metrics metrics = {0};
+
+#define METRICS_DUMP_INTERVAL_SECS 60
+
+// What happens to every task is recorded so it can be dumped as trace of the Chrome trace event format
+// (chrome://tracing or https://ui.perfetto.dev). Polls nest like the calls of task_poll,
+// so the trace shows where the time of a request went.
+typedef enum {
+    TRACE_ALLOC,
+    TRACE_FIRST_POLL,
+    TRACE_POLL,
+    TRACE_COMPLETE,
+    TRACE_DESTROY,
+} Trace_Phase;
+
+typedef struct {
+    // point in time on the monotonic clock in microseconds, the start for TRACE_POLL
+    uint64_t ts;
+    // TRACE_POLL only
+    uint32_t duration;
+    uint32_t task_id;
+    // 0 if the task has no parent
+    uint32_t parent_id;
+    uint8_t phase;
+    uint8_t kind;
+    uint8_t state;
+} Trace_Event;
+
+// The newest events, older ones are overwritten.
+// Recording reads the clock several times per task, so it is off until the trace command
+// or RIBEZAL_TRACE in the environment turns it on.
+#define TRACE_RING_CAPACITY (64*1024)
+#define TRACE_FILE_NAME "ribezal-trace.json"
+#define TRACE_ENV "RIBEZAL_TRACE"
+typedef struct {
+    bool enabled;
+    Trace_Event events[TRACE_RING_CAPACITY];
+    // number of events that were recorded since the start
+    size_t count;
+    uint32_t last_task_id;
+} Trace_Ring;
+
+Trace_Ring trace = {0};
+
+// The session of the fifo, its stack is printed when the server finishes
+Session console = {
+    .fd = -1,
+};
+// The session whose commands are executed, the stack_* functions work on its stack
+Session *session = &console;
+// Connections to the control socket
+Session *sessions = NULL;
+// Set by the quit command, the repls, the listener and the metrics dump end when they are polled next
+bool sessions_stopped = false;
+// Tasks of kind TASK_KIND_LISTEN and TASK_KIND_METRICS_DUMP, they are woken when the sessions are stopped
+#define MAX_LISTENERS 4
+Task *listeners[MAX_LISTENERS] = {0};
+size_t listener_count = 0;
+Task *metrics_dumper = NULL;
+
+#define STACK_TOP (session->stack[session->stack_count-1])
 
 /******************************
  * functions                  *
@@ -254,6 +698,11 @@ String_View string_view_from_char_ptr(char *ptr) {
     return result;
 }
 
+bool string_view_eq_cstr(String_View sv, const char *cstr) {
+    size_t n = strlen(cstr);
+    return sv.count == n && strncmp(sv.str, cstr, n) == 0;
+}
+
 String_View string_view_from_json_string(json_string_t *str) {
     String_View result = {
         .str = str->string,
@@ -344,11 +793,15 @@ String_View percent_encode(Arena *a, String_View in) {
     return string_view_from_arena_string_builder(sb);
 }
 
+// The base of every api url, RIBEZAL_API_URL in the environment replaces it, e.g. with build/mock-tg for load tests
+#define URL_PREFIX_ENV "RIBEZAL_API_URL"
+const char *url_prefix = URL_PREFIX;
+
 #define THUMBS_UP_SERIALIZED "[ { \"type\": \"emoji\", \"emoji\" : \"\U0001f44d\" } ]"
 
 String_View build_url(Arena *a, Tg_Method_Call *call) {
     Arena_String_Builder sb = {0};
-    arena_sb_append_cstr(a, &sb, URL_PREFIX);
+    arena_sb_append_cstr(a, &sb, url_prefix);
     arena_sb_append_cstr(a, &sb, call->bot_token);
     arena_sb_append_cstr(a, &sb, "/");
 
@@ -358,6 +811,10 @@ String_View build_url(Arena *a, Tg_Method_Call *call) {
             break;
         case GET_UPDATES:
             arena_sb_append_cstr(a, &sb, "getUpdates");
+            if (call->offset != 0 || call->timeout != 0) {
+                char *params_str = arena_sprintf(a, "?offset=%d&timeout=%d", call->offset, call->timeout);
+                arena_sb_append_cstr(a, &sb, params_str);
+            }
             break;
         case SEND_MESSAGE:
             {
@@ -394,10 +851,138 @@ String_View build_url(Arena *a, Tg_Method_Call *call) {
                 arena_free(&temp);
                 break;
             }
+        case TG_METHOD_COUNT:
+            UNREACHABLE("TG_METHOD_COUNT is not a valid Tg_Method");
     };
     return string_view_from_arena_string_builder(sb);
 }
 
+/******************************
+ * log_*                      *
+ ******************************/
+
+size_t log_ring_count() {
+    return log_ring.head - log_ring.tail;
+}
+
+// Appends the bytes as a whole or not at all
+bool log_append(const char *data, size_t count) {
+    if (count > LOG_RING_CAPACITY - log_ring_count()) {
+        log_ring.dropped++;
+        return false;
+    }
+    size_t start = log_ring.head & (LOG_RING_CAPACITY - 1);
+    size_t first = LOG_RING_CAPACITY - start < count ? LOG_RING_CAPACITY - start : count;
+    memcpy(log_ring.items + start, data, first);
+    memcpy(log_ring.items, data + first, count - first);
+    log_ring.head += count;
+    return true;
+}
+
+// Like printf with the prefix of the level, lines longer than LOG_LINE_MAX_LENGTH are cut
+CHECK_PRINTF_FMT(2, 0) void log_vprintf(Log_Level level, const char *fmt, va_list args) {
+    if (level < log_ring.level) return;
+    metrics.log_lines[level]++;
+    if (level == LOG_LEVEL_DEBUG && log_ring_count() > LOG_DEBUG_WATERMARK) {
+        log_ring.dropped++;
+        return;
+    }
+    char line[LOG_LINE_MAX_LENGTH];
+    size_t prefix = strlen(log_level_prefix[level]);
+    memcpy(line, log_level_prefix[level], prefix);
+    int n = vsnprintf(line + prefix, sizeof(line) - prefix, fmt, args);
+    if (n < 0) return;
+    size_t count = prefix + n;
+    if (count >= sizeof(line)) {
+        count = sizeof(line) - 1;
+        line[count - 1] = '\n';
+    }
+    log_append(line, count);
+}
+
+CHECK_PRINTF_FMT(2, 3) void log_printf(Log_Level level, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    log_vprintf(level, fmt, args);
+    va_end(args);
+}
+
+// Writes everything that is collected, the main loop calls this before it waits for events
+void log_flush() {
+    if (log_ring.dropped > 0) {
+        size_t dropped = log_ring.dropped;
+        log_ring.dropped = 0;
+        char line[64];
+        int n = snprintf(line, sizeof(line), "[ERROR] dropped %zu log lines\n", dropped);
+        if (!log_append(line, n)) log_ring.dropped = dropped;
+    }
+    while (log_ring_count() > 0) {
+        size_t start = log_ring.tail & (LOG_RING_CAPACITY - 1);
+        size_t count = LOG_RING_CAPACITY - start < log_ring_count() ? LOG_RING_CAPACITY - start : log_ring_count();
+        ssize_t n = write(log_ring.fd, log_ring.items + start, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            // there is no place left to report this
+            log_ring.tail = log_ring.head;
+            return;
+        }
+        log_ring.tail += n;
+    }
+}
+
+// abort() raises SIGABRT, so the lines that lead up to a failed assert, UNREACHABLE or UNIMPLEMENTED
+// are written before the process ends. When the handler returns abort() ends the process as usual.
+void log_flush_on_abort(int sig) {
+    UNUSED(sig);
+    log_flush();
+}
+
+bool log_init() {
+    struct sigaction action = {0};
+    action.sa_handler = log_flush_on_abort;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGABRT, &action, NULL) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Could not install the handler for SIGABRT: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/******************************
+ * session output             *
+ ******************************/
+
+// Replies to the client of the current session.
+// The output is collected in the session until it can be written, the fifo replies through the log.
+CHECK_PRINTF_FMT(1, 2) void session_printf(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    if (session->fd < 0) {
+        char line[LOG_LINE_MAX_LENGTH];
+        int n = vsnprintf(line, sizeof(line), fmt, args);
+        va_end(args);
+        if (n > 0) log_append(line, (size_t) n < sizeof(line) ? (size_t) n : sizeof(line) - 1);
+        return;
+    }
+    va_list args_copy;
+    va_copy(args_copy, args);
+    int n = vsnprintf(NULL, 0, fmt, args_copy);
+    va_end(args_copy);
+    assert(n >= 0);
+    if (session->reply_count + n + 1 > session->reply_capacity) {
+        size_t capacity = session->reply_capacity == 0 ? 256 : session->reply_capacity;
+        while (session->reply_count + n + 1 > capacity) capacity *= 2;
+        session->reply = realloc(session->reply, capacity);
+        assert(session->reply != NULL);
+        session->reply_capacity = capacity;
+    }
+    vsnprintf(session->reply + session->reply_count, n + 1, fmt, args);
+    session->reply_count += n;
+    va_end(args);
+}
+
 /******************************
  * stack_*                    *
  ******************************/
@@ -407,22 +992,22 @@ void stack_push_string(String_View sv) {
     strncpy(ptr, sv.str, sv.count);
     ptr[sv.count] = '\0';
 
-    assert(stack_count < MAX_STACK_SIZE);
-    stack[stack_count].kind  = STACK_VALUE_STRING;
-    stack[stack_count].str   = ptr;
-    stack[stack_count].count = sv.count;
-    stack_count++;
+    assert(session->stack_count < MAX_STACK_SIZE);
+    session->stack[session->stack_count].kind  = STACK_VALUE_STRING;
+    session->stack[session->stack_count].str   = ptr;
+    session->stack[session->stack_count].count = sv.count;
+    session->stack_count++;
 }
 
 void stack_push_int(int x) {
-    assert(stack_count < MAX_STACK_SIZE);
-    stack[stack_count].kind = STACK_VALUE_INT;
-    stack[stack_count].x = x;
-    stack_count++;
+    assert(session->stack_count < MAX_STACK_SIZE);
+    session->stack[session->stack_count].kind = STACK_VALUE_INT;
+    session->stack[session->stack_count].x = x;
+    session->stack_count++;
 }
 
 void stack_drop() {
-    if (stack_count == 0) return;
+    if (session->stack_count == 0) return;
     switch (STACK_TOP.kind) {
         case STACK_VALUE_STRING:
             free(STACK_TOP.str);
@@ -430,731 +1015,3263 @@ void stack_drop() {
         case STACK_VALUE_INT:
             break;
     }
-    stack_count--;
+    session->stack_count--;
 }
 
 bool stack_int() {
-    if (stack_count < 1) return false;
+    if (session->stack_count < 1) return false;
     return STACK_TOP.kind == STACK_VALUE_INT;
 }
 
 bool stack_string() {
-    if (stack_count < 1) return false;
-    size_t i = stack_count-1;
-    return stack[i].kind == STACK_VALUE_STRING;
+    if (session->stack_count < 1) return false;
+    size_t i = session->stack_count-1;
+    return session->stack[i].kind == STACK_VALUE_STRING;
 }
 
 bool stack_two_int() {
-    if (stack_count < 2) return false;
-    size_t i1 = stack_count-1;
-    size_t i2 = stack_count-2;
-    return (stack[i1].kind == STACK_VALUE_INT) && (stack[i2].kind == STACK_VALUE_INT);
+    if (session->stack_count < 2) return false;
+    size_t i1 = session->stack_count-1;
+    size_t i2 = session->stack_count-2;
+    return (session->stack[i1].kind == STACK_VALUE_INT) && (session->stack[i2].kind == STACK_VALUE_INT);
 }
 
 void stack_print() {
-    printf("[");
-    for (size_t i=0; i+1<stack_count; i++) {
-        switch (stack[i].kind) {
-            case STACK_VALUE_STRING: printf("%.*s, ", (int) stack[i].count, stack[i].str); break;
-            case STACK_VALUE_INT:    printf("%d, ", stack[i].x); break;
+    session_printf("[");
+    for (size_t i=0; i+1<session->stack_count; i++) {
+        switch (session->stack[i].kind) {
+            case STACK_VALUE_STRING: session_printf("%.*s, ", (int) session->stack[i].count, session->stack[i].str); break;
+            case STACK_VALUE_INT:    session_printf("%d, ", session->stack[i].x); break;
         }
     }
-    if (stack_count > 0) {
-        size_t i = stack_count-1;
-        switch (stack[i].kind) {
-            case STACK_VALUE_STRING: printf("%.*s", (int) stack[i].count, stack[i].str); break;
-            case STACK_VALUE_INT:    printf("%d", stack[i].x); break;
+    if (session->stack_count > 0) {
+        size_t i = session->stack_count-1;
+        switch (session->stack[i].kind) {
+            case STACK_VALUE_STRING: session_printf("%.*s", (int) session->stack[i].count, session->stack[i].str); break;
+            case STACK_VALUE_INT:    session_printf("%d", session->stack[i].x); break;
         }
     }
-    printf("]\n");
+    session_printf("]\n");
 }
 
-#define FIFO_NAME "input-fifo"
+/******************************
+ * task_queue_*               *
+ ******************************/
 
-int make_and_open_fifo() {
-    if (mkfifo(FIFO_NAME, 0666) < 0) {
-        printf("[ERROR] Could not make fifo '%s': %s\n", FIFO_NAME, strerror(errno));
-        return -1;
-    }
-    int fd = open(FIFO_NAME, O_RDONLY | O_NONBLOCK);
-    if (fd < 0) {
-        printf("[ERROR] Could not open file '%s': %s\n", FIFO_NAME, strerror(errno));
-        return -1;
+void task_queue_push(Task_Queue *q, Task *t) {
+    t->next_ready = NULL;
+    if (q->tail == NULL) {
+        q->head = t;
+    } else {
+        q->tail->next_ready = t;
     }
-    return fd;
+    q->tail = t;
 }
 
-bool close_and_unlink_fifo(int fd) {
-    if (close(fd) < 0) {
-        printf("[ERROR] Could not close file: %s\n", strerror(errno));
-        return false;
-    }
-    if (unlink(FIFO_NAME) < 0) {
-        printf("[ERROR] Could not unlink file: %s\n", strerror(errno));
-        return false;
+Task *task_queue_pop(Task_Queue *q) {
+    Task *t = q->head;
+    if (t == NULL) return NULL;
+    q->head = t->next_ready;
+    if (q->head == NULL) q->tail = NULL;
+    t->next_ready = NULL;
+    return t;
+}
+
+void task_queue_remove(Task_Queue *q, Task *t) {
+    Task *prev = NULL;
+    for (Task *cur = q->head; cur != NULL; prev = cur, cur = cur->next_ready) {
+        if (cur != t) continue;
+        if (prev == NULL) {
+            q->head = cur->next_ready;
+        } else {
+            prev->next_ready = cur->next_ready;
+        }
+        if (q->tail == cur) q->tail = prev;
+        cur->next_ready = NULL;
+        return;
     }
-    return true;
 }
 
 /******************************
- * result_*                   *
+ * waker                      *
  ******************************/
 
-#define RESULT_DONE    (Result) {.state = STATE_DONE,    .kind = RESULT_KIND_VOID}
-#define RESULT_PENDING (Result) {.state = STATE_PENDING, .kind = RESULT_KIND_VOID}
-#define RESULT_ERROR   (Result) {.state = STATE_ERROR,   .kind = RESULT_KIND_VOID}
+// Marks t as ready to be polled.
+// This is passed on to the ancestors until one is reached that is already woken:
+// a task of kind PARALLEL remembers which of its subtasks were woken and a root is queued in the executor.
+void task_wake(Task *t) {
+    while (t != NULL && !t->woken) {
+        t->woken = true;
+        Task *p = t->parent;
+        if (p == NULL) {
+            if (t->spawned) task_queue_push(&executor_ready, t);
+        } else if (p->kind == TASK_KIND_PARALLEL) {
+            task_queue_push(&p->par_ready, t);
+        }
+        t = p;
+    }
+}
 
-Result result_bool(bool b) {
-    Result r = RESULT_DONE;
-    r.kind = RESULT_KIND_BOOL;
-    r.bool_val = b;
-    return r;
+// Makes child a subtask of parent which is polled next.
+// New tasks are woken so they get their first poll once their parent is woken as well.
+void task_attach(Task *parent, Task *child) {
+    child->parent = parent;
+    child->woken = false;
+    task_wake(child);
 }
 
-Result result_int(int x) {
-    Result r = RESULT_DONE;
-    r.kind = RESULT_KIND_INT;
-    r.x = x;
-    return r;
+void executor_spawn(Task *t) {
+    t->parent = NULL;
+    t->spawned = true;
+    t->woken = false;
+    task_wake(t);
 }
 
-Result result_string_view(String_View sv) {
-    Result r = RESULT_DONE;
-    r.kind = RESULT_KIND_STRING_VIEW;
-    r.string_view = sv;
-    return r;
+/******************************
+ * reactor_*                  *
+ ******************************/
+
+uint64_t time_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
 }
 
-Result result_err_string_view(String_View sv) {
-    Result r = RESULT_ERROR;
-    r.kind = RESULT_KIND_STRING_VIEW;
-    r.string_view = sv;
-    return r;
+uint64_t time_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
 }
 
-Result result_json_value(json_value_t *val) {
-    Result r = RESULT_DONE;
-    r.kind = RESULT_KIND_JSON_VALUE;
-    r.json_value = val;
-    return r;
+bool reactor_init() {
+    reactor.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor.epoll_fd < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Could not create epoll instance: %s\n", strerror(errno));
+        return false;
+    }
+    reactor.timer_count = 0;
+    return true;
 }
 
-Result result_const(Result r) {
-    return r;
+void reactor_close() {
+    if (reactor.epoll_fd >= 0 && close(reactor.epoll_fd) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Could not close epoll instance: %s\n", strerror(errno));
+    }
+    reactor.epoll_fd = -1;
+    free(reactor.watch);
+    reactor.watch = NULL;
+    reactor.watch_capacity = 0;
+    free(reactor.timers);
+    reactor.timers = NULL;
+    reactor.timer_count = 0;
+    reactor.timer_capacity = 0;
 }
 
-/******************************
- * context_*                  *
- ******************************/
+Waker waker_task(Task *t) {
+    Waker w = {
+        .kind = WAKER_KIND_TASK,
+        .task = t,
+    };
+    return w;
+}
 
-Context context_new() {
-    Context c = {
-        .multi_handle = NULL,
-        .easy_handle = NULL,
-        .arena = NULL,
-        .file_descriptor = -1,
+// timer_slot may be NULL if the waker is only used for file descriptors
+Waker waker_curl_multi(CURLM *multi_handle, uint32_t *timer_slot) {
+    Waker w = {
+        .kind = WAKER_KIND_CURL_MULTI,
+        .multi_handle = multi_handle,
+        .multi_timer_slot = timer_slot,
     };
-    for (size_t i=0; i<CONTEXT_KIND_COUNT; i++) {
-        c.flag[i] = false;
-    }
-    return c;
+    return w;
 }
 
-bool context_is_empty(Context *c) {
-    for (size_t i=0; i<CONTEXT_KIND_COUNT; i++) {
-        if (c->flag[i]) return false;
+// Where the position of the timer of w in the heap is kept, so it is found without a search
+uint32_t *waker_timer_slot(Waker w) {
+    switch (w.kind) {
+        case WAKER_KIND_NONE:
+            UNREACHABLE("WAKER_KIND_NONE has no timer");
+        case WAKER_KIND_TASK:
+            return &w.task->timer_slot;
+        case WAKER_KIND_CURL_MULTI:
+            assert(w.multi_timer_slot != NULL);
+            return w.multi_timer_slot;
     }
-    return true;
+    UNREACHABLE("invalid Waker_Kind");
 }
 
-void context_add_fifo(Context *c) {
-    c->flag[CONTEXT_KIND_FIFO] = true;
-    c->file_descriptor = make_and_open_fifo();
+bool waker_eq(Waker a, Waker b) {
+    if (a.kind != b.kind) return false;
+    switch (a.kind) {
+        case WAKER_KIND_NONE:       return true;
+        case WAKER_KIND_TASK:       return a.task == b.task;
+        case WAKER_KIND_CURL_MULTI: return a.multi_handle == b.multi_handle;
+    }
+    UNREACHABLE("invalid Waker_Kind");
 }
 
-bool context_remove_fifo(Context *c) {
-    bool success = close_and_unlink_fifo(c->file_descriptor);
-    c->flag[CONTEXT_KIND_FIFO] = false;
-    return success;
+// Registers fd with the given epoll events, w fires when one of them occurs.
+// If fd is already registered its events are replaced, which also rearms it when EPOLLONESHOT is used.
+bool reactor_watch_fd(int fd, uint32_t events, Waker w) {
+    assert(reactor.epoll_fd >= 0);
+    assert(fd >= 0);
+    if ((size_t) fd >= reactor.watch_capacity) {
+        size_t capacity = reactor.watch_capacity == 0 ? 16 : reactor.watch_capacity;
+        while (capacity <= (size_t) fd) capacity *= 2;
+        reactor.watch = realloc(reactor.watch, capacity * sizeof(Waker));
+        assert(reactor.watch != NULL);
+        memset(reactor.watch + reactor.watch_capacity, 0, (capacity - reactor.watch_capacity) * sizeof(Waker));
+        reactor.watch_capacity = capacity;
+    }
+    reactor.watch[fd] = w;
+
+    struct epoll_event ev = {
+        .events = events,
+        .data.fd = fd,
+    };
+    if (epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0) return true;
+    if (errno == EEXIST && epoll_ctl(reactor.epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0) return true;
+    log_printf(LOG_LEVEL_ERROR, "Could not watch file descriptor %d: %s\n", fd, strerror(errno));
+    return false;
 }
 
-void context_add_curl_global(Context *c) {
-    CURLcode r = curl_global_init(CURL_GLOBAL_DEFAULT);
-    if (r != 0) {
-        UNIMPLEMENTED("context_add_curl_global");
+bool reactor_unwatch_fd(int fd) {
+    assert(reactor.epoll_fd >= 0);
+    if ((size_t) fd < reactor.watch_capacity) reactor.watch[fd].kind = WAKER_KIND_NONE;
+    // closing a file descriptor already removes it from epoll
+    if (epoll_ctl(reactor.epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0 && errno != EBADF && errno != ENOENT) {
+        log_printf(LOG_LEVEL_ERROR, "Could not unwatch file descriptor %d: %s\n", fd, strerror(errno));
+        return false;
     }
-    c->flag[CONTEXT_KIND_CURL_GLOBAL] = true;
+    return true;
 }
 
-void context_remove_curl_global(Context *c) {
-    curl_global_cleanup();
-    c->flag[CONTEXT_KIND_CURL_GLOBAL] = false;
+void reactor_timer_swap(size_t i, size_t j) {
+    Reactor_Timer tmp = reactor.timers[i];
+    reactor.timers[i] = reactor.timers[j];
+    reactor.timers[j] = tmp;
+    *waker_timer_slot(reactor.timers[i].waker) = i + 1;
+    *waker_timer_slot(reactor.timers[j].waker) = j + 1;
 }
 
-void context_add_curl_multi(Context *c) {
-    c->multi_handle = curl_multi_init();
-    if (c->multi_handle == NULL) {
-        UNIMPLEMENTED("context_add_curl_multi");
+void reactor_timer_sift_up(size_t i) {
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (reactor.timers[parent].deadline <= reactor.timers[i].deadline) break;
+        reactor_timer_swap(i, parent);
+        i = parent;
     }
-    c->flag[CONTEXT_KIND_CURL_MULTI] = true;
 }
 
-void context_remove_curl_multi(Context *c) {
-    CURLMcode code = curl_multi_cleanup(c->multi_handle);
-    if (code != CURLM_OK) {
-        UNIMPLEMENTED("context_remove_curl_multi");
+void reactor_timer_sift_down(size_t i) {
+    while (true) {
+        size_t min = i;
+        size_t l = 2*i + 1;
+        size_t r = 2*i + 2;
+        if (l < reactor.timer_count && reactor.timers[l].deadline < reactor.timers[min].deadline) min = l;
+        if (r < reactor.timer_count && reactor.timers[r].deadline < reactor.timers[min].deadline) min = r;
+        if (min == i) break;
+        reactor_timer_swap(i, min);
+        i = min;
     }
-    c->flag[CONTEXT_KIND_CURL_MULTI] = false;
 }
 
-void context_add_curl_easy(Context *c) {
-    c->flag[CONTEXT_KIND_CURL_EASY] = true;
-    c->easy_handle = curl_easy_init();
-    assert(c->easy_handle != NULL);
+void reactor_timer_remove_at(size_t i) {
+    assert(i < reactor.timer_count);
+    *waker_timer_slot(reactor.timers[i].waker) = 0;
+    reactor.timer_count--;
+    if (i == reactor.timer_count) return;
+    reactor.timers[i] = reactor.timers[reactor.timer_count];
+    *waker_timer_slot(reactor.timers[i].waker) = i + 1;
+    reactor_timer_sift_down(i);
+    reactor_timer_sift_up(i);
 }
 
-void context_remove_curl_easy(Context *c) {
-    curl_easy_cleanup(c->easy_handle);
-    c->flag[CONTEXT_KIND_CURL_EASY] = false;
+// Removes the timer of w if there is one.
+void reactor_cancel_timer(Waker w) {
+    uint32_t slot = *waker_timer_slot(w);
+    if (slot == 0) return;
+    assert(slot <= reactor.timer_count && waker_eq(reactor.timers[slot-1].waker, w));
+    reactor_timer_remove_at(slot - 1);
 }
 
-void context_add_arena(Context *c, Arena *a) {
-    assert(a != NULL);
-    c->arena = a;
-    c->flag[CONTEXT_KIND_ARENA] = true;
+// Fires w at the given deadline. Every waker has at most one timer, an earlier one is replaced.
+void reactor_set_timer(Waker w, uint64_t deadline) {
+    uint32_t *slot = waker_timer_slot(w);
+    if (*slot > 0) {
+        size_t i = *slot - 1;
+        assert(i < reactor.timer_count && waker_eq(reactor.timers[i].waker, w));
+        reactor.timers[i].deadline = deadline;
+        reactor_timer_sift_down(i);
+        reactor_timer_sift_up(i);
+        return;
+    }
+    if (reactor.timer_count >= reactor.timer_capacity) {
+        reactor.timer_capacity = reactor.timer_capacity == 0 ? 16 : 2*reactor.timer_capacity;
+        reactor.timers = realloc(reactor.timers, reactor.timer_capacity * sizeof(Reactor_Timer));
+        assert(reactor.timers != NULL);
+    }
+    reactor.timers[reactor.timer_count] = (Reactor_Timer) {
+        .deadline = deadline,
+        .waker = w,
+    };
+    reactor.timer_count++;
+    *slot = reactor.timer_count;
+    reactor_timer_sift_up(reactor.timer_count - 1);
 }
 
-void context_remove_arena(Context *c) {
-    arena_free(c->arena);
-    c->flag[CONTEXT_KIND_ARENA] = false;
+void reactor_wake_at(Task *t, uint64_t deadline) {
+    reactor_set_timer(waker_task(t), deadline);
+}
+
+// Must be called before t is destroyed so the reactor does not wake it afterwards.
+// fd is the file descriptor t watches, -1 if it does not watch one.
+void reactor_forget(Task *t, int fd) {
+    Waker w = waker_task(t);
+    reactor_cancel_timer(w);
+    if (fd >= 0 && (size_t) fd < reactor.watch_capacity && waker_eq(reactor.watch[fd], w)) {
+        reactor.watch[fd].kind = WAKER_KIND_NONE;
+    }
 }
 
 /******************************
- * task_*                     *
+ * curl multi socket driver   *
  ******************************/
 
-void task_free_all() {
-    task_pool_head = NULL;
-    for (size_t i=0; i<TASK_POOL_CAPACITY; i++) {
-        Task_Free_Node *cur = (Task_Free_Node *) &task_pool[i];
-        cur->next = task_pool_head;
-        task_pool_head = cur;
+// Wakes the tasks whose transfers are finished.
+void curl_multi_check_info(CURLM *multi_handle) {
+    int msgs_left;
+    CURLMsg *msg;
+    while ((msg = curl_multi_info_read(multi_handle, &msgs_left)) != NULL) {
+        if (msg->msg != CURLMSG_DONE) continue;
+        char *priv = NULL;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+        Curl_Transfer *transfer = (Curl_Transfer *) priv;
+        assert(transfer != NULL);
+        transfer->done = true;
+        transfer->code = msg->data.result;
+        task_wake(transfer->task);
     }
-    assert(task_pool_head != NULL);
 }
 
-bool task_in_pool(Task *t) {
-    return task_pool <= t && t < task_pool + TASK_POOL_CAPACITY;
+// fd is CURL_SOCKET_TIMEOUT when the timer of the multi handle expired
+void curl_multi_drive(CURLM *multi_handle, int fd, uint32_t events) {
+    int ev_bitmask = 0;
+    if (events & EPOLLIN)  ev_bitmask |= CURL_CSELECT_IN;
+    if (events & EPOLLOUT) ev_bitmask |= CURL_CSELECT_OUT;
+    if (events & EPOLLERR) ev_bitmask |= CURL_CSELECT_ERR;
+    int running_handles;
+    CURLMcode mcode = curl_multi_socket_action(multi_handle, fd, ev_bitmask, &running_handles);
+    if (mcode != CURLM_OK) {
+        log_printf(LOG_LEVEL_ERROR, "failed curl_multi_socket_action: %s\n", curl_multi_strerror(mcode));
+    }
+    curl_multi_check_info(multi_handle);
 }
 
-Task *task_alloc() {
-    Task_Free_Node *cur = task_pool_head;
-    if (cur == NULL) {
-        UNIMPLEMENTED("alloc_task");
+// CURLMOPT_SOCKETFUNCTION: curl tells us which events it waits for on a socket
+int curl_socket_cb(CURL *easy_handle, curl_socket_t s, int what, void *userp, void *socketp) {
+    UNUSED(easy_handle);
+    UNUSED(socketp);
+    CURLM *multi_handle = userp;
+    uint32_t events = 0;
+    switch (what) {
+        case CURL_POLL_IN:
+            events = EPOLLIN;
+            break;
+        case CURL_POLL_OUT:
+            events = EPOLLOUT;
+            break;
+        case CURL_POLL_INOUT:
+            events = EPOLLIN | EPOLLOUT;
+            break;
+        case CURL_POLL_REMOVE:
+            reactor_unwatch_fd(s);
+            return 0;
+        default:
+            UNREACHABLE("invalid value for what in curl_socket_cb");
     }
-    task_pool_head = cur->next;
-    return (Task *) cur;
+    if (!reactor_watch_fd(s, events, waker_curl_multi(multi_handle, NULL))) return -1;
+    return 0;
 }
 
-void task_free(Task *t) {
-    if (t == NULL) return;
-
-    //make sure t is actually in the task pool and does not come from somewhere else
-    assert(task_in_pool(t));
-
-    Task_Free_Node *tfree = (Task_Free_Node *) t;
-    tfree->next = task_pool_head;
-    task_pool_head = tfree;
+// CURLMOPT_TIMERFUNCTION: curl wants curl_multi_socket_action(CURL_SOCKET_TIMEOUT) to be called after timeout_ms
+int curl_timer_cb(CURLM *multi_handle, long timeout_ms, void *userp) {
+    Waker w = waker_curl_multi(multi_handle, userp);
+    if (timeout_ms < 0) {
+        reactor_cancel_timer(w);
+    } else {
+        reactor_set_timer(w, time_now_ms() + timeout_ms);
+    }
+    return 0;
 }
 
+void waker_fire(Waker w, int fd, uint32_t events) {
+    switch (w.kind) {
+        case WAKER_KIND_NONE:
+            return;
+        case WAKER_KIND_TASK:
+            task_wake(w.task);
+            return;
+        case WAKER_KIND_CURL_MULTI:
+            curl_multi_drive(w.multi_handle, fd, events);
+            return;
+    }
+    UNREACHABLE("invalid Waker_Kind");
+}
+
+#define REACTOR_MAX_EVENTS 64
+
+// Blocks until a watched file descriptor becomes ready or the earliest timer expired and fires the respective wakers.
+void reactor_wait() {
+    int timeout = -1;
+    if (reactor.timer_count > 0) {
+        uint64_t now = time_now_ms();
+        uint64_t deadline = reactor.timers[0].deadline;
+        timeout = deadline > now ? (int) (deadline - now) : 0;
+    }
+
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int n = epoll_wait(reactor.epoll_fd, events, REACTOR_MAX_EVENTS, timeout);
+    if (n < 0 && errno != EINTR) {
+        log_printf(LOG_LEVEL_ERROR, "Could not wait for events: %s\n", strerror(errno));
+    }
+    for (int i=0; i<n; i++) {
+        int fd = events[i].data.fd;
+        if ((size_t) fd < reactor.watch_capacity) waker_fire(reactor.watch[fd], fd, events[i].events);
+    }
+
+    // Firing a waker may set new timers that are already expired (e.g. curl likes timeouts of 0ms).
+    // Only the timers that existed before are fired here, the others on the next call.
+    uint64_t now = time_now_ms();
+    size_t limit = reactor.timer_count;
+    for (size_t i=0; i<limit && reactor.timer_count > 0 && reactor.timers[0].deadline <= now; i++) {
+        Waker w = reactor.timers[0].waker;
+        reactor_timer_remove_at(0);
+        waker_fire(w, CURL_SOCKET_TIMEOUT, 0);
+    }
+}
+
+#define FIFO_NAME "input-fifo"
+
+int make_and_open_fifo() {
+    if (mkfifo(FIFO_NAME, 0666) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Could not make fifo '%s': %s\n", FIFO_NAME, strerror(errno));
+        return -1;
+    }
+    // We open the fifo for writing as well so there is always a writer.
+    // Otherwise the fifo reports EOF (and epoll EPOLLHUP) permanently after the first writer closed it.
+    int fd = open(FIFO_NAME, O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Could not open file '%s': %s\n", FIFO_NAME, strerror(errno));
+        return -1;
+    }
+    return fd;
+}
+
+bool close_and_unlink_fifo(int fd) {
+    if (close(fd) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Could not close file: %s\n", strerror(errno));
+        return false;
+    }
+    if (unlink(FIFO_NAME) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Could not unlink file: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+#define CONTROL_SOCKET_NAME "control-socket"
+#define CONTROL_SOCKET_BACKLOG 16
+
+int control_socket_open() {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Could not create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    static_assert(sizeof(CONTROL_SOCKET_NAME) <= sizeof(addr.sun_path));
+    strcpy(addr.sun_path, CONTROL_SOCKET_NAME);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Could not bind socket '%s': %s\n", CONTROL_SOCKET_NAME, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, CONTROL_SOCKET_BACKLOG) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Could not listen on socket '%s': %s\n", CONTROL_SOCKET_NAME, strerror(errno));
+        close(fd);
+        unlink(CONTROL_SOCKET_NAME);
+        return -1;
+    }
+    return fd;
+}
+
+#define METRICS_HTTP_PORT 9464
+
+// Prometheus scrapes /metrics on this port, it is only reachable from localhost
+int metrics_http_open() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Could not create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(METRICS_HTTP_PORT),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Could not bind port %d: %s\n", METRICS_HTTP_PORT, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, CONTROL_SOCKET_BACKLOG) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Could not listen on port %d: %s\n", METRICS_HTTP_PORT, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool listen_socket_close(int fd, const char *path) {
+    if (close(fd) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Could not close socket: %s\n", strerror(errno));
+        return false;
+    }
+    if (path != NULL && unlink(path) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Could not unlink file: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/******************************
+ * result_*                   *
+ ******************************/
+
+#define RESULT_DONE    (Result) {.state = STATE_DONE,    .kind = RESULT_KIND_VOID}
+#define RESULT_PENDING (Result) {.state = STATE_PENDING, .kind = RESULT_KIND_VOID}
+#define RESULT_ERROR   (Result) {.state = STATE_ERROR,   .kind = RESULT_KIND_VOID}
+#define RESULT_TIMEOUT (Result) {.state = STATE_ERROR,   .kind = RESULT_KIND_TIMEOUT}
+
+Result result_bool(bool b) {
+    Result r = RESULT_DONE;
+    r.kind = RESULT_KIND_BOOL;
+    r.bool_val = b;
+    return r;
+}
+
+Result result_int(int x) {
+    Result r = RESULT_DONE;
+    r.kind = RESULT_KIND_INT;
+    r.x = x;
+    return r;
+}
+
+Result result_string_view(String_View sv) {
+    Result r = RESULT_DONE;
+    r.kind = RESULT_KIND_STRING_VIEW;
+    r.string_view = sv;
+    return r;
+}
+
+Result result_err_string_view(String_View sv) {
+    Result r = RESULT_ERROR;
+    r.kind = RESULT_KIND_STRING_VIEW;
+    r.string_view = sv;
+    return r;
+}
+
+Result result_json_value(json_value_t *val) {
+    Result r = RESULT_DONE;
+    r.kind = RESULT_KIND_JSON_VALUE;
+    r.json_value = val;
+    return r;
+}
+
+Result result_tg_poller(Tg_Poller *p) {
+    Result r = RESULT_DONE;
+    r.kind = RESULT_KIND_TG_POLLER;
+    r.tg_poller = p;
+    return r;
+}
+
+Result result_tg_update_list(Tg_Update_List *list) {
+    Result r = RESULT_DONE;
+    r.kind = RESULT_KIND_TG_UPDATE_LIST;
+    r.tg_update_list = list;
+    return r;
+}
+
+Result result_const(Result r) {
+    return r;
+}
+
+/******************************
+ * curl_easy_pool_*           *
+ ******************************/
+
+// Options every handle from the pool starts with
+void curl_easy_pool_configure(CURL *easy_handle) {
+    curl_easy_setopt(easy_handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(easy_handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(easy_handle, CURLOPT_TCP_KEEPIDLE, 60L);
+    curl_easy_setopt(easy_handle, CURLOPT_TCP_KEEPINTVL, 30L);
+}
+
+CURL *curl_easy_pool_acquire() {
+    if (curl_easy_pool.count > 0) {
+        curl_easy_pool.hits++;
+        curl_easy_pool.count--;
+        return curl_easy_pool.items[curl_easy_pool.count];
+    }
+    curl_easy_pool.misses++;
+    CURL *easy_handle = curl_easy_init();
+    if (easy_handle != NULL) curl_easy_pool_configure(easy_handle);
+    return easy_handle;
+}
+
+void curl_easy_pool_release(CURL *easy_handle) {
+    if (curl_easy_pool.count >= CURL_EASY_POOL_CAPACITY) {
+        curl_easy_cleanup(easy_handle);
+        return;
+    }
+    curl_easy_reset(easy_handle);
+    curl_easy_pool_configure(easy_handle);
+    curl_easy_pool.items[curl_easy_pool.count] = easy_handle;
+    curl_easy_pool.count++;
+}
+
+// Has to happen before curl_global_cleanup
+void curl_easy_pool_free_all() {
+    for (size_t i=0; i<curl_easy_pool.count; i++) {
+        curl_easy_cleanup(curl_easy_pool.items[i]);
+    }
+    curl_easy_pool.count = 0;
+}
+
+/******************************
+ * line_buffer_*              *
+ ******************************/
+
+#define LINE_BUFFER_INITIAL_CAPACITY 256
+// a longer line is dropped
+#define LINE_BUFFER_MAX_CAPACITY (64*1024)
+
+// Makes room for at least one more byte at the end, returns false if the line is too long
+bool line_buffer_reserve(Line_Buffer *b) {
+    if (b->head > 0) {
+        // the carried over partial line moves to the front
+        memmove(b->items, b->items + b->head, b->count - b->head);
+        b->count -= b->head;
+        b->head = 0;
+    }
+    if (b->count < b->capacity) return true;
+    if (b->capacity >= LINE_BUFFER_MAX_CAPACITY) return false;
+    b->capacity = b->capacity == 0 ? LINE_BUFFER_INITIAL_CAPACITY : 2*b->capacity;
+    b->items = realloc(b->items, b->capacity);
+    assert(b->items != NULL);
+    return true;
+}
+
+// The next complete line without the newline, it stays valid until the next line_buffer_reserve
+bool line_buffer_next_line(Line_Buffer *b, String_View *line) {
+    char *start = b->items + b->head;
+    char *newline = memchr(start, '\n', b->count - b->head);
+    if (b->discard) {
+        if (newline == NULL) {
+            b->head = b->count;
+            return false;
+        }
+        b->discard = false;
+        b->head += newline - start + 1;
+        return line_buffer_next_line(b, line);
+    }
+    if (newline == NULL) return false;
+    line->str = start;
+    line->count = newline - start;
+    b->head += line->count + 1;
+    return true;
+}
+
+// Drops everything up to the end of the current line
+void line_buffer_drop_line(Line_Buffer *b) {
+    b->head = 0;
+    b->count = 0;
+    b->discard = true;
+}
+
+void line_buffer_free(Line_Buffer *b) {
+    free(b->items);
+    *b = (Line_Buffer) {0};
+}
+
+/******************************
+ * session_*                  *
+ ******************************/
+
+Session *session_new(int fd) {
+    Session *s = malloc(sizeof(Session));
+    assert(s != NULL);
+    *s = (Session) {0};
+    s->fd = fd;
+    s->next = sessions;
+    sessions = s;
+    return s;
+}
+
+void session_free(Session *s) {
+    for (Session **p = &sessions; *p != NULL; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            break;
+        }
+    }
+    for (size_t i=0; i<s->stack_count; i++) {
+        if (s->stack[i].kind == STACK_VALUE_STRING) free(s->stack[i].str);
+    }
+    line_buffer_free(&s->input);
+    free(s->reply);
+    if (s->fd >= 0 && close(s->fd) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Could not close connection: %s\n", strerror(errno));
+    }
+    free(s);
+}
+
+// Writes as much of the pending replies as the connection takes.
+// Returns false if the connection is broken.
+bool session_flush(Session *s) {
+    size_t written = 0;
+    while (written < s->reply_count) {
+        ssize_t n = write(s->fd, s->reply + written, s->reply_count - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            log_printf(LOG_LEVEL_ERROR, "Could not write to connection: %s\n", strerror(errno));
+            return false;
+        }
+        written += n;
+    }
+    memmove(s->reply, s->reply + written, s->reply_count - written);
+    s->reply_count -= written;
+    return true;
+}
+
+// Ends the fifo repl, the listener of the control socket and all connections
+void sessions_stop_all() {
+    sessions_stopped = true;
+    if (console.task != NULL) task_wake(console.task);
+    for (size_t i=0; i<listener_count; i++) task_wake(listeners[i]);
+    if (metrics_dumper != NULL) task_wake(metrics_dumper);
+    for (Session *s = sessions; s != NULL; s = s->next) {
+        if (s->task != NULL) task_wake(s->task);
+    }
+}
+
+/******************************
+ * context_*                  *
+ ******************************/
+
+Context context_new() {
+    Context c = {
+        .multi_handle = NULL,
+        .multi_timer_slot = NULL,
+        .arena = NULL,
+        .file_descriptor = -1,
+        .tg_poller = NULL,
+    };
+    for (size_t i=0; i<CONTEXT_KIND_COUNT; i++) {
+        c.flag[i] = false;
+    }
+    return c;
+}
+
+bool context_is_empty(Context *c) {
+    for (size_t i=0; i<CONTEXT_KIND_COUNT; i++) {
+        if (c->flag[i]) return false;
+    }
+    return true;
+}
+
+void context_add_fifo(Context *c) {
+    c->flag[CONTEXT_KIND_FIFO] = true;
+    c->file_descriptor = make_and_open_fifo();
+}
+
+bool context_remove_fifo(Context *c) {
+    reactor_unwatch_fd(c->file_descriptor);
+    bool success = close_and_unlink_fifo(c->file_descriptor);
+    c->flag[CONTEXT_KIND_FIFO] = false;
+    return success;
+}
+
+void context_add_curl_global(Context *c) {
+    CURLcode r = curl_global_init(CURL_GLOBAL_DEFAULT);
+    if (r != 0) {
+        UNIMPLEMENTED("context_add_curl_global");
+    }
+    c->flag[CONTEXT_KIND_CURL_GLOBAL] = true;
+}
+
+void context_remove_curl_global(Context *c) {
+    curl_easy_pool_free_all();
+    curl_global_cleanup();
+    c->flag[CONTEXT_KIND_CURL_GLOBAL] = false;
+}
+
+// The transfers of the multi handle are driven by the reactor via curl_multi_socket_action.
+void context_add_curl_multi(Context *c) {
+    c->multi_handle = curl_multi_init();
+    if (c->multi_handle == NULL) {
+        UNIMPLEMENTED("context_add_curl_multi");
+    }
+    curl_multi_setopt(c->multi_handle, CURLMOPT_SOCKETFUNCTION, curl_socket_cb);
+    curl_multi_setopt(c->multi_handle, CURLMOPT_SOCKETDATA, c->multi_handle);
+    // the context is copied around, so the timer slot lives on the heap
+    c->multi_timer_slot = calloc(1, sizeof(uint32_t));
+    assert(c->multi_timer_slot != NULL);
+    curl_multi_setopt(c->multi_handle, CURLMOPT_TIMERFUNCTION, curl_timer_cb);
+    curl_multi_setopt(c->multi_handle, CURLMOPT_TIMERDATA, c->multi_timer_slot);
+    c->flag[CONTEXT_KIND_CURL_MULTI] = true;
+}
+
+void context_remove_curl_multi(Context *c) {
+    CURLMcode code = curl_multi_cleanup(c->multi_handle);
+    if (code != CURLM_OK) {
+        UNIMPLEMENTED("context_remove_curl_multi");
+    }
+    reactor_cancel_timer(waker_curl_multi(c->multi_handle, c->multi_timer_slot));
+    free(c->multi_timer_slot);
+    c->multi_timer_slot = NULL;
+    c->flag[CONTEXT_KIND_CURL_MULTI] = false;
+}
+
+void context_add_arena(Context *c, Arena *a) {
+    assert(a != NULL);
+    c->arena = a;
+    c->flag[CONTEXT_KIND_ARENA] = true;
+}
+
+void context_remove_arena(Context *c) {
+    arena_free(c->arena);
+    c->flag[CONTEXT_KIND_ARENA] = false;
+}
+
+void context_add_tg_poller(Context *c, Tg_Poller *p) {
+    assert(p != NULL);
+    c->tg_poller = p;
+    c->flag[CONTEXT_KIND_TG_POLLER] = true;
+}
+
+void context_remove_tg_poller(Context *c) {
+    c->tg_poller = NULL;
+    c->flag[CONTEXT_KIND_TG_POLLER] = false;
+}
+
+// Releases a context of the given kind without a result, see task_cancel
+void context_remove(Context *c, Context_Kind kind) {
+    switch (kind) {
+        case CONTEXT_KIND_FIFO:
+            if (!context_remove_fifo(c)) log_printf(LOG_LEVEL_ERROR, "could not close fifo\n");
+            break;
+        case CONTEXT_KIND_ARENA:
+            context_remove_arena(c);
+            break;
+        case CONTEXT_KIND_CURL_GLOBAL:
+            context_remove_curl_global(c);
+            break;
+        case CONTEXT_KIND_CURL_MULTI:
+            context_remove_curl_multi(c);
+            break;
+        case CONTEXT_KIND_TG_POLLER:
+            context_remove_tg_poller(c);
+            break;
+        case CONTEXT_KIND_COUNT:
+            UNREACHABLE("CONTEXT_KIND_COUNT is not a valid Context_Kind");
+    }
+}
+
+/******************************
+ * tg_poller_*                *
+ ******************************/
+
+// all pollers that are running so they can be stopped when the repl closes
+Tg_Poller *tg_pollers = NULL;
+
+Tg_Poller *tg_poller_find(const char *bot_token) {
+    for (Tg_Poller *p = tg_pollers; p != NULL; p = p->next) {
+        if (strcmp(p->bot_token, bot_token) == 0) return p;
+    }
+    return NULL;
+}
+
+// Returns NULL if a poller for the token is running already, telegram rejects concurrent getUpdates calls.
+Tg_Poller *tg_poller_new(const char *bot_token, int timeout, bool pipelined) {
+    if (tg_poller_find(bot_token) != NULL) return NULL;
+    Tg_Poller *p = malloc(sizeof(Tg_Poller));
+    assert(p != NULL);
+    p->bot_token = strdup(bot_token);
+    assert(p->bot_token != NULL);
+    p->offset = 0;
+    p->timeout = timeout;
+    p->error_count = 0;
+    p->stopped = false;
+    p->pipelined = pipelined;
+    p->task = NULL;
+    p->next = tg_pollers;
+    tg_pollers = p;
+    return p;
+}
+
+void tg_poller_free(Tg_Poller *p) {
+    for (Tg_Poller **cur = &tg_pollers; *cur != NULL; cur = &(*cur)->next) {
+        if (*cur == p) {
+            *cur = p->next;
+            break;
+        }
+    }
+    free(p->bot_token);
+    free(p);
+}
+
+void tg_pollers_stop_all() {
+    for (Tg_Poller *p = tg_pollers; p != NULL; p = p->next) {
+        p->stopped = true;
+        if (p->task != NULL) task_wake(p->task);
+    }
+}
+
+/******************************
+ * trace_*                    *
+ ******************************/
+
+void trace_record(Trace_Phase phase, Task *t, uint64_t ts, uint32_t duration, State state) {
+    Trace_Event *e = &trace.events[trace.count % TRACE_RING_CAPACITY];
+    e->ts = ts;
+    e->duration = duration;
+    e->task_id = t->id;
+    e->parent_id = t->parent != NULL ? t->parent->id : 0;
+    e->phase = phase;
+    e->kind = t->kind;
+    e->state = state;
+    trace.count++;
+}
+
+const char *trace_state_name(State state) {
+    switch (state) {
+        case STATE_DONE:    return "done";
+        case STATE_PENDING: return "pending";
+        case STATE_ERROR:   return "error";
+    }
+    UNREACHABLE("invalid State");
+}
+
+// Writes the recorded events as json of the Chrome trace event format.
+// The life of a task is an async slice from allocation to destruction, every poll is a complete event.
+void trace_write(FILE *f) {
+    size_t first = trace.count > TRACE_RING_CAPACITY ? trace.count - TRACE_RING_CAPACITY : 0;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (size_t i=first; i<trace.count; i++) {
+        Trace_Event *e = &trace.events[i % TRACE_RING_CAPACITY];
+        const char *sep = i+1 < trace.count ? "," : "";
+        const char *kind = task_kind_name[e->kind];
+        switch ((Trace_Phase) e->phase) {
+            case TRACE_ALLOC:
+                fprintf(f, "{\"name\":\"%s\",\"cat\":\"task\",\"ph\":\"b\",\"id\":%u,\"ts\":%lu,\"pid\":1,\"tid\":1}%s\n",
+                        kind, e->task_id, e->ts, sep);
+                break;
+            case TRACE_FIRST_POLL:
+            case TRACE_COMPLETE:
+                fprintf(f, "{\"name\":\"%s\",\"cat\":\"task\",\"ph\":\"n\",\"id\":%u,\"ts\":%lu,\"pid\":1,\"tid\":1,"
+                        "\"args\":{\"parent\":%u,\"state\":\"%s\"}}%s\n",
+                        e->phase == TRACE_FIRST_POLL ? "first poll" : "complete", e->task_id, e->ts, e->parent_id,
+                        trace_state_name(e->state), sep);
+                break;
+            case TRACE_POLL:
+                fprintf(f, "{\"name\":\"%s\",\"cat\":\"poll\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%u,\"pid\":1,\"tid\":1,"
+                        "\"args\":{\"task\":%u,\"parent\":%u,\"state\":\"%s\"}}%s\n",
+                        kind, e->ts, e->duration, e->task_id, e->parent_id, trace_state_name(e->state), sep);
+                break;
+            case TRACE_DESTROY:
+                fprintf(f, "{\"name\":\"%s\",\"cat\":\"task\",\"ph\":\"e\",\"id\":%u,\"ts\":%lu,\"pid\":1,\"tid\":1}%s\n",
+                        kind, e->task_id, e->ts, sep);
+                break;
+        }
+    }
+    fprintf(f, "]}\n");
+}
+
+bool trace_dump(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        log_printf(LOG_LEVEL_ERROR, "Could not open file '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+    trace_write(f);
+    if (fclose(f) != 0) {
+        log_printf(LOG_LEVEL_ERROR, "Could not write file '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+size_t trace_event_count() {
+    return trace.count < TRACE_RING_CAPACITY ? trace.count : TRACE_RING_CAPACITY;
+}
+
+/******************************
+ * task_*                     *
+ ******************************/
+
+Task_Size_Class task_kind_size_class(Task_Kind kind) {
+    switch (kind) {
+        case TASK_KIND_SEQUENCE:
+        case TASK_KIND_ITERATE:
+        case TASK_KIND_TG_CALL:
+            return TASK_SIZE_CLASS_LARGE;
+        case TASK_KIND_PURE:
+        case TASK_KIND_PARALLEL:
+        case TASK_KIND_AND:
+        case TASK_KIND_OR:
+        case TASK_KIND_WAIT:
+        case TASK_KIND_TIMEOUT:
+        case TASK_KIND_FIFO_REPL:
+        case TASK_KIND_SESSION:
+        case TASK_KIND_LISTEN:
+        case TASK_KIND_METRICS_HTTP:
+        case TASK_KIND_CONTEXT:
+        case TASK_KIND_METRICS_DUMP:
+            return TASK_SIZE_CLASS_SMALL;
+        case TASK_KIND_COUNT:
+            UNREACHABLE("TASK_KIND_COUNT is not a valid Task_Kind");
+    }
+    UNREACHABLE("invalid Task_Kind");
+}
+
+Task_Pool_Page *task_pool_page_of(void *block) {
+    return (Task_Pool_Page *) ((uintptr_t) block & ~(uintptr_t) (TASK_POOL_PAGE_SIZE - 1));
+}
+
+void task_pool_partial_push(Task_Pool *pool, Task_Pool_Page *page) {
+    page->prev_partial = NULL;
+    page->next_partial = pool->partial;
+    if (pool->partial != NULL) pool->partial->prev_partial = page;
+    pool->partial = page;
+}
+
+void task_pool_partial_remove(Task_Pool *pool, Task_Pool_Page *page) {
+    if (page->prev_partial != NULL) page->prev_partial->next_partial = page->next_partial;
+    else pool->partial = page->next_partial;
+    if (page->next_partial != NULL) page->next_partial->prev_partial = page->prev_partial;
+}
+
+void task_pool_grow(Task_Pool *pool) {
+    Task_Pool_Page *page = aligned_alloc(TASK_POOL_PAGE_SIZE, TASK_POOL_PAGE_SIZE);
+    if (page == NULL) {
+        UNIMPLEMENTED("task_pool_grow");
+    }
+    page->prev = NULL;
+    page->next = pool->pages;
+    if (pool->pages != NULL) pool->pages->prev = page;
+    pool->pages = page;
+    page->head = NULL;
+    page->fresh = 0;
+    page->live = 0;
+    task_pool_partial_push(pool, page);
+    pool->page_count++;
+    uintptr_t addr = (uintptr_t) page;
+    if (pool->lo == 0 || addr < pool->lo) pool->lo = addr;
+    if (addr + TASK_POOL_PAGE_SIZE > pool->hi) pool->hi = addr + TASK_POOL_PAGE_SIZE;
+}
+
+// page has to be empty
+void task_pool_release(Task_Pool *pool, Task_Pool_Page *page) {
+    assert(page->live == 0);
+    task_pool_partial_remove(pool, page);
+    if (page->prev != NULL) page->prev->next = page->next;
+    else pool->pages = page->next;
+    if (page->next != NULL) page->next->prev = page->prev;
+    pool->page_count--;
+    free(page);
+}
+
+void *task_pool_take(Task_Pool *pool) {
+    if (pool->partial == NULL) task_pool_grow(pool);
+    Task_Pool_Page *page = pool->partial;
+    void *block;
+    if (page->head != NULL) {
+        block = page->head;
+        page->head = page->head->next;
+    } else {
+        // the blocks at the beginning of the page are handed out first
+        block = page->blocks + page->fresh * pool->block_size;
+        page->fresh++;
+    }
+    page->live++;
+    if (page->live == pool->page_capacity) task_pool_partial_remove(pool, page);
+    pool->live++;
+    if (pool->live > pool->peak) pool->peak = pool->live;
+    return block;
+}
+
+void task_pool_give(Task_Pool *pool, void *block) {
+    Task_Pool_Page *page = task_pool_page_of(block);
+    if (page->live == pool->page_capacity) task_pool_partial_push(pool, page);
+    Task_Free_Node *node = block;
+    node->next = page->head;
+    page->head = node;
+    page->live--;
+    pool->live--;
+    if (page->live == 0) {
+        // a page is kept as a reserve, so a pool at the edge of a page does not allocate and free it all the time
+        size_t free_elsewhere = (pool->page_count - 1) * pool->page_capacity - pool->live;
+        if (free_elsewhere >= pool->page_capacity) task_pool_release(pool, page);
+    }
+}
+
+// number of tasks that fit into the pages of all pools
+size_t task_pool_capacity() {
+    size_t capacity = 0;
+    for (size_t i=0; i<TASK_SIZE_CLASS_COUNT; i++) {
+        capacity += task_pool[i].page_count * task_pool[i].page_capacity;
+    }
+    return capacity;
+}
+
+size_t task_pool_free_count() {
+    size_t count = 0;
+    for (size_t i=0; i<TASK_SIZE_CLASS_COUNT; i++) {
+        count += task_pool[i].page_count * task_pool[i].page_capacity - task_pool[i].live;
+    }
+    return count;
+}
+
+// Releases all pages, every task ever allocated is invalid afterwards.
+void task_free_all() {
+    for (size_t i=0; i<TASK_SIZE_CLASS_COUNT; i++) {
+        Task_Pool *pool = &task_pool[i];
+        while (pool->pages != NULL) {
+            Task_Pool_Page *next = pool->pages->next;
+            free(pool->pages);
+            pool->pages = next;
+        }
+        pool->partial = NULL;
+        pool->page_count = 0;
+        pool->live = 0;
+        pool->lo = 0;
+        pool->hi = 0;
+    }
+    memset(metrics.task_live, 0, sizeof(metrics.task_live));
+}
+
+// Only meant for asserts: the address lies in the range of the pages and its page has live blocks
+bool task_in_pool(Task *t) {
+    Task_Pool *pool = &task_pool[task_kind_size_class(t->kind)];
+    uintptr_t addr = (uintptr_t) t;
+    if (addr < pool->lo || addr >= pool->hi) return false;
+    Task_Pool_Page *page = task_pool_page_of(t);
+    size_t offset = (size_t) ((unsigned char *) t - page->blocks);
+    return page->live > 0 && offset % pool->block_size == 0 && offset / pool->block_size < page->fresh;
+}
+
+Task *task_alloc(Task_Kind kind) {
+    Task *t = task_pool_take(&task_pool[task_kind_size_class(kind)]);
+    t->kind = kind;
+    t->parent = NULL;
+    t->next_ready = NULL;
+    t->woken = true;
+    t->spawned = false;
+    t->polled = false;
+    t->timer_slot = 0;
+    t->id = ++trace.last_task_id;
+    if (trace.enabled) trace_record(TRACE_ALLOC, t, time_now_us(), 0, STATE_PENDING);
+    PROBE2(task__alloc, t->id, kind);
+
+    metrics.task_live[kind]++;
+    if (metrics.task_live[kind] > metrics.task_peak[kind]) metrics.task_peak[kind] = metrics.task_live[kind];
+    return t;
+}
+
+void task_free(Task *t) {
+    if (t == NULL) return;
+
+    //make sure t is actually in the task pool and does not come from somewhere else
+    assert(task_in_pool(t));
+    metrics.task_live[t->kind]--;
+    if (trace.enabled) trace_record(TRACE_DESTROY, t, time_now_us(), 0, STATE_DONE);
+    PROBE2(task__free, t->id, t->kind);
+
+    task_pool_give(&task_pool[task_kind_size_class(t->kind)], t);
+}
+
+/******************************
+ * metrics_*                  *
+ ******************************/
+
+// The root task of the server, see main
+Task *runner = NULL;
+
+void histogram_observe(Histogram *h, uint64_t value) {
+    size_t i = 0;
+    while (i+1 < HISTOGRAM_BUCKET_COUNT && ((uint64_t) 1 << i) < value) i++;
+    h->buckets[i]++;
+    h->count++;
+    h->sum += value;
+}
+
+// Upper bound of the bucket that contains the quantile q
+uint64_t histogram_quantile(Histogram *h, double q) {
+    uint64_t rank = (uint64_t) (q * (double) h->count);
+    uint64_t seen = 0;
+    for (size_t i=0; i<HISTOGRAM_BUCKET_COUNT; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) return (uint64_t) 1 << i;
+    }
+    return (uint64_t) 1 << (HISTOGRAM_BUCKET_COUNT - 1);
+}
+
+// The method is the last segment of the path, see build_url
+size_t metrics_endpoint(const char *url) {
+    const char *end = strchr(url, '?');
+    if (end == NULL) end = url + strlen(url);
+    const char *start = end;
+    while (start > url && start[-1] != '/') start--;
+    for (size_t i=0; i<TG_METHOD_COUNT; i++) {
+        if (strlen(tg_method_name[i]) == (size_t) (end - start) && memcmp(tg_method_name[i], start, end - start) == 0) return i;
+    }
+    return TG_METHOD_COUNT;
+}
+
+void metrics_observe_transfer(CURL *easy_handle, CURLcode code) {
+    char *url = NULL;
+    curl_off_t total_us = 0;
+    if (curl_easy_getinfo(easy_handle, CURLINFO_EFFECTIVE_URL, &url) != CURLE_OK || url == NULL) return;
+    size_t endpoint = metrics_endpoint(url);
+    if (code != CURLE_OK) metrics.http_errors[endpoint]++;
+    if (curl_easy_getinfo(easy_handle, CURLINFO_TOTAL_TIME_T, &total_us) != CURLE_OK) return;
+    histogram_observe(&metrics.http_latency[endpoint], (uint64_t) total_us);
+}
+
+void metrics_observe_update(Tg_Update *u) {
+    if (u->message == NULL || u->message->date <= 0) return;
+    int64_t lag = (int64_t) time(NULL) - u->message->date;
+    histogram_observe(&metrics.update_lag, lag > 0 ? (uint64_t) lag * 1000000 : 0);
+}
+
+size_t arena_bytes(Arena *a) {
+    size_t bytes = 0;
+    for (Region *r = a->begin; r != NULL; r = r->next) {
+        bytes += sizeof(Region) + r->capacity * sizeof(uintptr_t);
+    }
+    return bytes;
+}
+
+// Bytes in the arenas of t and all its subtasks
+size_t task_arena_bytes(Task *t) {
+    if (t == NULL) return 0;
+    switch (t->kind) {
+        case TASK_KIND_SEQUENCE:
+            {
+                size_t bytes = 0;
+                for (size_t i=t->seq_index; i<t->seq_count; i++) bytes += task_arena_bytes(t->seq[i]);
+                return bytes;
+            }
+        case TASK_KIND_PARALLEL:
+            {
+                size_t bytes = 0;
+                for (size_t i=0; i<t->par_count; i++) bytes += task_arena_bytes(t->par[i].task);
+                return bytes;
+            }
+        case TASK_KIND_AND:
+        case TASK_KIND_OR:
+            return task_arena_bytes(t->snd != NULL ? t->snd : t->fst);
+        case TASK_KIND_ITERATE:
+            return task_arena_bytes(t->iter_body) + task_arena_bytes(t->iter_condition);
+        case TASK_KIND_TIMEOUT:
+            return task_arena_bytes(t->timeout_body);
+        case TASK_KIND_CONTEXT:
+            {
+                size_t bytes = task_arena_bytes(t->context_body);
+                if (t->context_kind == CONTEXT_KIND_ARENA) bytes += arena_bytes(&t->context_arena);
+                return bytes;
+            }
+        case TASK_KIND_TG_CALL:
+            return arena_bytes(&t->tg_call_arena);
+        default:
+            return 0;
+    }
+}
+
+// Replies with all metrics to the current session, the rates are since the last report of the same reader
+void metrics_print(Metrics_Report *last) {
+    uint64_t now = time_now_ms();
+    if (metrics.start_ms == 0) metrics.start_ms = now;
+    if (last->ms == 0) last->ms = metrics.start_ms;
+    double interval = (double) (now - last->ms) / 1000.0;
+    double command_rate = interval > 0 ? (double) (metrics.commands - last->commands) / interval : 0.0;
+    last->ms = now;
+    last->commands = metrics.commands;
+
+    session_printf("[STATS] uptime: %.1fs\n", (double) (now - metrics.start_ms) / 1000.0);
+    session_printf("[STATS] main loop: %lu iterations, %.3fs polling, %.3fs waiting, poll p50 <= %luus, p99 <= %luus\n",
+            metrics.loop_iterations, (double) metrics.poll_us / 1e6, (double) metrics.wait_us / 1e6,
+            histogram_quantile(&metrics.poll_duration, 0.5), histogram_quantile(&metrics.poll_duration, 0.99));
+    session_printf("[STATS] commands: %lu, %.2f per second\n", metrics.commands, command_rate);
+    for (Task_Size_Class c=0; c<TASK_SIZE_CLASS_COUNT; c++) {
+        Task_Pool *pool = &task_pool[c];
+        session_printf("[STATS] task pool %s: %zu of %zu blocks used, %zu peak, %zu pages\n", task_size_class_name[c],
+                pool->live, pool->page_count * pool->page_capacity, pool->peak, pool->page_count);
+    }
+    session_printf("[STATS] arenas: %zu bytes\n", task_arena_bytes(runner));
+    session_printf("[STATS] curl: %zu transfers in flight, easy handle pool %zu hits, %zu misses\n",
+            metrics.curl_in_flight, curl_easy_pool.hits, curl_easy_pool.misses);
+    for (Task_Kind k=0; k<TASK_KIND_COUNT; k++) {
+        if (metrics.task_peak[k] == 0) continue;
+        session_printf("[STATS] tasks %s: %zu live, %zu peak\n", task_kind_name[k], metrics.task_live[k], metrics.task_peak[k]);
+    }
+    for (size_t i=0; i<=TG_METHOD_COUNT; i++) {
+        Histogram *h = &metrics.http_latency[i];
+        if (h->count == 0) continue;
+        session_printf("[STATS] http %s: %lu calls, %lu failed, mean %luus, p50 <= %luus, p99 <= %luus\n",
+                i < TG_METHOD_COUNT ? tg_method_name[i] : "other", h->count, metrics.http_errors[i], h->sum / h->count,
+                histogram_quantile(h, 0.5), histogram_quantile(h, 0.99));
+    }
+    if (metrics.update_lag.count > 0) {
+        session_printf("[STATS] update lag: %lu updates, p50 <= %.0fs, p99 <= %.0fs\n", metrics.update_lag.count,
+                (double) histogram_quantile(&metrics.update_lag, 0.5) / 1e6, (double) histogram_quantile(&metrics.update_lag, 0.99) / 1e6);
+    }
+    session_printf("[STATS] log lines: %lu debug, %lu info, %lu error\n",
+            metrics.log_lines[LOG_LEVEL_DEBUG], metrics.log_lines[LOG_LEVEL_INFO], metrics.log_lines[LOG_LEVEL_ERROR]);
+}
+
+// One histogram in the Prometheus text format, the values are scaled from microseconds to seconds
+void metrics_render_histogram(const char *name, const char *labels, Histogram *h) {
+    const char *sep = labels[0] != '\0' ? "," : "";
+    uint64_t cumulative = 0;
+    for (size_t i=0; i<HISTOGRAM_BUCKET_COUNT; i++) {
+        cumulative += h->buckets[i];
+        // the last bucket also counts all larger values, so it is only reported as +Inf
+        if (i+1 == HISTOGRAM_BUCKET_COUNT) break;
+        session_printf("%s_bucket{%s%sle=\"%.9g\"} %lu\n", name, labels, sep, (double) ((uint64_t) 1 << i) / 1e6, cumulative);
+    }
+    session_printf("%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep, h->count);
+    const char *brace_open = labels[0] != '\0' ? "{" : "";
+    const char *brace_close = labels[0] != '\0' ? "}" : "";
+    session_printf("%s_sum%s%s%s %.9g\n", name, brace_open, labels, brace_close, (double) h->sum / 1e6);
+    session_printf("%s_count%s%s%s %lu\n", name, brace_open, labels, brace_close, h->count);
+}
+
+// Replies with all metrics in the Prometheus text exposition format
+void metrics_render_prometheus() {
+    session_printf("# HELP ribezal_tasks_live Tasks that are allocated.\n");
+    session_printf("# TYPE ribezal_tasks_live gauge\n");
+    for (Task_Kind k=0; k<TASK_KIND_COUNT; k++) {
+        session_printf("ribezal_tasks_live{kind=\"%s\"} %zu\n", task_kind_name[k], metrics.task_live[k]);
+    }
+    session_printf("# HELP ribezal_tasks_peak Maximum of tasks that were allocated at the same time.\n");
+    session_printf("# TYPE ribezal_tasks_peak gauge\n");
+    for (Task_Kind k=0; k<TASK_KIND_COUNT; k++) {
+        session_printf("ribezal_tasks_peak{kind=\"%s\"} %zu\n", task_kind_name[k], metrics.task_peak[k]);
+    }
+    session_printf("# HELP ribezal_task_pool_blocks Blocks in the task pool.\n");
+    session_printf("# TYPE ribezal_task_pool_blocks gauge\n");
+    session_printf("ribezal_task_pool_blocks %zu\n", task_pool_capacity());
+    session_printf("# HELP ribezal_task_pool_blocks_used Blocks in the task pool that hold a task.\n");
+    session_printf("# TYPE ribezal_task_pool_blocks_used gauge\n");
+    session_printf("ribezal_task_pool_blocks_used %zu\n", task_pool_capacity() - task_pool_free_count());
+    session_printf("# HELP ribezal_task_pool_blocks_peak Maximum of blocks that held a task at the same time.\n");
+    session_printf("# TYPE ribezal_task_pool_blocks_peak gauge\n");
+    for (Task_Size_Class c=0; c<TASK_SIZE_CLASS_COUNT; c++) {
+        session_printf("ribezal_task_pool_blocks_peak{class=\"%s\"} %zu\n", task_size_class_name[c], task_pool[c].peak);
+    }
+    session_printf("# HELP ribezal_arena_bytes Bytes in the arenas of running requests.\n");
+    session_printf("# TYPE ribezal_arena_bytes gauge\n");
+    session_printf("ribezal_arena_bytes %zu\n", task_arena_bytes(runner));
+    session_printf("# HELP ribezal_curl_transfers_in_flight Transfers that are driven by the multi handle.\n");
+    session_printf("# TYPE ribezal_curl_transfers_in_flight gauge\n");
+    session_printf("ribezal_curl_transfers_in_flight %zu\n", metrics.curl_in_flight);
+    session_printf("# HELP ribezal_commands_total Commands that were executed.\n");
+    session_printf("# TYPE ribezal_commands_total counter\n");
+    session_printf("ribezal_commands_total %lu\n", metrics.commands);
+    session_printf("# HELP ribezal_loop_iterations_total Iterations of the main loop.\n");
+    session_printf("# TYPE ribezal_loop_iterations_total counter\n");
+    session_printf("ribezal_loop_iterations_total %lu\n", metrics.loop_iterations);
+    session_printf("# HELP ribezal_poll_seconds_total Time the main loop spent polling tasks.\n");
+    session_printf("# TYPE ribezal_poll_seconds_total counter\n");
+    session_printf("ribezal_poll_seconds_total %g\n", (double) metrics.poll_us / 1e6);
+    session_printf("# HELP ribezal_wait_seconds_total Time the main loop spent waiting for events.\n");
+    session_printf("# TYPE ribezal_wait_seconds_total counter\n");
+    session_printf("ribezal_wait_seconds_total %g\n", (double) metrics.wait_us / 1e6);
+    session_printf("# HELP ribezal_poll_duration_seconds Duration of one poll of the root task.\n");
+    session_printf("# TYPE ribezal_poll_duration_seconds histogram\n");
+    metrics_render_histogram("ribezal_poll_duration_seconds", "", &metrics.poll_duration);
+    session_printf("# HELP ribezal_http_request_duration_seconds Duration of calls to the telegram api.\n");
+    session_printf("# TYPE ribezal_http_request_duration_seconds histogram\n");
+    for (size_t i=0; i<=TG_METHOD_COUNT; i++) {
+        char labels[64];
+        snprintf(labels, sizeof(labels), "method=\"%s\"", i < TG_METHOD_COUNT ? tg_method_name[i] : "other");
+        metrics_render_histogram("ribezal_http_request_duration_seconds", labels, &metrics.http_latency[i]);
+    }
+    session_printf("# HELP ribezal_http_request_errors_total Calls to the telegram api that failed.\n");
+    session_printf("# TYPE ribezal_http_request_errors_total counter\n");
+    for (size_t i=0; i<=TG_METHOD_COUNT; i++) {
+        session_printf("ribezal_http_request_errors_total{method=\"%s\"} %lu\n", i < TG_METHOD_COUNT ? tg_method_name[i] : "other", metrics.http_errors[i]);
+    }
+    session_printf("# HELP ribezal_update_lag_seconds Time from sending a message to processing its update.\n");
+    session_printf("# TYPE ribezal_update_lag_seconds histogram\n");
+    metrics_render_histogram("ribezal_update_lag_seconds", "", &metrics.update_lag);
+    session_printf("# HELP ribezal_log_lines_total Lines that were logged.\n");
+    session_printf("# TYPE ribezal_log_lines_total counter\n");
+    for (Log_Level l=0; l<LOG_LEVEL_COUNT; l++) {
+        static const char *name[LOG_LEVEL_COUNT] = {"debug", "info", "error"};
+        session_printf("ribezal_log_lines_total{level=\"%s\"} %lu\n", name[l], metrics.log_lines[l]);
+    }
+}
+
+// End of the header of an http request
+bool http_request_complete(String_View request) {
+    for (size_t i=0; i+1<request.count; i++) {
+        if (request.str[i] != '\n') continue;
+        if (request.str[i+1] == '\n') return true;
+        if (request.str[i+1] == '\r' && i+2 < request.count && request.str[i+2] == '\n') return true;
+    }
+    return false;
+}
+
+// Reads the request and collects the response in the reply of s once the request is complete.
+// Only GET /metrics is served, the connection is closed after the response.
+Result metrics_http_read(Session *s) {
+    Line_Buffer *b = &s->input;
+    for (;;) {
+        // a request that does not fit is not answered
+        if (!line_buffer_reserve(b)) return RESULT_ERROR;
+        size_t space = b->capacity - b->count;
+        ssize_t r = read(s->fd, b->items + b->count, space);
+        if (r == 0) return RESULT_ERROR;
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            log_printf(LOG_LEVEL_ERROR, "Could not read from connection: %s\n", strerror(errno));
+            return RESULT_ERROR;
+        }
+        b->count += r;
+        if ((size_t) r < space) break;
+    }
+    String_View request = { .str = b->items + b->head, .count = b->count - b->head };
+    if (!http_request_complete(request)) return RESULT_PENDING;
+
+    const char *status = "200 OK";
+    if (request.count < 4 || memcmp(request.str, "GET ", 4) != 0) {
+        status = "405 Method Not Allowed";
+    } else {
+        String_View path = string_view_take_non_ws(string_view_drop_ws(string_view_drop_non_ws(request)));
+        if (!string_view_eq_cstr(path, "/metrics")) status = "404 Not Found";
+    }
+
+    Session *prev = session;
+    session = s;
+    if (strcmp(status, "200 OK") == 0) {
+        metrics_render_prometheus();
+    } else {
+        session_printf("%s\n", status);
+    }
+    // the header needs the length of the body, so it is put in front afterwards
+    char *body = s->reply;
+    size_t body_count = s->reply_count;
+    s->reply = NULL;
+    s->reply_count = 0;
+    s->reply_capacity = 0;
+    session_printf("HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n%.*s",
+            status, body_count, (int) body_count, body);
+    free(body);
+    session = prev;
+    return RESULT_DONE;
+}
+
+/******************************
+ * task constructors          *
+ ******************************/
+
 Task *task_pure(Result r, Result_Function f) {
-    Task *t = task_alloc();
-    t->kind = TASK_KIND_PURE;
+    Task *t = task_alloc(TASK_KIND_PURE);
     t->pure_argument = r;
     t->pure_function = f;
     return t;
 }
 
-Task *task_const(Result r) {
-    return task_pure(r, result_const);
+Task *task_const(Result r) {
+    return task_pure(r, result_const);
+}
+
+Task *task_wait(double dur) {
+    Task *ret = task_alloc(TASK_KIND_WAIT);
+    ret->started = false;
+    ret->duration = dur;
+    ret->deadline = 0;
+    return ret;
+}
+
+// Ends with the Result of body if it finishes within ms milliseconds after the first poll.
+// Otherwise body is cancelled with task_cancel and the Result is RESULT_TIMEOUT.
+Task *task_timeout(Task *body, uint64_t ms) {
+    Task *t = task_alloc(TASK_KIND_TIMEOUT);
+    t->timeout_body = body;
+    t->timeout_ms = ms;
+    t->timeout_deadline = 0;
+    task_attach(t, body);
+    return t;
+}
+
+Task *task_sequence() {
+    Task *ret = task_alloc(TASK_KIND_SEQUENCE);
+    ret->seq_count = 0;
+    ret->seq_index = 0;
+    return ret;
+}
+
+void task_seq_append(Task *s, Task *t) {
+    assert(s->kind == TASK_KIND_SEQUENCE);
+    assert(s->seq_count < MAX_SEQ_COUNT); 
+
+    s->seq[s->seq_count] = t;
+    if (s->seq_count == s->seq_index) {
+        task_attach(s, t);
+    } else {
+        // only the current subtask is scheduled, the others are attached again when it is their turn
+        t->parent = s;
+    }
+    s->seq_count++;
+}
+
+Task *task_parallel() {
+    Task *ret = task_alloc(TASK_KIND_PARALLEL);
+    ret->par_count = 0;
+    ret->par_capacity = 0;
+    ret->par = NULL;
+    ret->par_ready = (Task_Queue) {0};
+    return ret;
+}
+
+Task *task_iterate(Task *start, Then_Function next, Then_Function cond, void *data) {
+    Task *t = task_alloc(TASK_KIND_ITERATE);
+    t->iter_phase = 0;
+    t->iter_body = start;
+    t->iter_next = next;
+    t->iter_build_condition = cond;
+    t->iter_data = data;
+    task_attach(t, start);
+    return t;
+}
+
+void task_par_append(Task *p, Task *t) {
+    assert(p->kind == TASK_KIND_PARALLEL);
+
+    if (p->par_count >= p->par_capacity) {
+        p->par_capacity = p->par_capacity == 0 ? PAR_INITIAL_CAPACITY : 2*p->par_capacity;
+        p->par = realloc(p->par, p->par_capacity * sizeof(Par_Entry));
+        assert(p->par != NULL);
+    }
+    p->par[p->par_count].task = t;
+    p->par[p->par_count].ctx = context_new();
+    t->par_slot = p->par_count;
+    p->par_count++;
+    task_attach(p, t);
+}
+
+Task *task_and(Task *fst, Then_Function f, void *data) {
+    Task *t = task_alloc(TASK_KIND_AND);
+    t->fst = fst;
+    t->snd = NULL;
+    t->then = f;
+    t->then_data = data;
+    task_attach(t, fst);
+    return t;
+}
+
+Task *task_or(Task *fst, Then_Function f, void *data) {
+    Task *t = task_alloc(TASK_KIND_OR);
+    t->fst = fst;
+    t->snd = NULL;
+    t->then = f;
+    t->then_data = data;
+    task_attach(t, fst);
+    return t;
+}
+
+// Serves a connection to the control socket, the task owns the session
+Task *task_session(Session *s) {
+    Task *t = task_alloc(TASK_KIND_SESSION);
+    t->repl_session = s;
+    t->repl_events = 0;
+    t->repl_fd = s->fd;
+    s->task = t;
+    return t;
+}
+
+// Serves one scrape of /metrics, the task owns the session
+Task *task_metrics_http(Session *s) {
+    Task *t = task_alloc(TASK_KIND_METRICS_HTTP);
+    t->repl_session = s;
+    t->repl_events = 0;
+    t->repl_fd = s->fd;
+    s->task = t;
+    return t;
+}
+
+// Accepts connections and serves each with a task of client_kind, the task owns listen_fd
+Task *task_listen(int listen_fd, Task_Kind client_kind, const char *path) {
+    assert(client_kind == TASK_KIND_SESSION || client_kind == TASK_KIND_METRICS_HTTP);
+    assert(listener_count < MAX_LISTENERS);
+    Task *t = task_alloc(TASK_KIND_LISTEN);
+    t->listen_fd = listen_fd;
+    t->listen_watched = false;
+    t->listen_client_kind = client_kind;
+    t->listen_path = path;
+    listeners[listener_count++] = t;
+    return t;
+}
+
+// Logs the metrics every METRICS_DUMP_INTERVAL_SECS until the sessions are stopped
+Task *task_metrics_dump() {
+    Task *t = task_alloc(TASK_KIND_METRICS_DUMP);
+    t->dump_deadline = time_now_ms() + METRICS_DUMP_INTERVAL_SECS * 1000;
+    t->dump_report = (Metrics_Report) {0};
+    metrics_dumper = t;
+    return t;
+}
+
+Task *task_file_context(Task *body) {
+    Task *t = task_alloc(TASK_KIND_CONTEXT);
+    t->context_kind = CONTEXT_KIND_FIFO;
+    t->context_body = body;
+    task_attach(t, body);
+    return t;
+}
+
+Task *task_curl_multi_context(Task *body) {
+    Task *t = task_alloc(TASK_KIND_CONTEXT);
+    t->context_kind = CONTEXT_KIND_CURL_MULTI;
+    t->context_body = body;
+    task_attach(t, body);
+    return t;
+}
+
+Task *task_curl_global_context(Task *body) {
+    Task *t = task_alloc(TASK_KIND_CONTEXT);
+    t->context_kind = CONTEXT_KIND_CURL_GLOBAL;
+    t->context_body = body;
+    task_attach(t, body);
+    return t;
+}
+
+// The body can advance the offset of the poller, see tg_call_decode_get_updates.
+// The task always finishes with the poller as result, a failure of the body is counted in poller->error_count.
+Task *task_tg_poller_context(Task *body, Tg_Poller *p) {
+    Task *t = task_alloc(TASK_KIND_CONTEXT);
+    t->context_kind = CONTEXT_KIND_TG_POLLER;
+    t->context_body = body;
+    t->context_tg_poller = p;
+    p->task = t;
+    task_attach(t, body);
+    return t;
+}
+
+json_value_t *json_element_by_key(json_object_t *obj, const char *name) {
+    for (json_object_element_t *elem = obj->start; elem != NULL; elem = elem->next) {
+        if (strlen(name) == elem->name->string_size && strncmp(name, elem->name->string, elem->name->string_size) == 0) {
+            return elem->value;
+        }
+    }
+    return NULL;
+}
+
+bool as_tg_user(json_value_t *value, Tg_User *user) {
+    json_object_t *object = json_value_as_object(value);
+    if (object == NULL) return false;
+
+    json_value_t *value_first_name = json_element_by_key(object, "first_name");
+    if (value_first_name == NULL) return false;
+    json_string_t *string_first_name = json_value_as_string(value_first_name);
+    if (string_first_name == NULL) return false;
+    user->first_name = string_first_name->string;
+    return true;
+}
+
+// The result of a response if telegram reports success and the description of the error otherwise.
+// A response without the expected fields is an error without a description.
+Result unpack_tg_response(Result r) {
+    assert(r.state == STATE_DONE);
+    assert(r.kind == RESULT_KIND_JSON_VALUE);
+
+    if (r.json_value == NULL) return RESULT_ERROR;
+    json_object_t *object = json_value_as_object(r.json_value);
+    if (object == NULL) return RESULT_ERROR;
+    json_value_t *ok_value = json_element_by_key(object, "ok");
+    if (ok_value == NULL) return RESULT_ERROR;
+    if (json_value_is_true(ok_value)) {
+        json_value_t *result_value = json_element_by_key(object, "result");
+        if (result_value == NULL) return RESULT_ERROR;
+        return result_json_value(result_value);
+    }
+    if (!json_value_is_false(ok_value)) return RESULT_ERROR;
+    json_value_t *description_value = json_element_by_key(object, "description");
+    if (description_value == NULL) return RESULT_ERROR;
+    json_string_t *description_string = json_value_as_string(description_value);
+    if (description_string == NULL) return RESULT_ERROR;
+    return result_err_string_view(string_view_from_json_string(description_string));
+}
+
+Result get_tg_user(Result r) {
+    assert(r.state == STATE_DONE);
+    assert(r.kind == RESULT_KIND_JSON_VALUE);
+
+    Tg_User user;
+    if (r.json_value == NULL || !as_tg_user(r.json_value, &user)) {
+        log_printf(LOG_LEVEL_ERROR, "getMe returned no user\n");
+        return RESULT_ERROR;
+    }
+    log_printf(LOG_LEVEL_INFO, "User named '%s'\n", user.first_name);
+    return RESULT_DONE;
+}
+
+Result print_tg_update_list(Result r) {
+    assert(r.state == STATE_DONE);
+    assert(r.kind == RESULT_KIND_TG_UPDATE_LIST);
+
+    Tg_Update_List *list = r.tg_update_list;
+    for (size_t i=0; i<list->count; i++) {
+        Tg_Update *u = &list->items[i];
+        metrics_observe_update(u);
+        if (u->message != NULL && u->message->text != NULL) {
+            log_printf(LOG_LEVEL_INFO, "update id %d brought message: %s\n", u->update_id, u->message->text);
+        } else {
+            log_printf(LOG_LEVEL_DEBUG, "update id %d brought no text message\n", u->update_id);
+        }
+    }
+    return RESULT_DONE;
+}
+
+Task *task_context_arena(Task *body, Arena arena) {
+    Task *t = task_alloc(TASK_KIND_CONTEXT);
+    t->context_kind = CONTEXT_KIND_ARENA;
+    t->context_body = body;
+    task_attach(t, body);
+
+    t->context_arena = arena;
+
+    return t;
+}
+
+// see tg_call_decode_*
+Result tg_call_decode_get_me(Arena *a, String_View body, Context *ctx, void *data);
+Result tg_call_decode_get_updates(Arena *a, String_View body, Context *ctx, void *data);
+
+// A whole api call in one task: it sends the request to url, waits for the response and decodes it with decode.
+// It needs CONTEXT_KIND_CURL_GLOBAL and uses the multi handle of the context if there is one.
+Task *task_tg_call(String_View url, Tg_Response_Decoder decode, void *data) {
+    Task *t = task_alloc(TASK_KIND_TG_CALL);
+    t->tg_call_arena = (Arena) {0};
+    t->tg_call_url = (String_View) {
+        .str = arena_memdup(&t->tg_call_arena, url.str, url.count),
+        .count = url.count,
+    };
+    t->tg_call_easy = NULL;
+    t->tg_call_transfer = NULL;
+    t->tg_call_decode = decode;
+    t->tg_call_data = data;
+    return t;
+}
+
+// A call that takes longer is cancelled, long polling calls get this on top of their timeout
+#define TG_CALL_TIMEOUT_SECS 10
+
+Task *task_call_getme(String_View url) {
+    return task_tg_call(url, tg_call_decode_get_me, NULL);
+}
+
+Task *task_call_getupdates(String_View url) {
+    return task_tg_call(url, tg_call_decode_get_updates, NULL);
+}
+
+#define TG_POLL_TIMEOUT_SECS 30
+#define TG_POLL_MAX_BACKOFF_SECS 64
+
+// One iteration of the long polling loop: a single getUpdates call with the current offset.
+// In pipelined mode the iteration ends as soon as the offset is known, see tg_call_decode_get_updates.
+// After failed calls the iteration waits first. Both happen in the context of the poller,
+// so stopping the poller cancels either of them.
+Task *task_tg_poll_updates_once(Tg_Poller *p) {
+    Arena temp = {0};
+    Tg_Method_Call call = new_tg_api_call_get_updates_long_poll(p->bot_token, p->offset, p->timeout);
+    String_View url = build_url(&temp, &call);
+    // a timeout counts as a failed call, so the loop backs off and tries again
+    uint64_t ms = 1000 * (uint64_t) (p->timeout + TG_CALL_TIMEOUT_SECS);
+    Task *body = task_timeout(task_call_getupdates(url), ms);
+    if (p->error_count > 0) {
+        // back off exponentially so an unreachable api is not flooded with requests
+        unsigned int shift = p->error_count - 1;
+        double delay = shift < 6 ? (double) (1u << shift) : TG_POLL_MAX_BACKOFF_SECS;
+        log_printf(LOG_LEVEL_ERROR, "getUpdates failed %u times in a row, retrying in %.0f seconds\n", p->error_count, delay);
+        Task *seq = task_sequence();
+        task_seq_append(seq, task_wait(delay));
+        task_seq_append(seq, body);
+        body = seq;
+    }
+    Task *t = task_tg_poller_context(body, p);
+    arena_free(&temp);
+    return t;
+}
+
+Task *tg_poll_next(Result r, void *data) {
+    UNUSED(data);
+    assert(r.state == STATE_DONE);
+    assert(r.kind == RESULT_KIND_TG_POLLER);
+    return task_tg_poll_updates_once(r.tg_poller);
+}
+
+Task *tg_poll_condition(Result r, void *data) {
+    UNUSED(data);
+    assert(r.state == STATE_DONE);
+    assert(r.kind == RESULT_KIND_TG_POLLER);
+
+    return task_const(result_bool(!r.tg_poller->stopped));
+}
+
+Task *tg_poll_finish(Result r, void *data) {
+    UNUSED(data);
+    assert(r.state == STATE_DONE);
+    assert(r.kind == RESULT_KIND_TG_POLLER);
+
+    log_printf(LOG_LEVEL_INFO, "stopped polling updates\n");
+    tg_poller_free(r.tg_poller);
+    return task_const(RESULT_DONE);
+}
+
+// Keeps calling getUpdates with long polling until the poller is stopped
+Task *task_tg_poll_updates(Tg_Poller *p) {
+    return task_and(task_iterate(task_tg_poll_updates_once(p), tg_poll_next, tg_poll_condition, NULL), tg_poll_finish, NULL);
+}
+
+Reply_Kind command_execute(Command c) {
+    metrics.commands++;
+    switch (c) {
+        case HELP:
+            session_printf("[HELP] The following commands are accepted:\n");
+            for (Command i=0; i<COMMAND_COUNT; i++) {
+                session_printf("[HELP] \"%s\"\n", command_keyword[i]);
+                session_printf("[HELP]     Stack: %s\n", command_stack_config[i]);
+                session_printf("[HELP]     Description: %s\n", command_description[i]);
+            }
+            return REPLY_ACK;
+        case QUIT:
+            // the pollers cancel their current getUpdates call
+            tg_pollers_stop_all();
+            sessions_stop_all();
+            return REPLY_CLOSE;
+        case PRINT:
+            stack_print();
+            return REPLY_ACK;
+        case DROP:
+            stack_drop();
+            return REPLY_ACK;
+        case CLEAR:
+            while (session->stack_count > 0) stack_drop();
+            return REPLY_ACK;
+        case TG_GETME:
+            if (stack_string()) {
+                Arena temp = {0};
+
+                Tg_Method_Call call = new_tg_api_call_get_me(STACK_TOP.str);
+                String_View url = build_url(&temp, &call);
+                task_par_append(runner, task_timeout(task_call_getme(url), 1000 * TG_CALL_TIMEOUT_SECS));
+                stack_drop();
+
+                arena_free(&temp);
+                return REPLY_ACK;
+            }
+            return REPLY_ERROR;
+        case TG_GETUPDATES:
+            if (stack_string()) {
+                Arena temp = {0};
+
+                Tg_Method_Call call = new_tg_api_call_get_updates(STACK_TOP.str);
+                String_View url = build_url(&temp, &call);
+                task_par_append(runner, task_timeout(task_call_getupdates(url), 1000 * TG_CALL_TIMEOUT_SECS));
+                stack_drop();
+
+                arena_free(&temp);
+                return REPLY_ACK;
+            }
+            return REPLY_ERROR;
+        case TG_POLLUPDATES:
+            if (stack_string()) {
+                Tg_Poller *p = tg_poller_new(STACK_TOP.str, TG_POLL_TIMEOUT_SECS, false);
+                if (p == NULL) {
+                    session_printf("[ERROR] Updates of this bot are polled already\n");
+                    return REPLY_REFUSED;
+                }
+                task_par_append(runner, task_tg_poll_updates(p));
+                stack_drop();
+                return REPLY_ACK;
+            }
+            return REPLY_ERROR;
+        case TG_POLLUPDATES_PIPELINED:
+            if (stack_string()) {
+                Tg_Poller *p = tg_poller_new(STACK_TOP.str, TG_POLL_TIMEOUT_SECS, true);
+                if (p == NULL) {
+                    session_printf("[ERROR] Updates of this bot are polled already\n");
+                    return REPLY_REFUSED;
+                }
+                task_par_append(runner, task_tg_poll_updates(p));
+                stack_drop();
+                return REPLY_ACK;
+            }
+            return REPLY_ERROR;
+        case PLUS:
+            if (stack_two_int()) {
+                int x = STACK_TOP.x;
+                stack_drop();
+                STACK_TOP.x += x;
+                return REPLY_ACK;
+            }
+            return REPLY_ERROR;
+        case MINUS:
+            if (stack_two_int()) {
+                int x = STACK_TOP.x;
+                stack_drop();
+                STACK_TOP.x -= x;
+                return REPLY_ACK;
+            }
+            return REPLY_ERROR;
+        case TIMES:
+            if (stack_two_int()) {
+                int x = STACK_TOP.x;
+                stack_drop();
+                STACK_TOP.x *= x;
+                return REPLY_ACK;
+            }
+            return REPLY_ERROR;
+        case DIVIDE:
+            if (stack_two_int()) {
+                int x = STACK_TOP.x;
+                stack_drop();
+                STACK_TOP.x /= x;
+                return REPLY_ACK;
+            }
+            return REPLY_ERROR;
+        case STATS:
+            metrics_print(&session->stats_report);
+            return REPLY_ACK;
+        case TRACE:
+            if (!trace.enabled) {
+                trace.enabled = true;
+                session_printf("[TRACE] recording, run 'trace' again to write the events to '%s'\n", TRACE_FILE_NAME);
+                return REPLY_ACK;
+            }
+            if (!trace_dump(TRACE_FILE_NAME)) return REPLY_ERROR;
+            session_printf("[TRACE] wrote %zu events to '%s'\n", trace_event_count(), TRACE_FILE_NAME);
+            return REPLY_ACK;
+        case COMMAND_COUNT:
+            UNREACHABLE("COMMAND_COUNT is not a valid Command");
+    }
+    UNREACHABLE("no valid Command");
+}
+
+// Exact match of a token against the keywords with the perfect hash from command_hash.h
+bool command_lookup(String_View token, Command *result) {
+    uint32_t slot = command_hash(token.str, token.count, COMMAND_HASH_SEED) & (COMMAND_HASH_SIZE - 1);
+    const Command_Hash_Slot *entry = &command_hash_table[slot];
+    if (entry->command < 0 || entry->length != token.count) return false;
+    if (memcmp(command_keyword[entry->command], token.str, token.count) != 0) return false;
+    *result = entry->command;
+    return true;
 }
 
-void task_par_append(Task *p, Task *t) {
-    assert(p->kind == TASK_KIND_PARALLEL);
-    assert(p->par_count < MAX_PAR_COUNT);
+/******************************
+ * program_*                  *
+ ******************************/
 
-    p->par[p->par_count] = t;
-    p->sub_ctx[p->par_count] = context_new();
-    p->par_count++;
+// A line of the repl compiled to bytecode, so a line that is sent again does not have to be
+// tokenized, parsed and looked up again. The strings point into the copy of the line.
+typedef enum {
+    INSTRUCTION_PUSH_INT,
+    INSTRUCTION_PUSH_STRING,
+    INSTRUCTION_COMMAND,
+    // a token that is neither int, keyword nor printable string
+    INSTRUCTION_ERROR,
+    INSTRUCTION_END,
+    INSTRUCTION_KIND_COUNT,
+} Instruction_Kind;
+
+typedef struct {
+    Instruction_Kind kind;
+    union {
+        int x;
+        Command command;
+        String_View str;
+    };
+} Instruction;
+
+typedef struct {
+    uint32_t hash;
+    String_View source;
+    size_t code_count;
+    Instruction code[];
+} Program;
+
+#define PROGRAM_CACHE_CAPACITY 64
+typedef struct {
+    // direct mapped by the hash of the source, a line replaces the one that was in its slot
+    Program *items[PROGRAM_CACHE_CAPACITY];
+    size_t hits;
+    size_t misses;
+} Program_Cache;
+
+Program_Cache program_cache = {0};
+
+uint32_t program_hash(String_View source) {
+    return command_hash(source.str, source.count, 0);
 }
 
-Task *task_and(Task *fst, Then_Function f) {
-    Task *t = task_alloc();
-    t->kind = TASK_KIND_AND;
-    t->fst = fst;
-    t->snd = NULL;
-    t->then = f;
-    return t;
+Program *program_compile(String_View source) {
+    // every token is at least one byte followed by whitespace, plus the final END
+    size_t max_code_count = source.count / 2 + 2;
+    Program *p = malloc(sizeof(Program) + max_code_count * sizeof(Instruction) + source.count);
+    assert(p != NULL);
+    char *source_copy = (char *) &p->code[max_code_count];
+    memcpy(source_copy, source.str, source.count);
+    p->hash = program_hash(source);
+    p->source = (String_View) { .str = source_copy, .count = source.count };
+    p->code_count = 0;
+
+    String_View prog = p->source;
+    for (prog = string_view_drop_ws(prog); prog.count > 0; prog = string_view_drop_ws(string_view_drop_non_ws(prog))) {
+        String_View token = string_view_take_non_ws(prog);
+        Instruction *ins = &p->code[p->code_count++];
+        Command c;
+        if (string_view_try_parse_int(token, &ins->x)) {
+            ins->kind = INSTRUCTION_PUSH_INT;
+        } else if (!string_view_all_graph(token)) {
+            // nothing after the error is executed
+            ins->kind = INSTRUCTION_ERROR;
+            break;
+        } else if (command_lookup(token, &c)) {
+            ins->kind = INSTRUCTION_COMMAND;
+            ins->command = c;
+        } else {
+            ins->kind = INSTRUCTION_PUSH_STRING;
+            ins->str = token;
+        }
+    }
+    p->code[p->code_count++].kind = INSTRUCTION_END;
+    assert(p->code_count <= max_code_count);
+    return p;
 }
 
-Task *task_or(Task *fst, Then_Function f) {
-    Task *t = task_alloc();
-    t->kind = TASK_KIND_OR;
-    t->fst = fst;
-    t->snd = NULL;
-    t->then = f;
-    return t;
+// The compiled program for source, it stays valid until the next call
+Program *program_cache_get(String_View source) {
+    uint32_t hash = program_hash(source);
+    Program **slot = &program_cache.items[hash % PROGRAM_CACHE_CAPACITY];
+    Program *p = *slot;
+    if (p != NULL && p->hash == hash && p->source.count == source.count && memcmp(p->source.str, source.str, source.count) == 0) {
+        program_cache.hits++;
+        return p;
+    }
+    program_cache.misses++;
+    free(p);
+    *slot = program_compile(source);
+    return *slot;
 }
 
-Task *task_file_context(Task *body) {
-    Task *t = task_alloc();
-    t->kind = TASK_KIND_CONTEXT;
-    t->context_kind = CONTEXT_KIND_FIFO;
-    t->context_body = body;
-    return t;
+void program_cache_free_all() {
+    for (size_t i=0; i<PROGRAM_CACHE_CAPACITY; i++) {
+        free(program_cache.items[i]);
+        program_cache.items[i] = NULL;
+    }
 }
 
-Task *task_curl_easy_context(Task *body) {
-    Task *t = task_alloc();
-    t->kind = TASK_KIND_CONTEXT;
-    t->context_kind = CONTEXT_KIND_CURL_EASY;
-    t->context_body = body;
-    return t;
+Reply_Kind program_run(Program *p) {
+    Instruction *ip = p->code;
+#if defined(__GNUC__) || defined(__clang__)
+    // direct threaded: every instruction jumps straight to the code of the next one
+    static void *dispatch[INSTRUCTION_KIND_COUNT] = {
+        [INSTRUCTION_PUSH_INT]    = &&push_int,
+        [INSTRUCTION_PUSH_STRING] = &&push_string,
+        [INSTRUCTION_COMMAND]     = &&command,
+        [INSTRUCTION_ERROR]       = &&error,
+        [INSTRUCTION_END]         = &&end,
+    };
+#define DISPATCH() goto *dispatch[ip->kind]
+    DISPATCH();
+push_int:
+    stack_push_int(ip->x);
+    ip++;
+    DISPATCH();
+push_string:
+    stack_push_string(ip->str);
+    ip++;
+    DISPATCH();
+command:
+    {
+        Reply_Kind r = command_execute(ip->command);
+        if (r != REPLY_ACK) return r;
+        ip++;
+        DISPATCH();
+    }
+error:
+    return REPLY_ERROR;
+end:
+    return REPLY_ACK;
+#undef DISPATCH
+#else
+    for (;; ip++) {
+        switch (ip->kind) {
+            case INSTRUCTION_PUSH_INT:
+                stack_push_int(ip->x);
+                break;
+            case INSTRUCTION_PUSH_STRING:
+                stack_push_string(ip->str);
+                break;
+            case INSTRUCTION_COMMAND:
+                {
+                    Reply_Kind r = command_execute(ip->command);
+                    if (r != REPLY_ACK) return r;
+                    break;
+                }
+            case INSTRUCTION_ERROR:
+                return REPLY_ERROR;
+            case INSTRUCTION_END:
+                return REPLY_ACK;
+            case INSTRUCTION_KIND_COUNT:
+                UNREACHABLE("INSTRUCTION_KIND_COUNT is not a valid Instruction_Kind");
+        }
+    }
+#endif
+}
+
+Reply_Kind execute(String_View prog) {
+    return program_run(program_cache_get(prog));
+}
+
+// Reads everything that is available from fd and executes every complete line in the session s.
+// The buffer is only read again if the last read filled it.
+Result session_read(Session *s, int fd) {
+    Line_Buffer *b = &s->input;
+    Session *prev = session;
+    session = s;
+    Result result = RESULT_PENDING;
+    for (;;) {
+        if (!line_buffer_reserve(b)) {
+            session_printf("[ERROR] Command is longer than %d bytes, it is dropped\n", LINE_BUFFER_MAX_CAPACITY);
+            line_buffer_drop_line(b);
+            line_buffer_reserve(b);
+        }
+        size_t space = b->capacity - b->count;
+        ssize_t r = read(fd, b->items + b->count, space);
+        if (r == 0) {
+            // the client closed the connection
+            result = RESULT_DONE;
+            break;
+        } else if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_printf(LOG_LEVEL_ERROR, "Could not read from file: %s\n", strerror(errno));
+                result = RESULT_ERROR;
+            }
+            break;
+        }
+        b->count += r;
+        String_View line;
+        bool closed = false;
+        while (!closed && line_buffer_next_line(b, &line)) {
+            switch (execute(line)) {
+                case REPLY_CLOSE:
+                    closed = true;
+                    break;
+                case REPLY_ACK:
+                    break;
+                case REPLY_ERROR:
+                    session_printf("[ERROR] Command caused error, try again\n");
+                    break;
+                case REPLY_REFUSED:
+                    break;
+            }
+        }
+        if (closed) {
+            result = RESULT_DONE;
+            break;
+        }
+        if ((size_t) r < space) break;
+    }
+    session = prev;
+    return result;
+}
+
+bool as_tg_chat(json_value_t *value, Tg_Chat *chat) {
+    json_object_t *object = json_value_as_object(value);
+    if (object == NULL) return false;
+
+    json_value_t *id_value = json_element_by_key(object, "id");
+    if (id_value == NULL) return false;
+    json_number_t *id_number = json_value_as_number(id_value);
+    if (id_number == NULL) return false;
+    char *endptr;
+    chat_id_t id = strtol(id_number->number, &endptr, 10);
+    assert(endptr[0] == '\0');
+    chat->id = id;
+
+    return true;
+}
+
+Tg_Message *as_tg_message(Arena *a, json_value_t *value) {
+    json_object_t *object = json_value_as_object(value);
+    if (object == NULL) return NULL;
+
+    Tg_Message result;
+    {
+        json_value_t *id_value = json_element_by_key(object, "message_id");
+        if (id_value == NULL) return NULL;
+        json_number_t *id_number = json_value_as_number(id_value);
+        if (id_number == NULL) return NULL;
+        char *endptr;
+        message_id_t id = strtol(id_number->number, &endptr, 10);
+        assert(endptr[0] == '\0');
+        result.message_id = id;
+    }
+
+    {
+        json_value_t *chat_value = json_element_by_key(object, "chat");
+        if (chat_value == NULL) return NULL;
+        result.chat = arena_alloc(a, sizeof(Tg_Chat));
+        if (!as_tg_chat(chat_value, result.chat)) return NULL;
+    }
+    
+    {
+        result.from = NULL;
+        json_value_t *from_value = json_element_by_key(object, "from");
+        if (from_value != NULL) {
+            result.from = arena_alloc(a, sizeof(Tg_User));
+            if (!as_tg_user(from_value, result.from)) return NULL;
+        }
+    }
+    
+    {
+        result.text = NULL;
+        json_value_t *text_value = json_element_by_key(object, "text");
+        if (text_value != NULL) {
+            json_string_t *text_string = json_value_as_string(text_value);
+            if (text_string == NULL) return NULL;
+            result.text = text_string->string;
+        }
+    }
+
+    {
+        result.date = 0;
+        json_value_t *date_value = json_element_by_key(object, "date");
+        if (date_value != NULL) {
+            // the date is only used for metrics, a date that is not an integer is ignored
+            json_number_t *date_number = json_value_as_number(date_value);
+            if (date_number != NULL) {
+                char *endptr;
+                result.date = strtoll(date_number->number, &endptr, 10);
+                if (endptr[0] != '\0') result.date = 0;
+            }
+        }
+    }
+
+    return arena_memdup(a, &result, sizeof(result));
+}
+
+Tg_Update *as_tg_update(Arena *a, json_value_t *value) {
+    json_object_t *as_obj = json_value_as_object(value);
+    if (as_obj == NULL) return NULL;
+
+    Tg_Update result;
+
+    json_value_t *id_value = json_element_by_key(as_obj, "update_id");
+    if (id_value == NULL) return NULL;
+    json_number_t *id_number = json_value_as_number(id_value);
+    if (id_number == NULL) return NULL;
+    char *endptr;
+    update_id_t id = strtol(id_number->number, &endptr, 10);
+    assert(endptr[0] == '\0');
+    result.update_id = id;
+
+    json_value_t *message_value = json_element_by_key(as_obj, "message");
+    // message is an optional field
+    result.message = NULL;
+    if (message_value != NULL) {
+        result.message = as_tg_message(a, message_value);
+        if (result.message == NULL) return NULL;
+    }
+
+    return arena_memdup(a, &result, sizeof(result));
+}
+
+/******************************
+ * json_index_*               *
+ ******************************/
+
+// Stage 1 of decoding json: finds the offsets of all quotes that delimit strings
+// and of all braces and brackets outside of strings in one pass over 64 byte blocks.
+// The decoder uses the index to jump over strings and nested values instead of reading them byte by byte.
+#define JSON_INDEX_BLOCK_SIZE 64
+
+typedef struct {
+    uint32_t *items;
+    size_t count;
+    size_t capacity;
+} Json_Index;
+
+// Bitmasks of one block, bit i stands for byte i
+typedef struct {
+    uint64_t quote;
+    uint64_t backslash;
+    // '{', '}', '[' and ']'
+    uint64_t bracket;
+    // bytes below 0x20, they are not allowed inside of strings
+    uint64_t control;
+} Json_Block_Masks;
+
+Json_Block_Masks json_index_scan_block_scalar(const char *block) {
+    Json_Block_Masks m = {0};
+    for (size_t i=0; i<JSON_INDEX_BLOCK_SIZE; i++) {
+        uint64_t bit = (uint64_t) 1 << i;
+        switch (block[i]) {
+            case '"':  m.quote     |= bit; break;
+            case '\\': m.backslash |= bit; break;
+            case '{':
+            case '}':
+            case '[':
+            case ']':  m.bracket   |= bit; break;
+            default:
+                if ((unsigned char) block[i] < 0x20) m.control |= bit;
+                break;
+        }
+    }
+    return m;
+}
+
+#ifdef __SSE2__
+Json_Block_Masks json_index_scan_block_sse2(const char *block) {
+    Json_Block_Masks m = {0};
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    // '[' and ']' only differ from '{' and '}' in the bit 0x20
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i open = _mm_set1_epi8('{');
+    const __m128i close = _mm_set1_epi8('}');
+    const __m128i control_max = _mm_set1_epi8(0x1F);
+    for (size_t i=0; i<JSON_INDEX_BLOCK_SIZE; i+=16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (block + i));
+        __m128i folded = _mm_or_si128(v, case_bit);
+        uint64_t q = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, quote));
+        uint64_t b = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, backslash));
+        uint64_t s = (uint16_t) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close)));
+        // there is no unsigned compare, v <= 0x1F is max(v, 0x1F) == 0x1F
+        uint64_t c = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, control_max), control_max));
+        m.quote     |= q << i;
+        m.backslash |= b << i;
+        m.bracket   |= s << i;
+        m.control   |= c << i;
+    }
+    return m;
+}
+
+#define json_index_scan_block json_index_scan_block_sse2
+#else
+#define json_index_scan_block json_index_scan_block_scalar
+#endif // __SSE2__
+
+// State that is carried from one block to the next
+typedef struct {
+    // the first byte of the next block is escaped by a backslash
+    bool escape_carry;
+    // the next block starts inside of a string
+    bool in_string;
+} Json_Index_State;
+
+// Bits of bytes that are escaped by a backslash, backslashes are rare so they are visited one by one
+uint64_t json_index_escaped(uint64_t backslash, bool *escape_carry) {
+    uint64_t escaped = 0;
+    if (*escape_carry) {
+        escaped |= 1;
+        backslash &= ~(uint64_t) 1;
+    }
+    *escape_carry = false;
+    while (backslash != 0) {
+        int i = __builtin_ctzll(backslash);
+        if (i == 63) {
+            *escape_carry = true;
+            break;
+        }
+        escaped |= (uint64_t) 1 << (i+1);
+        // the escaped byte can not escape anything itself
+        backslash &= ~((uint64_t) 3 << i);
+    }
+    return escaped;
 }
 
-Task *task_curl_multi_context(Task *body) {
-    Task *t = task_alloc();
-    t->kind = TASK_KIND_CONTEXT;
-    t->context_kind = CONTEXT_KIND_CURL_MULTI;
-    t->context_body = body;
-    return t;
+// Bits of the bytes that are part of a string, including the opening but not the closing quote
+uint64_t json_index_in_string(uint64_t quote, bool *in_string) {
+    uint64_t m = quote;
+    m ^= m << 1;
+    m ^= m << 2;
+    m ^= m << 4;
+    m ^= m << 8;
+    m ^= m << 16;
+    m ^= m << 32;
+    if (*in_string) m = ~m;
+    *in_string = (m >> 63) != 0;
+    return m;
 }
 
-Task *task_curl_global_context(Task *body) {
-    Task *t = task_alloc();
-    t->kind = TASK_KIND_CONTEXT;
-    t->context_kind = CONTEXT_KIND_CURL_GLOBAL;
-    t->context_body = body;
-    return t;
+// Returns false if the source ends inside of a string or a string contains a control character
+bool json_index_build(Arena *a, String_View src, Json_Index *index) {
+    assert(src.count < UINT32_MAX);
+    // a guess for typical responses, the index grows if a block has more entries than are left
+    index->capacity = src.count/4 + JSON_INDEX_BLOCK_SIZE;
+    index->items = arena_alloc(a, index->capacity * sizeof(uint32_t));
+    index->count = 0;
+    Json_Index_State state = {0};
+    for (size_t base=0; base<src.count; base+=JSON_INDEX_BLOCK_SIZE) {
+        Json_Block_Masks m;
+        if (src.count - base >= JSON_INDEX_BLOCK_SIZE) {
+            m = json_index_scan_block(src.str + base);
+        } else {
+            // the last block is padded with spaces
+            char tail[JSON_INDEX_BLOCK_SIZE];
+            memset(tail, ' ', JSON_INDEX_BLOCK_SIZE);
+            memcpy(tail, src.str + base, src.count - base);
+            m = json_index_scan_block(tail);
+        }
+        uint64_t escaped = json_index_escaped(m.backslash, &state.escape_carry);
+        uint64_t quote = m.quote & ~escaped;
+        uint64_t in_string = json_index_in_string(quote, &state.in_string);
+        if ((m.control & in_string) != 0) return false;
+        uint64_t bits = quote | (m.bracket & ~escaped & ~in_string);
+
+        size_t needed = index->count + __builtin_popcountll(bits);
+        if (needed > index->capacity) {
+            size_t capacity = index->capacity;
+            while (capacity < needed) capacity *= 2;
+            // arena_realloc copies byte by byte
+            uint32_t *items = arena_alloc(a, capacity * sizeof(uint32_t));
+            memcpy(items, index->items, index->count * sizeof(uint32_t));
+            index->items = items;
+            index->capacity = capacity;
+        }
+        while (bits != 0) {
+            index->items[index->count++] = base + __builtin_ctzll(bits);
+            bits &= bits - 1;
+        }
+    }
+    return !state.in_string;
 }
 
-Task *task_curl_setup(Result r) {
-    assert(r.state == STATE_DONE);
-    assert(r.kind == RESULT_KIND_STRING_VIEW);
-
-    Task *t = task_alloc();
-    t->kind = TASK_KIND_CURL_SETUP;
-    t->url_setup = r.string_view;
-    return t;
-}
+/******************************
+ * tg_decode_*                *
+ ******************************/
 
-Task *task_curl_perform(Result r) {
-    assert(r.state == STATE_DONE);
-    assert(r.kind == RESULT_KIND_VOID);
+// Single pass decoder from the bytes of a response straight into the Tg_* types.
+// Only the fields the Tg_* types know are kept, everything else is skipped without allocating.
+#define TG_DECODE_MAX_DEPTH 64
 
-    Task *t = task_alloc();
-    t->kind = TASK_KIND_CURL_PERFORM;
-    t->curl_perform_sb.arena = NULL;
-    return t;
+typedef struct {
+    const char *start;
+    const char *cur;
+    const char *end;
+    Arena *arena;
+    size_t depth;
+    // structural index of the source, the decoder reads byte by byte if it is NULL
+    Json_Index *index;
+    // first entry of the index that is not behind cur
+    size_t index_pos;
+} Tg_Decoder;
+
+Tg_Decoder tg_decoder_init(Arena *a, String_View src, Json_Index *index) {
+    Tg_Decoder d = {
+        .start = src.str,
+        .cur = src.str,
+        .end = src.str + src.count,
+        .arena = a,
+        .depth = 0,
+        .index = index,
+        .index_pos = 0,
+    };
+    return d;
 }
 
-Task *task_curl_setup_and_perform(Result r) {
-    return task_and(task_curl_setup(r), task_curl_perform);
+// Moves index_pos to the entry of cur if there is one
+bool tg_decode_index_seek(Tg_Decoder *d) {
+    uint32_t offset = d->cur - d->start;
+    while (d->index_pos < d->index->count && d->index->items[d->index_pos] < offset) d->index_pos++;
+    return d->index_pos < d->index->count && d->index->items[d->index_pos] == offset;
 }
 
-Task *task_parse_json_value(Result r) {
-    assert(r.state == STATE_DONE);
-    assert(r.kind == RESULT_KIND_STRING_VIEW);
-
-    Task *t = task_alloc();
-    t->kind = TASK_KIND_PARSE_JSON_VALUE;
-    t->json_source_str = r.string_view;
-    return t;
+void tg_decode_ws(Tg_Decoder *d) {
+    while (d->cur < d->end && (*d->cur == ' ' || *d->cur == '\t' || *d->cur == '\n' || *d->cur == '\r')) d->cur++;
 }
 
-json_value_t *json_element_by_key(json_object_t *obj, const char *name) {
-    for (json_object_element_t *elem = obj->start; elem != NULL; elem = elem->next) {
-        if (strncmp(name, elem->name->string, elem->name->string_size) == 0) {
-            return elem->value;
-        }
-    }
-    return NULL;
+// Unlike isdigit this is defined for negative chars and does not depend on the locale
+bool tg_decode_is_digit(char c) {
+    return '0' <= c && c <= '9';
 }
 
-bool as_tg_user(json_value_t *value, Tg_User *user) {
-    json_object_t *object = json_value_as_object(value);
-    if (object == NULL) return false;
+bool tg_decode_peek(Tg_Decoder *d, char c) {
+    tg_decode_ws(d);
+    return d->cur < d->end && *d->cur == c;
+}
 
-    json_value_t *value_first_name = json_element_by_key(object, "first_name");
-    if (value_first_name == NULL) return false;
-    json_string_t *string_first_name = json_value_as_string(value_first_name);
-    if (string_first_name == NULL) return false;
-    user->first_name = string_first_name->string;
+bool tg_decode_char(Tg_Decoder *d, char c) {
+    if (!tg_decode_peek(d, c)) return false;
+    d->cur++;
     return true;
 }
 
-Result unpack_tg_response(Result r) {
-    assert(r.state == STATE_DONE);
-    assert(r.kind == RESULT_KIND_JSON_VALUE);
+bool tg_decode_literal(Tg_Decoder *d, const char *lit) {
+    size_t n = strlen(lit);
+    if ((size_t) (d->end - d->cur) < n || strncmp(d->cur, lit, n) != 0) return false;
+    d->cur += n;
+    return true;
+}
 
-    if (r.json_value == NULL) {
-        UNIMPLEMENTED("unpack_tg_response");
-    } else {
-        json_object_t *object = json_value_as_object(r.json_value);
-        if (object == NULL) {
-            UNIMPLEMENTED("unpack_tg_response");
-        }
-        json_value_t *ok_value = json_element_by_key(object, "ok");
-        if (ok_value == NULL) {
-            UNIMPLEMENTED("unpack_tg_response");
-        }
-        if (json_value_is_true(ok_value)) {
-            json_value_t *result_value = json_element_by_key(object, "result");
-            if (result_value == NULL) {
-                UNIMPLEMENTED("unpack_tg_response");
-            }
-            return result_json_value(result_value);
-        } else if (json_value_is_false(ok_value)) {
-            json_value_t *description_value = json_element_by_key(object, "description");
-            if (description_value == NULL) {
-                UNIMPLEMENTED("unpack_tg_response");
-            }
-            json_string_t *description_string = json_value_as_string(description_value);
-            if (description_string == NULL) {
-                UNIMPLEMENTED("unpack_tg_response");
-            }
-            return result_err_string_view(string_view_from_json_string(description_string));
-        } else {
-            UNIMPLEMENTED("unpack_tg_response");
+// The raw bytes between the quotes, escape sequences are left as they are
+bool tg_decode_raw_string(Tg_Decoder *d, String_View *raw, bool *escaped) {
+    if (!tg_decode_peek(d, '"')) return false;
+    if (d->index != NULL) {
+        // the closing quote is the next entry of the index
+        if (!tg_decode_index_seek(d) || d->index_pos + 1 >= d->index->count) return false;
+        const char *close = d->start + d->index->items[d->index_pos + 1];
+        if (*close != '"') return false;
+        raw->str = d->cur + 1;
+        raw->count = close - raw->str;
+        *escaped = memchr(raw->str, '\\', raw->count) != NULL;
+        d->index_pos += 2;
+        d->cur = close + 1;
+        return true;
+    }
+    d->cur++;
+    const char *start = d->cur;
+    *escaped = false;
+    while (d->cur < d->end && *d->cur != '"') {
+        if (*d->cur == '\\') {
+            *escaped = true;
+            d->cur++;
+        } else if ((unsigned char) *d->cur < 0x20) {
+            return false;
         }
+        d->cur++;
     }
+    if (d->cur >= d->end) return false;
+    raw->str = start;
+    raw->count = d->cur - start;
+    d->cur++;
+    return true;
 }
 
-Result get_tg_user(Result r) {
-    assert(r.state == STATE_DONE);
-    assert(r.kind == RESULT_KIND_JSON_VALUE);
-
-    if (r.json_value == NULL) {
-        UNIMPLEMENTED("get_tg_user");
+int tg_decode_hex4(const char *s) {
+    int acc = 0;
+    for (size_t i=0; i<4; i++) {
+        char c = s[i];
+        acc *= 16;
+        if ('0' <= c && c <= '9') acc += c - '0';
+        else if ('a' <= c && c <= 'f') acc += c - 'a' + 10;
+        else if ('A' <= c && c <= 'F') acc += c - 'A' + 10;
+        else return -1;
     }
-    Tg_User user;
-    if (as_tg_user(r.json_value, &user)) {
-        printf("[INFO] User named '%s'\n", user.first_name);
-        return RESULT_DONE;
+    return acc;
+}
+
+size_t tg_decode_utf8(uint32_t cp, char *out) {
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = 0xC0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    } else if (cp < 0x10000) {
+        out[0] = 0xE0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3F);
+        out[2] = 0x80 | (cp & 0x3F);
+        return 3;
     } else {
-        UNIMPLEMENTED("get_tg_user");
+        out[0] = 0xF0 | (cp >> 18);
+        out[1] = 0x80 | ((cp >> 12) & 0x3F);
+        out[2] = 0x80 | ((cp >> 6) & 0x3F);
+        out[3] = 0x80 | (cp & 0x3F);
+        return 4;
     }
 }
 
-Task *task_get_tg_user(Result r) {
-    return task_pure(r, get_tg_user);
+// Decodes a string into a null terminated copy in the arena
+bool tg_decode_string(Tg_Decoder *d, const char **result) {
+    String_View raw;
+    bool escaped;
+    if (!tg_decode_raw_string(d, &raw, &escaped)) return false;
+    // the decoded string is never longer than the raw one
+    char *out = arena_alloc(d->arena, raw.count + 1);
+    if (!escaped) {
+        memcpy(out, raw.str, raw.count);
+        out[raw.count] = '\0';
+        *result = out;
+        return true;
+    }
+    size_t n = 0;
+    for (size_t i=0; i<raw.count; i++) {
+        if (raw.str[i] != '\\') {
+            out[n++] = raw.str[i];
+            continue;
+        }
+        i++;
+        switch (raw.str[i]) {
+            case '"':  out[n++] = '"';  break;
+            case '\\': out[n++] = '\\'; break;
+            case '/':  out[n++] = '/';  break;
+            case 'b':  out[n++] = '\b'; break;
+            case 'f':  out[n++] = '\f'; break;
+            case 'n':  out[n++] = '\n'; break;
+            case 'r':  out[n++] = '\r'; break;
+            case 't':  out[n++] = '\t'; break;
+            case 'u':
+                {
+                    if (i + 4 >= raw.count) return false;
+                    int hi = tg_decode_hex4(raw.str + i + 1);
+                    if (hi < 0) return false;
+                    i += 4;
+                    uint32_t cp = hi;
+                    if (0xD800 <= hi && hi < 0xDC00) {
+                        // surrogate pair, the raw form takes 12 bytes for the 4 bytes of utf-8
+                        if (i + 6 >= raw.count || raw.str[i+1] != '\\' || raw.str[i+2] != 'u') return false;
+                        int lo = tg_decode_hex4(raw.str + i + 3);
+                        if (lo < 0xDC00 || lo >= 0xE000) return false;
+                        i += 6;
+                        cp = 0x10000 + ((hi - 0xD800) << 10) + (lo - 0xDC00);
+                    }
+                    // the result is null terminated, a null character would cut it short
+                    if (cp == 0) return false;
+                    n += tg_decode_utf8(cp, out + n);
+                    break;
+                }
+            default:
+                return false;
+        }
+    }
+    out[n] = '\0';
+    *result = out;
+    return true;
 }
 
-Task *catch_unpack(Result r) {
-    assert(r.state == STATE_ERROR);
-    assert(r.kind == RESULT_KIND_STRING_VIEW);
-    printf("[ERROR] telegram api returned error: %.*s\n", (int) r.string_view.count, r.string_view.str);
-
-    return task_const(RESULT_ERROR);
+bool tg_decode_int64(Tg_Decoder *d, int64_t *result) {
+    tg_decode_ws(d);
+    bool negative = false;
+    if (d->cur < d->end && *d->cur == '-') {
+        negative = true;
+        d->cur++;
+    }
+    if (d->cur >= d->end || !tg_decode_is_digit(*d->cur)) return false;
+    int64_t acc = 0;
+    while (d->cur < d->end && tg_decode_is_digit(*d->cur)) {
+        int digit = *d->cur - '0';
+        // out of range of int64_t, the magnitude of INT64_MIN is not accepted either
+        if (acc > (INT64_MAX - digit) / 10) return false;
+        acc = 10*acc + digit;
+        d->cur++;
+    }
+    // ids are integers, a fraction or exponent means this is not one
+    if (d->cur < d->end && (*d->cur == '.' || *d->cur == 'e' || *d->cur == 'E')) return false;
+    *result = negative ? -acc : acc;
+    return true;
 }
 
-Task *task_unpack_and_get_tg_user(Result r) {
-    assert(r.state == STATE_DONE);
-    assert(r.kind == RESULT_KIND_JSON_VALUE);
-
-    return task_and(task_or(task_pure(r, unpack_tg_response), catch_unpack), task_get_tg_user);
+bool tg_decode_bool(Tg_Decoder *d, bool *result) {
+    tg_decode_ws(d);
+    if (tg_decode_literal(d, "true")) {
+        *result = true;
+        return true;
+    }
+    if (tg_decode_literal(d, "false")) {
+        *result = false;
+        return true;
+    }
+    return false;
 }
 
-Task *task_get_tg_update_list(Result r) {
-    assert(r.state == STATE_DONE);
-    assert(r.kind == RESULT_KIND_JSON_VALUE);
-
-    Task *t = task_alloc();
-    t->kind = TASK_KIND_GET_TG_UPDATE_LIST;
-    t->json_root = r.json_value;
-    return t;
+bool tg_decode_object_begin(Tg_Decoder *d) {
+    if (d->depth >= TG_DECODE_MAX_DEPTH) return false;
+    if (!tg_decode_char(d, '{')) return false;
+    d->depth++;
+    return true;
 }
 
-Task *task_unpack_and_get_tg_update_list(Result r) {
-    assert(r.state == STATE_DONE);
-    assert(r.kind == RESULT_KIND_JSON_VALUE);
-
-    return task_and(task_or(task_pure(r, unpack_tg_response), catch_unpack), task_get_tg_update_list);
+// Reads the key of the i-th member of an object up to and including the colon.
+// Returns false at the end of the object, *ok tells whether the end was reached without an error.
+bool tg_decode_object_next(Tg_Decoder *d, size_t i, String_View *key, bool *ok) {
+    *ok = false;
+    if (tg_decode_char(d, '}')) {
+        d->depth--;
+        *ok = true;
+        return false;
+    }
+    if (i > 0 && !tg_decode_char(d, ',')) return false;
+    bool escaped;
+    if (!tg_decode_raw_string(d, key, &escaped)) return false;
+    if (!tg_decode_char(d, ':')) return false;
+    *ok = true;
+    return true;
 }
 
-Task *task_context_arena(Task *body, Arena arena) {
-    Task *t = task_alloc();
-    t->kind = TASK_KIND_CONTEXT;
-    t->context_kind = CONTEXT_KIND_ARENA;
-    t->context_body = body;
-
-    t->context_arena = arena;
-
-    return t;
+bool tg_decode_array_begin(Tg_Decoder *d) {
+    if (d->depth >= TG_DECODE_MAX_DEPTH) return false;
+    if (!tg_decode_char(d, '[')) return false;
+    d->depth++;
+    return true;
 }
 
-// TODO: create a mechanism to put this variable in a task (kind of like currying)
-String_View url_copy;
-
-Task *catch_getme(Result r) {
-    assert(r.state == STATE_ERROR);
-    printf("[ERROR] error when requesting url '%.*s'\n", (int) url_copy.count, url_copy.str);
-    return task_const(RESULT_ERROR);
+// Positions the decoder at the i-th element of an array, see tg_decode_object_next
+bool tg_decode_array_next(Tg_Decoder *d, size_t i, bool *ok) {
+    *ok = false;
+    if (tg_decode_char(d, ']')) {
+        d->depth--;
+        *ok = true;
+        return false;
+    }
+    if (i > 0 && !tg_decode_char(d, ',')) return false;
+    *ok = true;
+    return true;
 }
 
-Task *task_call_getme(String_View url) {
-    Arena a = {0};
-    url_copy = (String_View) {
-        .str = arena_memdup(&a, url.str, url.count),
-        .count = url.count,
-    };
-    return task_curl_easy_context( 
-            task_context_arena(
-                task_or(
-                    task_and(
-                        task_and(
-                            task_curl_setup_and_perform(result_string_view(url_copy)),
-                            task_parse_json_value
-                            ),
-                        task_unpack_and_get_tg_user
-                    ),
-                    catch_getme
-                ),
-                a
-                )
-            ); 
+bool tg_decode_skip(Tg_Decoder *d) {
+    tg_decode_ws(d);
+    if (d->cur >= d->end) return false;
+    bool ok;
+    if (d->index != NULL && (*d->cur == '{' || *d->cur == '[')) {
+        // jump to the matching closing bracket, the quotes of strings in the index are passed over.
+        // Like the byte by byte path this limits the nesting and requires each bracket to be closed by its own kind.
+        if (!tg_decode_index_seek(d)) return false;
+        char closing[TG_DECODE_MAX_DEPTH];
+        size_t depth = 0;
+        for (size_t i=d->index_pos; i<d->index->count; i++) {
+            char c = d->start[d->index->items[i]];
+            if (c == '{' || c == '[') {
+                if (d->depth + depth >= TG_DECODE_MAX_DEPTH) return false;
+                closing[depth++] = c == '{' ? '}' : ']';
+            } else if (c == '}' || c == ']') {
+                if (closing[--depth] != c) return false;
+                if (depth == 0) {
+                    d->cur = d->start + d->index->items[i] + 1;
+                    d->index_pos = i + 1;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    switch (*d->cur) {
+        case '{':
+            {
+                if (!tg_decode_object_begin(d)) return false;
+                String_View key;
+                for (size_t i=0; tg_decode_object_next(d, i, &key, &ok); i++) {
+                    if (!tg_decode_skip(d)) return false;
+                }
+                return ok;
+            }
+        case '[':
+            {
+                if (!tg_decode_array_begin(d)) return false;
+                for (size_t i=0; tg_decode_array_next(d, i, &ok); i++) {
+                    if (!tg_decode_skip(d)) return false;
+                }
+                return ok;
+            }
+        case '"':
+            {
+                String_View raw;
+                bool escaped;
+                return tg_decode_raw_string(d, &raw, &escaped);
+            }
+        case 't':
+            return tg_decode_literal(d, "true");
+        case 'f':
+            return tg_decode_literal(d, "false");
+        case 'n':
+            return tg_decode_literal(d, "null");
+        default:
+            {
+                const char *start = d->cur;
+                while (d->cur < d->end && (tg_decode_is_digit(*d->cur) || *d->cur == '+' || *d->cur == '-'
+                                           || *d->cur == '.' || *d->cur == 'e' || *d->cur == 'E')) {
+                    d->cur++;
+                }
+                return d->cur > start;
+            }
+    }
 }
 
-Task *task_call_getupdates(String_View url) {
-    Arena a = {0};
-    String_View url_copy = {
-        .str = arena_memdup(&a, url.str, url.count),
-        .count = url.count,
-    };
-    return task_curl_easy_context( 
-            task_context_arena(
-                task_and(
-                    task_and(
-                        task_curl_setup_and_perform(result_string_view(url_copy)),
-                        task_parse_json_value
-                        ),
-                    task_unpack_and_get_tg_update_list
-                ),
-                a
-                )
-            ); 
+bool tg_decode_user(Tg_Decoder *d, Tg_User *user) {
+    if (!tg_decode_object_begin(d)) return false;
+    bool has_first_name = false;
+    String_View key;
+    bool ok;
+    for (size_t i=0; tg_decode_object_next(d, i, &key, &ok); i++) {
+        if (string_view_eq_cstr(key, "first_name")) {
+            if (!tg_decode_string(d, &user->first_name)) return false;
+            has_first_name = true;
+        } else {
+            if (!tg_decode_skip(d)) return false;
+        }
+    }
+    return ok && has_first_name;
 }
 
-Task *runner = NULL;
+bool tg_decode_chat(Tg_Decoder *d, Tg_Chat *chat) {
+    if (!tg_decode_object_begin(d)) return false;
+    bool has_id = false;
+    String_View key;
+    bool ok;
+    for (size_t i=0; tg_decode_object_next(d, i, &key, &ok); i++) {
+        if (string_view_eq_cstr(key, "id")) {
+            int64_t id;
+            if (!tg_decode_int64(d, &id)) return false;
+            chat->id = id;
+            has_id = true;
+        } else {
+            if (!tg_decode_skip(d)) return false;
+        }
+    }
+    return ok && has_id;
+}
 
-Reply_Kind command_execute(Command c) {
-    switch (c) {
-        case HELP:
-            printf("[HELP] The following commands are accepted:\n");
-            for (Command i=0; i<COMMAND_COUNT; i++) {
-                printf("[HELP] \"%s\"\n", command_keyword[i]);
-                printf("[HELP]     Stack: %s\n", command_stack_config[i]);
-                printf("[HELP]     Description: %s\n", command_description[i]);
+bool tg_decode_message(Tg_Decoder *d, Tg_Message *message) {
+    if (!tg_decode_object_begin(d)) return false;
+    message->chat = NULL;
+    message->from = NULL;
+    message->text = NULL;
+    message->date = 0;
+    bool has_message_id = false;
+    String_View key;
+    bool ok;
+    for (size_t i=0; tg_decode_object_next(d, i, &key, &ok); i++) {
+        if (string_view_eq_cstr(key, "message_id")) {
+            int64_t id;
+            if (!tg_decode_int64(d, &id)) return false;
+            message->message_id = id;
+            has_message_id = true;
+        } else if (string_view_eq_cstr(key, "chat")) {
+            message->chat = arena_alloc(d->arena, sizeof(Tg_Chat));
+            if (!tg_decode_chat(d, message->chat)) return false;
+        } else if (string_view_eq_cstr(key, "from")) {
+            message->from = arena_alloc(d->arena, sizeof(Tg_User));
+            if (!tg_decode_user(d, message->from)) return false;
+        } else if (string_view_eq_cstr(key, "text")) {
+            if (!tg_decode_string(d, &message->text)) return false;
+        } else if (string_view_eq_cstr(key, "date")) {
+            // the date is only used for metrics, a date that is not an integer is ignored
+            const char *start = d->cur;
+            if (!tg_decode_int64(d, &message->date)) {
+                d->cur = start;
+                message->date = 0;
+                if (!tg_decode_skip(d)) return false;
             }
-            return REPLY_ACK;
-        case QUIT:
-            return REPLY_CLOSE;
-        case PRINT:
-            stack_print();
-            return REPLY_ACK;
-        case DROP:
-            stack_drop();
-            return REPLY_ACK;
-        case CLEAR:
-            while (stack_count > 0) stack_drop();
-            return REPLY_ACK;
-        case TG_GETME:
-            if (stack_string()) {
-                Arena temp = {0};
+        } else {
+            if (!tg_decode_skip(d)) return false;
+        }
+    }
+    return ok && has_message_id && message->chat != NULL;
+}
 
-                Tg_Method_Call call = new_tg_api_call_get_me(STACK_TOP.str);
-                String_View url = build_url(&temp, &call);
-                task_par_append(runner, task_curl_multi_context(task_call_getme(url)));
-                stack_drop();
+bool tg_decode_update(Tg_Decoder *d, Tg_Update *update) {
+    if (!tg_decode_object_begin(d)) return false;
+    update->message = NULL;
+    bool has_update_id = false;
+    String_View key;
+    bool ok;
+    for (size_t i=0; tg_decode_object_next(d, i, &key, &ok); i++) {
+        if (string_view_eq_cstr(key, "update_id")) {
+            int64_t id;
+            if (!tg_decode_int64(d, &id)) return false;
+            update->update_id = id;
+            has_update_id = true;
+        } else if (string_view_eq_cstr(key, "message")) {
+            update->message = arena_alloc(d->arena, sizeof(Tg_Message));
+            if (!tg_decode_message(d, update->message)) return false;
+        } else {
+            if (!tg_decode_skip(d)) return false;
+        }
+    }
+    return ok && has_update_id;
+}
 
-                arena_free(&temp);
-                return REPLY_ACK;
-            }
-            return REPLY_ERROR;
-        case TG_GETUPDATES:
-            if (stack_string()) {
-                Arena temp = {0};
+bool tg_decode_update_list(Tg_Decoder *d, Tg_Update_List *list) {
+    if (!tg_decode_array_begin(d)) return false;
+    bool ok;
+    for (size_t i=0; tg_decode_array_next(d, i, &ok); i++) {
+        Tg_Update update;
+        if (!tg_decode_update(d, &update)) return false;
+        arena_da_append(d->arena, list, update);
+    }
+    return ok;
+}
 
-                Tg_Method_Call call = new_tg_api_call_get_updates(STACK_TOP.str);
-                String_View url = build_url(&temp, &call);
-                task_par_append(runner, task_curl_multi_context(task_call_getupdates(url)));
-                stack_drop();
+// Decodes the response of a getUpdates call.
+// The result is the update list if telegram reports success and the description of the error otherwise.
+Result tg_decode_get_updates(Tg_Decoder *d) {
+    Arena *a = d->arena;
+    Tg_Update_List *list = arena_alloc(a, sizeof(Tg_Update_List));
+    *list = (Tg_Update_List) {0};
+    bool has_ok = false;
+    bool is_ok = false;
+    bool has_result = false;
+    const char *description = NULL;
+
+    if (!tg_decode_object_begin(d)) return RESULT_ERROR;
+    String_View key;
+    bool ok;
+    for (size_t i=0; tg_decode_object_next(d, i, &key, &ok); i++) {
+        if (string_view_eq_cstr(key, "ok")) {
+            if (!tg_decode_bool(d, &is_ok)) return RESULT_ERROR;
+            has_ok = true;
+        } else if (string_view_eq_cstr(key, "result")) {
+            if (!tg_decode_update_list(d, list)) return RESULT_ERROR;
+            has_result = true;
+        } else if (string_view_eq_cstr(key, "description")) {
+            if (!tg_decode_string(d, &description)) return RESULT_ERROR;
+        } else {
+            if (!tg_decode_skip(d)) return RESULT_ERROR;
+        }
+    }
+    if (!ok || !has_ok) return RESULT_ERROR;
+    tg_decode_ws(d);
+    if (d->cur != d->end) return RESULT_ERROR;
 
-                arena_free(&temp);
-                return REPLY_ACK;
-            }
-            return REPLY_ERROR;
-        case PLUS:
-            if (stack_two_int()) {
-                int x = stack[stack_count-1].x;
-                stack_drop();
-                stack[stack_count-1].x += x;
-                return REPLY_ACK;
-            }
-            return REPLY_ERROR;
-        case MINUS:
-            if (stack_two_int()) {
-                int x = stack[stack_count-1].x;
-                stack_drop();
-                stack[stack_count-1].x -= x;
-                return REPLY_ACK;
-            }
-            return REPLY_ERROR;
-        case TIMES:
-            if (stack_two_int()) {
-                int x = stack[stack_count-1].x;
-                stack_drop();
-                stack[stack_count-1].x *= x;
-                return REPLY_ACK;
-            }
-            return REPLY_ERROR;
-        case DIVIDE:
-            if (stack_two_int()) {
-                int x = stack[stack_count-1].x;
-                stack_drop();
-                stack[stack_count-1].x /= x;
-                return REPLY_ACK;
-            }
-            return REPLY_ERROR;
-        case COMMAND_COUNT:
-            UNREACHABLE("COMMAND_COUNT is not a valid Command");
+    if (!is_ok) {
+        if (description == NULL) return RESULT_ERROR;
+        return result_err_string_view(string_view_from_char_ptr((char *) description));
     }
-    UNREACHABLE("no valid Command");
+    if (!has_result) return RESULT_ERROR;
+    return result_tg_update_list(list);
 }
 
-Reply_Kind execute(String_View prog) {
-    for (prog = string_view_drop_ws(prog); prog.count > 0; prog = string_view_drop_ws(string_view_drop_non_ws(prog))) {
-        String_View token = string_view_take_non_ws(prog);
-        int val;
-        if (string_view_try_parse_int(token, &val)) {
-            stack_push_int(val);
-        } else if (string_view_all_graph(token)) {
-            bool matched = false;
-            for (Command i=0; i<COMMAND_COUNT && !matched; i++) {
-                // TODO: if there are commands that have the same prefix this can lead to errors
-                if (strncmp(token.str, command_keyword[i], token.count) == 0) {
-                    matched = true;
-                    Reply_Kind r = command_execute(i);
-                    switch (r) {
-                        case REPLY_ACK:
-                            break;
-                        case REPLY_CLOSE:
-                        case REPLY_ERROR:
-                            return r;
+Result tg_decode_get_updates_response(Arena *a, String_View src) {
+    Json_Index index;
+    if (!json_index_build(a, src, &index)) return RESULT_ERROR;
+    Tg_Decoder d = tg_decoder_init(a, src, &index);
+    return tg_decode_get_updates(&d);
+}
+
+// Reads only what the poller needs from a getUpdates response: the number of updates and the largest update_id.
+// The updates are skipped through the index, returns false if the response is malformed or telegram reports an error.
+bool tg_decode_get_updates_ids(Tg_Decoder *d, size_t *count, int64_t *max_id) {
+    *count = 0;
+    *max_id = -1;
+    bool is_ok = false;
+    bool has_result = false;
+    if (!tg_decode_object_begin(d)) return false;
+    String_View key;
+    bool ok;
+    for (size_t i=0; tg_decode_object_next(d, i, &key, &ok); i++) {
+        if (string_view_eq_cstr(key, "ok")) {
+            if (!tg_decode_bool(d, &is_ok)) return false;
+        } else if (string_view_eq_cstr(key, "result")) {
+            if (!tg_decode_array_begin(d)) return false;
+            bool update_ok;
+            for (size_t j=0; tg_decode_array_next(d, j, &update_ok); j++) {
+                if (!tg_decode_object_begin(d)) return false;
+                bool has_update_id = false;
+                bool member_ok;
+                for (size_t k=0; tg_decode_object_next(d, k, &key, &member_ok); k++) {
+                    if (string_view_eq_cstr(key, "update_id")) {
+                        int64_t id;
+                        if (!tg_decode_int64(d, &id)) return false;
+                        if (id > *max_id) *max_id = id;
+                        has_update_id = true;
+                    } else {
+                        if (!tg_decode_skip(d)) return false;
                     }
                 }
+                if (!member_ok || !has_update_id) return false;
+                *count += 1;
             }
-            if (!matched) stack_push_string(token);
+            if (!update_ok) return false;
+            has_result = true;
         } else {
-            return REPLY_ERROR;
+            if (!tg_decode_skip(d)) return false;
         }
     }
-    return REPLY_ACK;
+    if (!ok) return false;
+    tg_decode_ws(d);
+    return d->cur == d->end && is_ok && has_result;
 }
 
-bool as_tg_chat(json_value_t *value, Tg_Chat *chat) {
-    json_object_t *object = json_value_as_object(value);
-    if (object == NULL) return false;
-
-    json_value_t *id_value = json_element_by_key(object, "id");
-    if (id_value == NULL) return false;
-    json_number_t *id_number = json_value_as_number(id_value);
-    if (id_number == NULL) return false;
-    char *endptr;
-    chat_id_t id = strtol(id_number->number, &endptr, 10);
-    assert(endptr[0] == '\0');
-    chat->id = id;
+/******************************
+ * tg_call_decode_*           *
+ ******************************/
 
-    return true;
+void *json_parse_cb(void *arena, size_t size) {
+    return arena_alloc(arena, size);
 }
 
-Tg_Message *as_tg_message(Arena *a, json_value_t *value) {
-    json_object_t *object = json_value_as_object(value);
-    if (object == NULL) return NULL;
-
-    Tg_Message result;
-    {
-        json_value_t *id_value = json_element_by_key(object, "message_id");
-        if (id_value == NULL) return NULL;
-        json_number_t *id_number = json_value_as_number(id_value);
-        if (id_number == NULL) return NULL;
-        char *endptr;
-        message_id_t id = strtol(id_number->number, &endptr, 10);
-        assert(endptr[0] == '\0');
-        result.message_id = id;
+// Decoder of getMe for task_tg_call, logs the name of the bot
+Result tg_call_decode_get_me(Arena *a, String_View body, Context *ctx, void *data) {
+    UNUSED(ctx);
+    UNUSED(data);
+    json_value_t *root = json_parse_ex(body.str, body.count, json_parse_flags_default, json_parse_cb, a, NULL);
+    if (root == NULL) {
+        log_printf(LOG_LEVEL_ERROR, "Failed to parse json value\n");
+        return RESULT_ERROR;
+    }
+    Result r = unpack_tg_response(result_json_value(root));
+    if (r.state == STATE_ERROR) {
+        if (r.kind == RESULT_KIND_STRING_VIEW) {
+            log_printf(LOG_LEVEL_ERROR, "telegram api returned error: %.*s\n", (int) r.string_view.count, r.string_view.str);
+        } else {
+            log_printf(LOG_LEVEL_ERROR, "Failed to decode getMe response\n");
+        }
+        return RESULT_ERROR;
     }
+    return get_tg_user(r);
+}
 
-    {
-        json_value_t *chat_value = json_element_by_key(object, "chat");
-        if (chat_value == NULL) return NULL;
-        result.chat = arena_alloc(a, sizeof(Tg_Chat));
-        if (!as_tg_chat(chat_value, result.chat)) return NULL;
+// A getUpdates response that is decoded and printed by its own task, see tg_call_decode_get_updates
+typedef struct {
+    // the arena of the task that owns the batch
+    Arena *arena;
+    String_View body;
+    Json_Index index;
+} Tg_Update_Batch;
+
+// The continuation of an empty AND, the batch is the data of the AND so PURE tasks stay small
+Task *tg_update_batch_print(Result r, void *data) {
+    UNUSED(r);
+    Tg_Update_Batch *batch = data;
+    Tg_Decoder d = tg_decoder_init(batch->arena, batch->body, &batch->index);
+    Result list = tg_decode_get_updates(&d);
+    if (list.state == STATE_ERROR) {
+        log_printf(LOG_LEVEL_ERROR, "Failed to decode getUpdates response\n");
+        return task_const(RESULT_ERROR);
     }
-    
-    {
-        result.from = NULL;
-        json_value_t *from_value = json_element_by_key(object, "from");
-        if (from_value != NULL) {
-            result.from = arena_alloc(a, sizeof(Tg_User));
-            if (!as_tg_user(from_value, result.from)) return NULL;
+    return task_const(print_tg_update_list(list));
+}
+
+// Decoder of getUpdates for task_tg_call.
+// Inside a CONTEXT_KIND_TG_POLLER the updates are confirmed to the poller. In pipelined mode only the
+// update ids are read before the batch is handed to its own task that takes over the arena, decodes and prints it.
+Result tg_call_decode_get_updates(Arena *a, String_View body, Context *ctx, void *data) {
+    UNUSED(data);
+    if (ctx->flag[CONTEXT_KIND_TG_POLLER] && ctx->tg_poller->pipelined) {
+        Tg_Poller *p = ctx->tg_poller;
+        Tg_Update_Batch *batch = arena_alloc(a, sizeof(Tg_Update_Batch));
+        batch->body = body;
+        size_t count;
+        int64_t max_id;
+        if (json_index_build(a, body, &batch->index)) {
+            Tg_Decoder d = tg_decoder_init(a, body, &batch->index);
+            if (tg_decode_get_updates_ids(&d, &count, &max_id)) {
+                if (count == 0) return RESULT_DONE;
+                // the next getUpdates can go out with the new offset while the batch is decoded
+                if (max_id >= p->offset) p->offset = max_id + 1;
+                assert(runner != NULL);
+                Arena batch_arena = *a;
+                *a = (Arena) {0};
+                Task *batch_task = task_context_arena(task_and(task_const(RESULT_DONE), tg_update_batch_print, batch), batch_arena);
+                batch->arena = &batch_task->context_arena;
+                task_par_append(runner, batch_task);
+                return RESULT_DONE;
+            }
         }
+        // errors are reported by the full decode below
     }
-    
-    {
-        result.text = NULL;
-        json_value_t *text_value = json_element_by_key(object, "text");
-        if (text_value != NULL) {
-            json_string_t *text_string = json_value_as_string(text_value);
-            if (text_string == NULL) return NULL;
-            result.text = text_string->string;
+    Result r = tg_decode_get_updates_response(a, body);
+    if (r.state == STATE_ERROR) {
+        if (r.kind == RESULT_KIND_STRING_VIEW) {
+            log_printf(LOG_LEVEL_ERROR, "telegram api returned error: %.*s\n", (int) r.string_view.count, r.string_view.str);
+        } else {
+            log_printf(LOG_LEVEL_ERROR, "Failed to decode getUpdates response\n");
         }
+        return RESULT_ERROR;
     }
-
-    return arena_memdup(a, &result, sizeof(result));
+    Tg_Update_List *list = r.tg_update_list;
+    if (ctx->flag[CONTEXT_KIND_TG_POLLER]) {
+        // confirm the updates so the next getUpdates does not return them again
+        Tg_Poller *p = ctx->tg_poller;
+        for (size_t i=0; i<list->count; i++) {
+            if (list->items[i].update_id >= p->offset) p->offset = list->items[i].update_id + 1;
+        }
+    }
+    return print_tg_update_list(r);
 }
 
-Tg_Update *as_tg_update(Arena *a, json_value_t *value) {
-    json_object_t *as_obj = json_value_as_object(value);
-    if (as_obj == NULL) return NULL;
-
-    Tg_Update result;
+/******************************
+ * curl_transfer_*            *
+ ******************************/
 
-    json_value_t *id_value = json_element_by_key(as_obj, "update_id");
-    if (id_value == NULL) return NULL;
-    json_number_t *id_number = json_value_as_number(id_value);
-    if (id_number == NULL) return NULL;
-    char *endptr;
-    update_id_t id = strtol(id_number->number, &endptr, 10);
-    assert(endptr[0] == '\0');
-    result.update_id = id;
+Curl_Transfer *curl_transfer_new(Arena *a, Task *t, CURL *easy_handle) {
+    Curl_Transfer *transfer = arena_alloc(a, sizeof(Curl_Transfer));
+    *transfer = (Curl_Transfer) {
+        .task = t,
+        .sb = arena_string_builder_init(a),
+        .multi_handle = NULL,
+        .easy_handle = easy_handle,
+        .started = false,
+        .done = false,
+        .code = CURLE_OK,
+    };
+    return transfer;
+}
 
-    json_value_t *message_value = json_element_by_key(as_obj, "message");
-    // message is an optional field
-    result.message = NULL;
-    if (message_value != NULL) {
-        result.message = as_tg_message(a, message_value);
-        if (result.message == NULL) return NULL;
+// Drives the transfer until the whole response is in transfer->sb.
+// With a multi handle the reactor performs it and wakes the task when it is finished,
+// without one it is performed on the first poll.
+Result curl_transfer_poll(Curl_Transfer *transfer, CURLM *multi_handle) {
+    Task *t = transfer->task;
+    if (!transfer->started) {
+        transfer->started = true;
+        CURLcode code = curl_easy_setopt(transfer->easy_handle, CURLOPT_WRITEDATA, &transfer->sb);
+        if (code != CURLE_OK) {
+            log_printf(LOG_LEVEL_ERROR, "failed curl_easy_setopt: %s\n", curl_easy_strerror(code));
+            return RESULT_ERROR;
+        }
+        if (multi_handle == NULL) {
+            PROBE2(curl__transfer__start, t->id, transfer->easy_handle);
+            code = curl_easy_perform(transfer->easy_handle);
+            PROBE3(curl__transfer__finish, t->id, code, transfer->sb.count);
+            metrics_observe_transfer(transfer->easy_handle, code);
+            if (code != CURLE_OK) {
+                log_printf(LOG_LEVEL_ERROR, "failed curl_easy_perform: %s\n", curl_easy_strerror(code));
+                return RESULT_ERROR;
+            }
+            return RESULT_DONE;
+        }
+        code = curl_easy_setopt(transfer->easy_handle, CURLOPT_PRIVATE, transfer);
+        if (code != CURLE_OK) {
+            log_printf(LOG_LEVEL_ERROR, "failed curl_easy_setopt: %s\n", curl_easy_strerror(code));
+            return RESULT_ERROR;
+        }
+        PROBE2(curl__transfer__start, t->id, transfer->easy_handle);
+        CURLMcode mcode = curl_multi_add_handle(multi_handle, transfer->easy_handle);
+        if (mcode != CURLM_OK) {
+            log_printf(LOG_LEVEL_ERROR, "failed curl_multi_add_handle: %s\n", curl_multi_strerror(mcode));
+            return RESULT_ERROR;
+        }
+        transfer->multi_handle = multi_handle;
+        metrics.curl_in_flight++;
+        return RESULT_PENDING;
     }
+    if (!transfer->done) return RESULT_PENDING;
 
-    return arena_memdup(a, &result, sizeof(result));
+    CURLMcode mcode = curl_multi_remove_handle(transfer->multi_handle, transfer->easy_handle);
+    if (mcode != CURLM_OK) {
+        log_printf(LOG_LEVEL_ERROR, "failed curl_multi_remove_handle: %s\n", curl_multi_strerror(mcode));
+    }
+    transfer->multi_handle = NULL;
+    metrics.curl_in_flight--;
+    PROBE3(curl__transfer__finish, t->id, transfer->code, transfer->sb.count);
+    metrics_observe_transfer(transfer->easy_handle, transfer->code);
+    if (transfer->code != CURLE_OK) {
+        log_printf(LOG_LEVEL_ERROR, "transfer failed: %s\n", curl_easy_strerror(transfer->code));
+        return RESULT_ERROR;
+    }
+    return RESULT_DONE;
 }
 
-// TODO: multiple read tasks can use this so every read task should have its own
-#define READ_BUF_CAPACITY 64
-char read_buf[READ_BUF_CAPACITY];
+// Takes a transfer that is still in flight away from the multi handle
+void curl_transfer_cancel(Curl_Transfer *transfer) {
+    if (transfer->multi_handle == NULL) return;
+    curl_multi_remove_handle(transfer->multi_handle, transfer->easy_handle);
+    transfer->multi_handle = NULL;
+    metrics.curl_in_flight--;
+}
 
 void task_destroy(Task *t) {
-    if (task_in_pool(t)) task_free(t);
+    switch (t->kind) {
+        case TASK_KIND_WAIT:
+        case TASK_KIND_TIMEOUT:
+            // the reactor may wake it
+            reactor_forget(t, -1);
+            break;
+        case TASK_KIND_FIFO_REPL:
+            reactor_forget(t, t->repl_events != 0 ? t->repl_fd : -1);
+            // the stack of the console is kept to be printed at the end
+            line_buffer_free(&t->repl_session->input);
+            t->repl_session->task = NULL;
+            break;
+        case TASK_KIND_SESSION:
+        case TASK_KIND_METRICS_HTTP:
+            reactor_forget(t, t->repl_events != 0 ? t->repl_fd : -1);
+            session_free(t->repl_session);
+            break;
+        case TASK_KIND_LISTEN:
+            reactor_forget(t, t->listen_watched ? t->listen_fd : -1);
+            for (size_t i=0; i<listener_count; i++) {
+                if (listeners[i] == t) listeners[i] = listeners[--listener_count];
+            }
+            listen_socket_close(t->listen_fd, t->listen_path);
+            break;
+        case TASK_KIND_METRICS_DUMP:
+            reactor_forget(t, -1);
+            metrics_dumper = NULL;
+            break;
+        case TASK_KIND_TG_CALL:
+            // the transfer was not finished, afterwards it may live in an arena that was handed over
+            if (t->tg_call_easy != NULL) {
+                if (t->tg_call_transfer != NULL) curl_transfer_cancel(t->tg_call_transfer);
+                curl_easy_pool_release(t->tg_call_easy);
+            }
+            arena_free(&t->tg_call_arena);
+            break;
+        case TASK_KIND_PARALLEL:
+            free(t->par);
+            break;
+        case TASK_KIND_CONTEXT:
+            if (t->context_kind == CONTEXT_KIND_TG_POLLER && t->context_tg_poller->task == t) {
+                t->context_tg_poller->task = NULL;
+            }
+            break;
+        default:
+            break;
+    }
+    task_free(t);
+}
+
+// Destroys t together with all subtasks that did not finish yet.
+// The contexts the subtasks added to ctx are removed again, so easy handles, arenas and fifos are released.
+// Tasks that finished are destroyed by their parents already, so only the pending branch of each task is followed.
+void task_cancel(Task *t, Context *ctx) {
+    if (t == NULL) return;
+    switch (t->kind) {
+        case TASK_KIND_SEQUENCE:
+            for (size_t i=t->seq_index; i<t->seq_count; i++) task_cancel(t->seq[i], ctx);
+            break;
+        case TASK_KIND_PARALLEL:
+            for (size_t i=0; i<t->par_count; i++) {
+                // a subtask that was polled layered its contexts on top of its own copy
+                Context *sub_ctx = context_is_empty(&t->par[i].ctx) ? ctx : &t->par[i].ctx;
+                task_cancel(t->par[i].task, sub_ctx);
+            }
+            break;
+        case TASK_KIND_AND:
+        case TASK_KIND_OR:
+            task_cancel(t->snd != NULL ? t->snd : t->fst, ctx);
+            break;
+        case TASK_KIND_ITERATE:
+            task_cancel(t->iter_phase == 0 ? t->iter_body : t->iter_condition, ctx);
+            break;
+        case TASK_KIND_TIMEOUT:
+            task_cancel(t->timeout_body, ctx);
+            break;
+        case TASK_KIND_CONTEXT:
+            task_cancel(t->context_body, ctx);
+            // the context is only added on the first poll
+            if (t->polled && ctx->flag[t->context_kind]) context_remove(ctx, t->context_kind);
+            break;
+        default:
+            // the leaves release what they hold in task_destroy
+            break;
+    }
+    task_destroy(t);
 }
 
 CURLcode curl_easy_seturl(CURL *easy_handle, String_View url) {
@@ -1174,12 +4291,10 @@ size_t curl_write_cb(char *ptr, size_t size, size_t nmemb, void *userdata) {
     return real_size;
 }
 
-void *json_parse_cb(void *arena, size_t size) {
-    return arena_alloc(arena, size);
-}
+// task_poll_kind polls the subtasks with task_poll
+Result task_poll(Task *t, Context *ctx);
 
-Result task_poll(Task *t, Context *ctx) {
-    assert(t != NULL);
+Result task_poll_kind(Task *t, Context *ctx) {
     switch (t->kind) {
         case TASK_KIND_PURE:
             return t->pure_function(t->pure_argument);
@@ -1195,37 +4310,51 @@ Result task_poll(Task *t, Context *ctx) {
 
                         // if this was the last Task in the sequence we should return its result
                         if (t->seq_index == t->seq_count) return r;
+                        task_attach(t, t->seq[t->seq_index]);
                         break;
                     case STATE_PENDING:
                         break;
                     case STATE_ERROR:
-                        UNIMPLEMENTED("task_poll");
+                        // the rest of the sequence is not run
+                        task_destroy(t->seq[t->seq_index]);
+                        for (size_t i=t->seq_index+1; i<t->seq_count; i++) task_cancel(t->seq[i], ctx);
+                        t->seq_index = t->seq_count;
+                        return r;
                 }
                 return RESULT_PENDING;
             }
         case TASK_KIND_PARALLEL:
             {
                 if (t->par_count == 0) return RESULT_DONE;
-                Context *sub_ctx = t->sub_ctx + t->par_index;
-                if (context_is_empty(sub_ctx)) {
+                // Every subtask that was woken is polled once.
+                // Subtasks that are woken while we are at it end up in t->par_ready again and wake t.
+                Task_Queue ready = t->par_ready;
+                t->par_ready = (Task_Queue) {0};
+                for (Task *sub = task_queue_pop(&ready); sub != NULL; sub = task_queue_pop(&ready)) {
+                    size_t i = sub->par_slot;
+                    assert(i < t->par_count && t->par[i].task == sub);
                     // each subtask needs a copy of the context in case it will layer more context on top
-                    *sub_ctx = *ctx;
-                }
-                Result r = task_poll(t->par[t->par_index], t->sub_ctx + t->par_index);
-                switch (r.state) {
-                    case STATE_ERROR:
-                    case STATE_DONE:
-                        task_destroy(t->par[t->par_index]);
-                        t->par[t->par_index] = t->par[t->par_count - 1];
-                        t->sub_ctx[t->par_index] = t->sub_ctx[t->par_count - 1];
-                        t->par_count--;
-                        if (t->par_count > 0) t->par_index %= t->par_count;
-                        break;
-                    case STATE_PENDING:
-                        t->par_index += 1;
-                        t->par_index %= t->par_count;
-                        break;
+                    Context sub_ctx = context_is_empty(&t->par[i].ctx) ? *ctx : t->par[i].ctx;
+                    // the subtask is polled with a local copy because appending to t may move t->par
+                    Result r = task_poll(sub, &sub_ctx);
+                    t->par[i].ctx = sub_ctx;
+                    switch (r.state) {
+                        case STATE_ERROR:
+                        case STATE_DONE:
+                            // the subtask may have woken itself during its last poll
+                            if (sub->woken) task_queue_remove(&t->par_ready, sub);
+                            task_destroy(sub);
+                            t->par_count--;
+                            if (i < t->par_count) {
+                                t->par[i] = t->par[t->par_count];
+                                t->par[i].task->par_slot = i;
+                            }
+                            break;
+                        case STATE_PENDING:
+                            break;
+                    }
                 }
+                if (t->par_count == 0) return RESULT_DONE;
                 return RESULT_PENDING;
             }
         case TASK_KIND_AND:
@@ -1235,7 +4364,8 @@ Result task_poll(Task *t, Context *ctx) {
                     switch (r.state) {
                         case STATE_DONE:
                             task_destroy(t->fst);
-                            t->snd = t->then(r);
+                            t->snd = t->then(r, t->then_data);
+                            task_attach(t, t->snd);
                             return RESULT_PENDING;
                         case STATE_ERROR:
                             task_destroy(t->fst);
@@ -1265,7 +4395,8 @@ Result task_poll(Task *t, Context *ctx) {
                             return r;
                         case STATE_ERROR:
                             task_destroy(t->fst);
-                            t->snd = t->then(r);
+                            t->snd = t->then(r, t->then_data);
+                            task_attach(t, t->snd);
                             return RESULT_PENDING;
                         case STATE_PENDING:
                             return r;
@@ -1289,15 +4420,16 @@ Result task_poll(Task *t, Context *ctx) {
                     t->last = task_poll(t->iter_body, ctx);
                     switch (t->last.state) {
                         case STATE_DONE:
+                        case STATE_ERROR:
+                            // the condition decides whether an error ends the iteration
                             task_destroy(t->iter_body);
                             t->iter_body = NULL;
                             t->iter_phase = 1;
-                            t->iter_condition = t->iter_build_condition(t->last);
+                            t->iter_condition = t->iter_build_condition(t->last, t->iter_data);
+                            task_attach(t, t->iter_condition);
                             break;
                         case STATE_PENDING:
                             break;
-                        case STATE_ERROR:
-                            UNIMPLEMENTED("task_poll");
                     }
                     return RESULT_PENDING;
                 case 1:
@@ -1310,55 +4442,158 @@ Result task_poll(Task *t, Context *ctx) {
                             assert(r.kind == RESULT_KIND_BOOL);
                             if (r.bool_val) {
                                 t->iter_phase = 0;
-                                t->iter_body = t->iter_next(t->last);
+                                t->iter_body = t->iter_next(t->last, t->iter_data);
+                                task_attach(t, t->iter_body);
                                 return RESULT_PENDING;
                             } else {
-                                assert(t->last.state == STATE_DONE);
                                 return t->last;
                             }
                         case STATE_PENDING:
-                            UNIMPLEMENTED("task_poll");
+                            return RESULT_PENDING;
                         case STATE_ERROR:
-                            UNIMPLEMENTED("task_poll");
+                            // a condition that cannot be decided ends the iteration
+                            task_destroy(t->iter_condition);
+                            t->iter_condition = NULL;
+                            return r;
                     }
-                    UNIMPLEMENTED("task_poll");
+                    UNREACHABLE("invalid State");
             }
             UNREACHABLE("invalid phase");
         case TASK_KIND_WAIT:
-            if (!t->started) {
-                t->start = time(NULL);
-                t->started = true;
+            {
+                uint64_t now = time_now_ms();
+                if (!t->started) {
+                    t->deadline = now + (uint64_t) (1000.0 * t->duration);
+                    t->started = true;
+                }
+                if (now >= t->deadline) return RESULT_DONE;
+                reactor_wake_at(t, t->deadline);
                 return RESULT_PENDING;
             }
-            time_t now = time(NULL);
-            if (difftime(now, t->start) >= t->duration) return RESULT_DONE;
-            return RESULT_PENDING;
+        case TASK_KIND_TIMEOUT:
+            {
+                uint64_t now = time_now_ms();
+                if (t->timeout_deadline == 0) {
+                    // the deadline does not move, so the timer is armed once and stays until it fires or is forgotten
+                    t->timeout_deadline = now + t->timeout_ms;
+                    reactor_wake_at(t, t->timeout_deadline);
+                }
+                if (now < t->timeout_deadline) {
+                    Result r = task_poll(t->timeout_body, ctx);
+                    switch (r.state) {
+                        case STATE_DONE:
+                        case STATE_ERROR:
+                            task_destroy(t->timeout_body);
+                            t->timeout_body = NULL;
+                            reactor_forget(t, -1);
+                            return r;
+                        case STATE_PENDING:
+                            return r;
+                    }
+                }
+                log_printf(LOG_LEVEL_ERROR, "%s task timed out after %lu ms\n", task_kind_name[t->timeout_body->kind], t->timeout_ms);
+                task_cancel(t->timeout_body, ctx);
+                t->timeout_body = NULL;
+                return RESULT_TIMEOUT;
+            }
         case TASK_KIND_FIFO_REPL:
+            assert(ctx->flag[CONTEXT_KIND_FIFO]);
+            if (sessions_stopped) return RESULT_DONE;
+            if (t->repl_events == 0) {
+                if (!reactor_watch_fd(ctx->file_descriptor, EPOLLIN, waker_task(t))) return RESULT_ERROR;
+                t->repl_events = EPOLLIN;
+                t->repl_fd = ctx->file_descriptor;
+            }
+            return session_read(t->repl_session, ctx->file_descriptor);
+        case TASK_KIND_SESSION:
             {
-                assert(ctx->flag[CONTEXT_KIND_FIFO]);
-                ssize_t r = read(ctx->file_descriptor, read_buf, READ_BUF_CAPACITY-1);
-                if (r == 0) {
-                    return RESULT_PENDING;
-                } else if (r == -1 && errno == EAGAIN) {
-                    return RESULT_PENDING;
-                } else if (r > 0) {
-                    assert(r < READ_BUF_CAPACITY);
-                    read_buf[r] = '\0';
-                    // TODO: when a command is longer than READ_BUF_CAPACITY only a part of the command is passed to execute
-                    switch (execute(string_view_from_char_ptr(read_buf))) {
-                        case REPLY_CLOSE:
-                            return RESULT_DONE;
-                        case REPLY_ACK:
-                            return RESULT_PENDING;
-                        case REPLY_ERROR:
-                            printf("[ERROR] Command caused error, try again\n");
-                            return RESULT_PENDING;
+                Session *s = t->repl_session;
+                Result r = RESULT_PENDING;
+                // No more input is read while replies are pending, so a client that does not read them is not served.
+                if (sessions_stopped) {
+                    r = RESULT_DONE;
+                } else if (s->reply_count == 0) {
+                    r = session_read(s, s->fd);
+                }
+                if (!session_flush(s)) return RESULT_ERROR;
+                if (r.state != STATE_PENDING) return r;
+                uint32_t events = s->reply_count > 0 ? EPOLLOUT : EPOLLIN;
+                if (events != t->repl_events) {
+                    if (!reactor_watch_fd(s->fd, events, waker_task(t))) return RESULT_ERROR;
+                    t->repl_events = events;
+                }
+                return RESULT_PENDING;
+            }
+        case TASK_KIND_METRICS_DUMP:
+            {
+                if (sessions_stopped) return RESULT_DONE;
+                uint64_t now = time_now_ms();
+                if (now >= t->dump_deadline) {
+                    // the console replies through the log
+                    Session *prev = session;
+                    session = &console;
+                    metrics_print(&t->dump_report);
+                    session = prev;
+                    while (t->dump_deadline <= now) t->dump_deadline += METRICS_DUMP_INTERVAL_SECS * 1000;
+                }
+                reactor_wake_at(t, t->dump_deadline);
+                return RESULT_PENDING;
+            }
+        case TASK_KIND_METRICS_HTTP:
+            {
+                Session *s = t->repl_session;
+                if (sessions_stopped) return RESULT_DONE;
+                // the reply is only collected after the whole request is read
+                if (s->reply_count == 0) {
+                    Result r = metrics_http_read(s);
+                    if (r.state == STATE_ERROR) return r;
+                    if (r.state == STATE_PENDING) {
+                        if (t->repl_events != EPOLLIN) {
+                            if (!reactor_watch_fd(s->fd, EPOLLIN, waker_task(t))) return RESULT_ERROR;
+                            t->repl_events = EPOLLIN;
+                        }
+                        return RESULT_PENDING;
                     }
-                    UNREACHABLE("invalid Result_Kind");
-                } else {
-                    printf("[ERROR] Could not read from file: %s\n", strerror(errno));
+                }
+                if (!session_flush(s)) return RESULT_ERROR;
+                if (s->reply_count == 0) return RESULT_DONE;
+                if (t->repl_events != EPOLLOUT) {
+                    if (!reactor_watch_fd(s->fd, EPOLLOUT, waker_task(t))) return RESULT_ERROR;
+                    t->repl_events = EPOLLOUT;
+                }
+                return RESULT_PENDING;
+            }
+        case TASK_KIND_LISTEN:
+            if (sessions_stopped) return RESULT_DONE;
+            if (!t->listen_watched) {
+                if (!reactor_watch_fd(t->listen_fd, EPOLLIN, waker_task(t))) return RESULT_ERROR;
+                t->listen_watched = true;
+            }
+            for (;;) {
+                int fd = accept(t->listen_fd, NULL, NULL);
+                if (fd < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return RESULT_PENDING;
+                    if (errno == EINTR || errno == ECONNABORTED) continue;
+                    log_printf(LOG_LEVEL_ERROR, "Could not accept connection: %s\n", strerror(errno));
                     return RESULT_ERROR;
                 }
+                if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+                    log_printf(LOG_LEVEL_ERROR, "Could not make connection non-blocking: %s\n", strerror(errno));
+                    close(fd);
+                    continue;
+                }
+                assert(runner != NULL);
+                switch (t->listen_client_kind) {
+                    case TASK_KIND_SESSION:
+                        task_par_append(runner, task_session(session_new(fd)));
+                        log_printf(LOG_LEVEL_INFO, "accepted connection to control socket\n");
+                        break;
+                    case TASK_KIND_METRICS_HTTP:
+                        task_par_append(runner, task_metrics_http(session_new(fd)));
+                        break;
+                    default:
+                        UNREACHABLE("invalid listen_client_kind");
+                }
             }
         case TASK_KIND_CONTEXT:
             switch (t->context_kind) {
@@ -1383,8 +4618,7 @@ Result task_poll(Task *t, Context *ctx) {
                     if (!ctx->flag[CONTEXT_KIND_FIFO]) {
                         context_add_fifo(ctx);
                         if (ctx->file_descriptor < 0) return RESULT_ERROR;
-                        printf("[INFO] opened fifo successfully\n");
-                        return RESULT_PENDING;
+                        log_printf(LOG_LEVEL_INFO, "opened fifo successfully\n");
                     }
                     Result ret = task_poll(t->context_body, ctx);
                     switch (ret.state) {
@@ -1392,7 +4626,7 @@ Result task_poll(Task *t, Context *ctx) {
                         case STATE_DONE:
                             task_destroy(t->context_body);
                             if (!context_remove_fifo(ctx)) return RESULT_ERROR;
-                            printf("[INFO] closed fifo successfully\n");
+                            log_printf(LOG_LEVEL_INFO, "closed fifo successfully\n");
                             break;
                         case STATE_PENDING:
                             break;
@@ -1434,237 +4668,194 @@ Result task_poll(Task *t, Context *ctx) {
                         }
                         return r;
                     }
-                case CONTEXT_KIND_CURL_EASY:
-                    assert(ctx->flag[CONTEXT_KIND_CURL_GLOBAL]);
-                    if (ctx->flag[CONTEXT_KIND_CURL_MULTI]) {
-                        if (!ctx->flag[CONTEXT_KIND_CURL_EASY]) {
-                            context_add_curl_easy(ctx);
-                            CURLMcode code = curl_multi_add_handle(ctx->multi_handle, ctx->easy_handle);
-                            if (code != CURLM_OK) {
-                                UNIMPLEMENTED("task_poll");
-                            }
-                        }
-                        assert(t->context_body != NULL);
-                        Result r = task_poll(t->context_body, ctx);
-                        switch (r.state) {
-                            case STATE_ERROR:
-                            case STATE_DONE:
-                                task_destroy(t->context_body);
-                                CURLMcode code = curl_multi_remove_handle(ctx->multi_handle, ctx->easy_handle);
-                                if (code != CURLM_OK) {
-                                    UNIMPLEMENTED("task_poll");
-                                }
-                                context_remove_curl_easy(ctx);
-                                break;
-                            case STATE_PENDING:
-                                break;
+                case CONTEXT_KIND_TG_POLLER:
+                    {
+                        Tg_Poller *p = t->context_tg_poller;
+                        if (!ctx->flag[CONTEXT_KIND_TG_POLLER]) {
+                            context_add_tg_poller(ctx, p);
                         }
-                        return r;
-                    } else {
-                        if (!ctx->flag[CONTEXT_KIND_CURL_EASY]) {
-                            context_add_curl_easy(ctx);
+                        if (p->stopped) {
+                            // the long poll is not waited for, see tg_pollers_stop_all
+                            task_cancel(t->context_body, ctx);
+                            t->context_body = NULL;
+                            context_remove_tg_poller(ctx);
+                            return result_tg_poller(p);
                         }
-                        assert(t->context_body != NULL);
                         Result r = task_poll(t->context_body, ctx);
                         switch (r.state) {
                             case STATE_ERROR:
+                                p->error_count++;
+                                break;
                             case STATE_DONE:
-                                task_destroy(t->context_body);
-                                context_remove_curl_easy(ctx);
+                                p->error_count = 0;
                                 break;
                             case STATE_PENDING:
-                                break;
+                                return r;
                         }
-                        return r;
+                        task_destroy(t->context_body);
+                        context_remove_tg_poller(ctx);
+                        return result_tg_poller(p);
                     }
                 case CONTEXT_KIND_COUNT:
                     UNREACHABLE("CONTEXT_KIND_COUNT is not a valid Context_Kind");
             }
             UNREACHABLE("no valid Context_Kind");
-        case TASK_KIND_CURL_SETUP:
+        case TASK_KIND_TG_CALL:
             {
-                assert(ctx->flag[CONTEXT_KIND_CURL_EASY]);
-
-                CURLcode code;
-                assert(t->url_setup.str != NULL);
-                code = curl_easy_seturl(ctx->easy_handle, t->url_setup);
-                if (code != CURLE_OK) {
-                    printf("[ERROR] tried to set url '%.*s'\n", (int) t->url_setup.count, t->url_setup.str);
-                    printf("[ERROR] failed curl_easy_setopt: %s\n", curl_easy_strerror(code));
-                    return RESULT_ERROR;
-                }
-                code = curl_easy_setopt(ctx->easy_handle, CURLOPT_WRITEFUNCTION, curl_write_cb);
-                if (code != CURLE_OK) {
-                    printf("[ERROR] failed curl_easy_setopt: %s\n", curl_easy_strerror(code));
-                    return RESULT_ERROR;
-                }
-
-                return RESULT_DONE;
-            }
-        case TASK_KIND_CURL_PERFORM:
-            assert(ctx->flag[CONTEXT_KIND_CURL_EASY]);
-            assert(ctx->flag[CONTEXT_KIND_ARENA]);
-
-            if (t->curl_perform_sb.arena == NULL) {
-                t->curl_perform_sb = arena_string_builder_init(ctx->arena);
-                CURLcode code = curl_easy_setopt(ctx->easy_handle, CURLOPT_WRITEDATA, &t->curl_perform_sb);
-                if (code != CURLE_OK) {
-                    printf("[ERROR] failed curl_easy_setopt: %s\n", curl_easy_strerror(code));
-                    return RESULT_ERROR;
-                }
-            }
-            if (ctx->flag[CONTEXT_KIND_CURL_MULTI]) {
-                int running_handles;
-                CURLMcode mcode = curl_multi_perform(ctx->multi_handle, &running_handles);
-                if (mcode != CURLM_OK) {
-                    UNIMPLEMENTED("task_poll");
-                }
-                int msgs_left;
-                CURLMsg *msg = curl_multi_info_read(ctx->multi_handle, &msgs_left);
-                if (msg == NULL) {
-                    assert(running_handles >= 1);
-                    return RESULT_PENDING;
-                } else {
-                    assert(msg->msg == CURLMSG_DONE);
-                    assert(msg->easy_handle == ctx->easy_handle);
-                }
-            } else {
-                CURLcode code = curl_easy_perform(ctx->easy_handle);
-                if (code != CURLE_OK) {
-                    printf("[ERROR] failed curl_easy_perform: %s\n", curl_easy_strerror(code));
-                    return RESULT_ERROR;
+                assert(ctx->flag[CONTEXT_KIND_CURL_GLOBAL]);
+
+                if (t->tg_call_transfer == NULL) {
+                    t->tg_call_easy = curl_easy_pool_acquire();
+                    assert(t->tg_call_easy != NULL);
+                    t->tg_call_transfer = curl_transfer_new(&t->tg_call_arena, t, t->tg_call_easy);
+                    CURLcode code = curl_easy_seturl(t->tg_call_easy, t->tg_call_url);
+                    if (code == CURLE_OK) code = curl_easy_setopt(t->tg_call_easy, CURLOPT_WRITEFUNCTION, curl_write_cb);
+                    if (code != CURLE_OK) {
+                        log_printf(LOG_LEVEL_ERROR, "failed curl_easy_setopt: %s\n", curl_easy_strerror(code));
+                        return RESULT_ERROR;
+                    }
                 }
-            }
-            return result_string_view(string_view_from_arena_string_builder(t->curl_perform_sb));
-        case TASK_KIND_PARSE_JSON_VALUE:
-            assert(ctx->flag[CONTEXT_KIND_ARENA]);
-            json_value_t *root = json_parse_ex(
-                    t->json_source_str.str, t->json_source_str.count, 
-                    json_parse_flags_default, 
-                    json_parse_cb, 
-                    ctx->arena, 
-                    NULL
-                    );
-            if (root == NULL) {
-                printf("[ERROR] Failed to parse json value\n");
-                return RESULT_ERROR;
-            }
-            return result_json_value(root);
-        case TASK_KIND_GET_TG_UPDATE_LIST:
-            assert(ctx->flag[CONTEXT_KIND_ARENA]);
-
-            if (t->json_root == NULL) {
-                UNIMPLEMENTED("task_poll");
-            } else {
-                json_array_t *array = json_value_as_array(t->json_root);
-                if (array == NULL) {
-                    UNIMPLEMENTED("task_poll");
+                assert(t->tg_call_easy != NULL);
+                Result r = curl_transfer_poll(t->tg_call_transfer, ctx->flag[CONTEXT_KIND_CURL_MULTI] ? ctx->multi_handle : NULL);
+                if (r.state == STATE_PENDING) return r;
+                // the handle is not needed for decoding, the next call can have it
+                curl_easy_pool_release(t->tg_call_easy);
+                t->tg_call_easy = NULL;
+                if (r.state == STATE_DONE) {
+                    String_View body = string_view_from_arena_string_builder(t->tg_call_transfer->sb);
+                    PROBE2(json__parse__start, t->id, body.count);
+                    r = t->tg_call_decode(&t->tg_call_arena, body, ctx, t->tg_call_data);
+                    PROBE3(json__parse__finish, t->id, body.count, r.state != STATE_ERROR);
                 }
-                size_t l = array->length;
-                json_array_element_t *update_elem = array->start;
-                for (size_t i=0; i<l; i++) {
-                    Tg_Update *u = as_tg_update(ctx->arena, update_elem->value);
-                    if (u == NULL) {
-                        UNIMPLEMENTED("task_poll");
-                    }
-                    printf("[INFO] update id %d brought message: %s\n", u->update_id, u->message->text);
-                    update_elem = update_elem->next;
+                if (r.state == STATE_ERROR) {
+                    log_printf(LOG_LEVEL_ERROR, "error when requesting url '%.*s'\n", (int) t->tg_call_url.count, t->tg_call_url.str);
                 }
-                return RESULT_DONE;
+                return r;
             }
+        case TASK_KIND_COUNT:
+            UNREACHABLE("TASK_KIND_COUNT is not a valid Task_Kind");
     }
     UNREACHABLE("task_poll");
 }
 
-Task *task_wait(double dur) {
-    Task *ret = task_alloc();
-    ret->kind = TASK_KIND_WAIT;
-    ret->started = false;
-    ret->duration = dur;
-    ret->start = 0;
-    return ret;
-}
-
-Task *task_sequence() {
-    Task *ret = task_alloc();
-    ret->kind = TASK_KIND_SEQUENCE;
-    ret->seq_count = 0;
-    ret->seq_index = 0;
-    return ret;
-}
-
-void task_seq_append(Task *s, Task *t) {
-    assert(s->kind == TASK_KIND_SEQUENCE);
-    assert(s->seq_count < MAX_SEQ_COUNT); 
-
-    s->seq[s->seq_count] = t;
-    s->seq_count++;
-}
-
-Task *task_parallel() {
-    Task *ret = task_alloc();
-    ret->kind = TASK_KIND_PARALLEL;
-    ret->par_count = 0;
-    ret->par_index = 0;
-    return ret;
-}
-
-Task *task_iterate(Task *start, Then_Function next, Then_Function cond) {
-    Task *t = task_alloc();
-    t->kind = TASK_KIND_ITERATE;
-    t->iter_phase = 0;
-    t->iter_body = start;
-    t->iter_next = next;
-    t->iter_build_condition = cond;
-    return t;
+Result task_poll(Task *t, Context *ctx) {
+    assert(t != NULL);
+    // everything that wakes t from now on requires another poll
+    t->woken = false;
+    // the trace command may turn recording on during the poll
+    bool tracing = trace.enabled;
+    uint64_t start = tracing ? time_now_us() : 0;
+    if (!t->polled) {
+        t->polled = true;
+        if (tracing) trace_record(TRACE_FIRST_POLL, t, start, 0, STATE_PENDING);
+    }
+    PROBE2(task__poll__entry, t->id, t->kind);
+    Result r = task_poll_kind(t, ctx);
+    PROBE3(task__poll__exit, t->id, t->kind, r.state);
+    if (tracing) {
+        uint64_t end = time_now_us();
+        trace_record(TRACE_POLL, t, start, (uint32_t) (end - start), r.state);
+        if (r.state != STATE_PENDING) trace_record(TRACE_COMPLETE, t, end, 0, r.state);
+    }
+    return r;
 }
 
 Task *repl() {
-    Task *repl = task_alloc();
-    repl->kind = TASK_KIND_FIFO_REPL;
+    Task *repl = task_alloc(TASK_KIND_FIFO_REPL);
+    repl->repl_session = &console;
+    repl->repl_events = 0;
+    repl->repl_fd = -1;
+    console.task = repl;
 
     return repl;
 }
 
-// TODO: maybe the tasks should be responsible for themselves that they don't call to often
-// but this is a good workaround
-#define TARGET_SECS_PER_POLL (1 / 60.0)
-
 #ifndef TEST
 
 int main() {
-    // We need to do this to initialize the pool allocator
-    task_free_all();
+    if (!log_init()) {
+        log_flush();
+        return 1;
+    }
+    if (command_keywords_hash() != COMMAND_HASH_KEYWORDS) {
+        log_printf(LOG_LEVEL_ERROR, "command_hash.h is outdated, run 'make command_hash.h'\n");
+        log_flush();
+        return 1;
+    }
+    if (!reactor_init()) {
+        log_flush();
+        return 1;
+    }
+
+    const char *env_trace = getenv(TRACE_ENV);
+    if (env_trace != NULL && env_trace[0] != '\0') trace.enabled = true;
+
+    const char *env_url_prefix = getenv(URL_PREFIX_ENV);
+    if (env_url_prefix != NULL && env_url_prefix[0] != '\0') {
+        url_prefix = env_url_prefix;
+        log_printf(LOG_LEVEL_INFO, "using telegram api at '%s'\n", url_prefix);
+    }
 
     // runner is a global task of kind PARALLEL that all can acces
     runner = task_parallel();
-    Task *runner_ctx = task_curl_global_context(runner);
+    // all transfers share one multi handle so they share connections as well
+    Task *runner_ctx = task_curl_global_context(task_curl_multi_context(runner));
 
     Task *fifo = task_file_context(repl());
     task_par_append(runner, fifo);
 
+    // the server also runs without the control socket, e.g. if it is already taken
+    int listen_fd = control_socket_open();
+    if (listen_fd >= 0) {
+        task_par_append(runner, task_listen(listen_fd, TASK_KIND_SESSION, CONTROL_SOCKET_NAME));
+        log_printf(LOG_LEVEL_INFO, "listening on control socket '%s'\n", CONTROL_SOCKET_NAME);
+    }
+    int metrics_fd = metrics_http_open();
+    if (metrics_fd >= 0) {
+        task_par_append(runner, task_listen(metrics_fd, TASK_KIND_METRICS_HTTP, NULL));
+        log_printf(LOG_LEVEL_INFO, "serving metrics on http://127.0.0.1:%d/metrics\n", METRICS_HTTP_PORT);
+    }
+
+    task_par_append(runner, task_metrics_dump());
+
     Context ctx = context_new();
 
-    printf("[INFO] starting server\n");
-    Result r = task_poll(runner_ctx, &ctx);
-    while (r.state != STATE_DONE) {
-        clock_t start = clock();
-        r = task_poll(runner_ctx, &ctx);
-        clock_t end = clock();
-        double dt = ((double) (end - start)) / CLOCKS_PER_SEC;
-        if (dt < TARGET_TIME_PER_POLL) {
-            usleep(1000000.0 * (TARGET_SECS_PER_POLL - dt));
+    log_printf(LOG_LEVEL_INFO, "starting server\n");
+    metrics.start_ms = time_now_ms();
+    executor_spawn(runner_ctx);
+    Result r = RESULT_PENDING;
+    while (r.state == STATE_PENDING) {
+        metrics.loop_iterations++;
+        Task *t = task_queue_pop(&executor_ready);
+        if (t == NULL) {
+            log_flush();
+            uint64_t start = time_now_us();
+            reactor_wait();
+            metrics.wait_us += time_now_us() - start;
+            continue;
         }
+        assert(t == runner_ctx);
+        uint64_t start = time_now_us();
+        r = task_poll(t, &ctx);
+        uint64_t duration = time_now_us() - start;
+        metrics.poll_us += duration;
+        histogram_observe(&metrics.poll_duration, duration);
     }
-    printf("[INFO] finishing server\n");
+    log_printf(LOG_LEVEL_INFO, "finishing server\n");
     task_destroy(runner_ctx);
+    reactor_close();
+    if (trace.enabled && trace_dump(TRACE_FILE_NAME)) {
+        log_printf(LOG_LEVEL_INFO, "wrote %zu trace events to '%s'\n", trace_event_count(), TRACE_FILE_NAME);
+    }
     
-    size_t count = 0;
-    for (Task_Free_Node *i = task_pool_head; i != NULL; i = i->next) count++;
-    printf("[INFO] memory leaked %zu tasks from the pool\n", TASK_POOL_CAPACITY - count);
+    log_printf(LOG_LEVEL_INFO, "memory leaked %zu tasks from the pool\n", task_pool_capacity() - task_pool_free_count());
+    log_printf(LOG_LEVEL_INFO, "curl easy handle pool: %zu hits, %zu misses\n", curl_easy_pool.hits, curl_easy_pool.misses);
+    log_printf(LOG_LEVEL_INFO, "program cache: %zu hits, %zu misses\n", program_cache.hits, program_cache.misses);
+    program_cache_free_all();
 
-    printf("[INFO] Stack: ");
+    log_printf(LOG_LEVEL_INFO, "Stack: ");
     stack_print();
+    log_flush();
 }
 
 #endif // TEST
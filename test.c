@@ -53,6 +53,15 @@ UTEST_F_TEARDOWN(Task_Const_Fixture) {
                 case RESULT_KIND_JSON_VALUE:
                     ASSERT_EQ(pre.json_value, post.json_value);
                     break;
+                case RESULT_KIND_TG_POLLER:
+                    ASSERT_EQ(pre.tg_poller, post.tg_poller);
+                    break;
+                case RESULT_KIND_TG_UPDATE_LIST:
+                    ASSERT_EQ(pre.tg_update_list, post.tg_update_list);
+                    break;
+                case RESULT_KIND_TIMEOUT:
+                    ASSERT_TRUE(false);
+                    break;
             }
             break;
         case STATE_PENDING:
@@ -84,6 +93,508 @@ UTEST_F(Task_Const_Fixture, RESULT_KIND_JSON_VALUE) {
     utest_fixture->pre = result_json_value(json_parse("[2, 3]", 6));
 }
 
+UTEST(Task, wait) {
+    task_free_all();
+    ASSERT_TRUE(reactor_init());
+    Context ctx = context_new();
+
+    uint64_t start = time_now_ms();
+    Task *t = task_wait(0.02);
+    Result r = task_poll(t, &ctx);
+    while (r.state == STATE_PENDING) {
+        reactor_wait();
+        r = task_poll(t, &ctx);
+    }
+    ASSERT_EQ(r.state, STATE_DONE);
+    ASSERT_GE(time_now_ms() - start, (uint64_t) 20);
+
+    task_destroy(t);
+    reactor_close();
+}
+
+UTEST(reactor, timer_slots) {
+    task_free_all();
+    ASSERT_TRUE(reactor_init());
+    Task *t[4];
+    for (size_t i=0; i<4; i++) {
+        t[i] = task_wait(1);
+        reactor_wake_at(t[i], 100 - 10*i);
+    }
+    // re-arming moves the timer in place, forgetting removes it
+    reactor_wake_at(t[0], 1);
+    reactor_forget(t[2], -1);
+    ASSERT_EQ(reactor.timer_count, (size_t) 3);
+    ASSERT_EQ(t[2]->timer_slot, (uint32_t) 0);
+    ASSERT_TRUE(reactor.timers[0].waker.task == t[0]);
+    for (size_t i=0; i<4; i++) {
+        if (t[i]->timer_slot > 0) ASSERT_TRUE(reactor.timers[t[i]->timer_slot - 1].waker.task == t[i]);
+    }
+    for (size_t i=0; i<4; i++) task_destroy(t[i]);
+    ASSERT_EQ(reactor.timer_count, (size_t) 0);
+    reactor_close();
+}
+
+UTEST(Task, timeout) {
+    task_free_all();
+    ASSERT_TRUE(reactor_init());
+    Context ctx = context_new();
+    size_t in_use = task_pool_capacity() - task_pool_free_count();
+
+    // the arena and the pending subtasks are released when the body is cancelled
+    Arena a = {0};
+    arena_alloc(&a, 64);
+    Task *p = task_parallel();
+    task_par_append(p, task_wait(10));
+    task_par_append(p, task_const(result_int(1)));
+    Task *t = task_timeout(task_context_arena(p, a), 20);
+    uint64_t start = time_now_ms();
+    Result r = task_poll(t, &ctx);
+    while (r.state == STATE_PENDING) {
+        reactor_wait();
+        r = task_poll(t, &ctx);
+    }
+    ASSERT_EQ(r.state, STATE_ERROR);
+    ASSERT_EQ(r.kind, RESULT_KIND_TIMEOUT);
+    ASSERT_GE(time_now_ms() - start, (uint64_t) 20);
+    ASSERT_FALSE(ctx.flag[CONTEXT_KIND_ARENA]);
+    task_destroy(t);
+    ASSERT_EQ(task_pool_capacity() - task_pool_free_count(), in_use);
+
+    // a body that finishes in time keeps its Result, the timer of the deadline is armed once and then cancelled
+    t = task_timeout(task_wait(0.01), 1000);
+    r = task_poll(t, &ctx);
+    ASSERT_NE(t->timer_slot, (uint32_t) 0);
+    uint64_t deadline = reactor.timers[t->timer_slot - 1].deadline;
+    while (r.state == STATE_PENDING) {
+        reactor_wait();
+        r = task_poll(t, &ctx);
+        if (r.state == STATE_PENDING) ASSERT_EQ(reactor.timers[t->timer_slot - 1].deadline, deadline);
+    }
+    ASSERT_EQ(r.state, STATE_DONE);
+    ASSERT_EQ(t->timer_slot, (uint32_t) 0);
+    task_destroy(t);
+    reactor_close();
+}
+
+Task *iterate_test_next(Result r, void *data) {
+    UNUSED(r);
+    UNUSED(data);
+    return task_const(result_int(1));
+}
+
+// keep going as long as the body fails
+Task *iterate_test_condition(Result r, void *data) {
+    UNUSED(data);
+    return task_const(result_bool(r.state == STATE_ERROR));
+}
+
+UTEST(Task, iterate_continues_after_error) {
+    task_free_all();
+    Context ctx = context_new();
+
+    Task *t = task_iterate(task_const(RESULT_ERROR), iterate_test_next, iterate_test_condition, NULL);
+    Result r = RESULT_PENDING;
+    for (size_t i=0; i<8 && r.state == STATE_PENDING; i++) {
+        r = task_poll(t, &ctx);
+    }
+    ASSERT_EQ(r.state, STATE_DONE);
+    ASSERT_EQ(r.kind, RESULT_KIND_INT);
+    ASSERT_EQ(r.x, 1);
+
+    task_destroy(t);
+}
+
+UTEST(Task, getme_calls_keep_their_url) {
+    task_free_all();
+    char *urls[2] = {"http://127.0.0.1:1/botA/getMe", "http://127.0.0.1:1/botB/getMe"};
+    Task *t[2];
+    for (size_t i=0; i<2; i++) t[i] = task_call_getme(string_view_from_char_ptr(urls[i]));
+    for (size_t i=0; i<2; i++) {
+        ASSERT_EQ(t[i]->kind, TASK_KIND_TG_CALL);
+        ASSERT_EQ(t[i]->tg_call_url.count, strlen(urls[i]));
+        ASSERT_STRNEQ(t[i]->tg_call_url.str, urls[i], t[i]->tg_call_url.count);
+    }
+    for (size_t i=0; i<2; i++) task_destroy(t[i]);
+}
+
+Result tg_call_test_decode(Arena *a, String_View body, Context *ctx, void *data) {
+    UNUSED(ctx);
+    *(String_View *) data = (String_View) {
+        .str = arena_memdup(a, body.str, body.count),
+        .count = body.count,
+    };
+    return body.count > 0 ? RESULT_DONE : RESULT_ERROR;
+}
+
+UTEST(Task, tg_call_file) {
+    task_free_all();
+    const char *path = "/tmp/ribezal-test-tg-call.json";
+    const char *body = "{\"ok\":true,\"result\":{\"id\":1,\"is_bot\":true,\"first_name\":\"Mock\"}}";
+    FILE *f = fopen(path, "w");
+    ASSERT_TRUE(f != NULL);
+    fputs(body, f);
+    fclose(f);
+
+    Context ctx = context_new();
+    context_add_curl_global(&ctx);
+    size_t in_use = task_pool_capacity() - task_pool_free_count();
+    String_View seen = {0};
+    Task *t = task_tg_call(string_view_from_char_ptr("file:///tmp/ribezal-test-tg-call.json"), tg_call_test_decode, &seen);
+    // the whole call is a single task
+    ASSERT_EQ(task_pool_capacity() - task_pool_free_count(), in_use + 1);
+    ASSERT_EQ(task_poll(t, &ctx).state, STATE_DONE);
+    ASSERT_EQ(seen.count, strlen(body));
+    ASSERT_STRNEQ(seen.str, body, seen.count);
+    task_destroy(t);
+
+    t = task_call_getme(string_view_from_char_ptr("file:///tmp/ribezal-test-tg-call.json"));
+    ASSERT_EQ(task_poll(t, &ctx).state, STATE_DONE);
+    task_destroy(t);
+    t = task_call_getme(string_view_from_char_ptr("file:///tmp/ribezal-test-does-not-exist.json"));
+    ASSERT_EQ(task_poll(t, &ctx).state, STATE_ERROR);
+    task_destroy(t);
+
+    context_remove_curl_global(&ctx);
+    remove(path);
+}
+
+UTEST(line_buffer, framing) {
+    Line_Buffer b = {0};
+    const char *chunks[] = {"ab", "c\nde\nf", "g\n"};
+    const char *expected[] = {"abc", "de", "fg"};
+    size_t n = 0;
+    for (size_t i=0; i<3; i++) {
+        size_t len = strlen(chunks[i]);
+        while (b.capacity - b.count < len) ASSERT_TRUE(line_buffer_reserve(&b));
+        memcpy(b.items + b.count, chunks[i], len);
+        b.count += len;
+        String_View line;
+        while (line_buffer_next_line(&b, &line)) {
+            ASSERT_LT(n, (size_t) 3);
+            ASSERT_TRUE(string_view_eq_cstr(line, expected[n]));
+            n++;
+        }
+    }
+    ASSERT_EQ(n, (size_t) 3);
+
+    // the rest of a dropped line is not executed
+    line_buffer_drop_line(&b);
+    memcpy(b.items, "tail\nnext\n", 10);
+    b.count = 10;
+    String_View line;
+    ASSERT_TRUE(line_buffer_next_line(&b, &line));
+    ASSERT_TRUE(string_view_eq_cstr(line, "next"));
+    free(b.items);
+}
+
+UTEST(Task, fifo_repl_lines) {
+    task_free_all();
+    ASSERT_TRUE(reactor_init());
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    ASSERT_EQ(fcntl(fds[0], F_SETFL, O_NONBLOCK), 0);
+    Context ctx = context_new();
+    ctx.flag[CONTEXT_KIND_FIFO] = true;
+    ctx.file_descriptor = fds[0];
+
+    // longer than the old 64 byte buffer, several lines in one read and a partial tail
+    const char *input = "1 2 + 3 + 4 + 5 + 6 + 7 + 8 + 9 + 10 + 11 + 12 + 13 + 14 + 15 + 16 + 17 + 18 + 19 + 20 +\n"
+        "1 drop\n4";
+    ASSERT_EQ(write(fds[1], input, strlen(input)), (ssize_t) strlen(input));
+    Task *t = repl();
+    Result r = task_poll(t, &ctx);
+    ASSERT_EQ(r.state, STATE_PENDING);
+    ASSERT_EQ(session->stack_count, (size_t) 1);
+    ASSERT_EQ(session->stack[0].x, 210);
+
+    ASSERT_EQ(write(fds[1], "0 2 +\nquit\n", 11), 11);
+    r = task_poll(t, &ctx);
+    ASSERT_EQ(r.state, STATE_DONE);
+    ASSERT_EQ(session->stack_count, (size_t) 2);
+    ASSERT_EQ(session->stack[1].x, 42);
+
+    session->stack_count = 0;
+    sessions_stopped = false;
+    task_destroy(t);
+    close(fds[0]);
+    close(fds[1]);
+    reactor_close();
+}
+
+UTEST(Task, session_own_stack_and_replies) {
+    task_free_all();
+    ASSERT_TRUE(reactor_init());
+    int fds[2][2];
+    Task *t[2];
+    for (size_t i=0; i<2; i++) {
+        ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds[i]), 0);
+        t[i] = task_session(session_new(fds[i][0]));
+    }
+    Context ctx = context_new();
+
+    ASSERT_EQ(write(fds[0][1], "3 4 +\n", 6), 6);
+    ASSERT_EQ(write(fds[1][1], "5 print\ndrop +\n", 15), 15);
+    for (size_t i=0; i<2; i++) ASSERT_EQ(task_poll(t[i], &ctx).state, STATE_PENDING);
+    ASSERT_EQ(write(fds[0][1], "print\n", 6), 6);
+    ASSERT_EQ(task_poll(t[0], &ctx).state, STATE_PENDING);
+
+    char reply[128] = {0};
+    ASSERT_EQ(read(fds[0][1], reply, sizeof(reply)), 4);
+    ASSERT_STREQ(reply, "[7]\n");
+    memset(reply, 0, sizeof(reply));
+    read(fds[1][1], reply, sizeof(reply));
+    ASSERT_STREQ(reply, "[5]\n[ERROR] Command caused error, try again\n");
+    // the console is not touched
+    ASSERT_EQ(console.stack_count, (size_t) 0);
+
+    // closing the connection ends the session
+    close(fds[1][1]);
+    ASSERT_EQ(task_poll(t[1], &ctx).state, STATE_DONE);
+    task_destroy(t[1]);
+    task_destroy(t[0]);
+    close(fds[0][1]);
+    ASSERT_TRUE(sessions == NULL);
+    program_cache_free_all();
+    reactor_close();
+}
+
+UTEST(log, ring) {
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    Log_Ring saved = log_ring;
+    log_ring.head = log_ring.tail = log_ring.dropped = 0;
+    log_ring.fd = fds[1];
+
+    log_printf(LOG_LEVEL_INFO, "a %d\n", 1);
+    log_printf(LOG_LEVEL_DEBUG, "b\n");
+    log_flush();
+    char out[64] = {0};
+    ASSERT_EQ(read(fds[0], out, sizeof(out)), 21);
+    ASSERT_STREQ(out, "[INFO] a 1\n[DEBUG] b\n");
+
+    // under pressure DEBUG lines are dropped first, the ring wraps around
+    log_ring.head = log_ring.tail = LOG_RING_CAPACITY - 4;
+    char filler[LOG_DEBUG_WATERMARK - 7];
+    memset(filler, 'x', sizeof(filler));
+    ASSERT_TRUE(log_append(filler, sizeof(filler)));
+    log_printf(LOG_LEVEL_DEBUG, "dropped\n");
+    ASSERT_EQ(log_ring.dropped, (size_t) 0);
+    log_printf(LOG_LEVEL_DEBUG, "dropped\n");
+    ASSERT_EQ(log_ring.dropped, (size_t) 1);
+    log_printf(LOG_LEVEL_ERROR, "kept\n");
+    ASSERT_EQ(log_ring.dropped, (size_t) 1);
+    log_ring.tail += sizeof(filler);
+
+    log_flush();
+    memset(out, 0, sizeof(out));
+    ASSERT_GT(read(fds[0], out, sizeof(out)), 0);
+    ASSERT_STREQ(out, "[DEBUG] dropped\n[ERROR] kept\n[ERROR] dropped 1 log lines\n");
+
+    log_ring = saved;
+    close(fds[0]);
+    close(fds[1]);
+}
+
+UTEST(metrics, histogram) {
+    Histogram h = {0};
+    histogram_observe(&h, 1);
+    histogram_observe(&h, 3);
+    histogram_observe(&h, 4);
+    histogram_observe(&h, 1000);
+    ASSERT_EQ(h.count, (uint64_t) 4);
+    ASSERT_EQ(h.sum, (uint64_t) 1008);
+    ASSERT_EQ(h.buckets[0], (uint64_t) 1);
+    ASSERT_EQ(h.buckets[2], (uint64_t) 2);
+    ASSERT_EQ(h.buckets[10], (uint64_t) 1);
+    ASSERT_EQ(histogram_quantile(&h, 0.5), (uint64_t) 4);
+    ASSERT_EQ(histogram_quantile(&h, 0.99), (uint64_t) 1024);
+}
+
+UTEST(metrics, endpoint_and_tasks) {
+    ASSERT_EQ(metrics_endpoint("https://api.telegram.org/bot123:abc/getUpdates?offset=1&timeout=30"), (size_t) GET_UPDATES);
+    ASSERT_EQ(metrics_endpoint("https://api.telegram.org/bot123:abc/getMe"), (size_t) GET_ME);
+    ASSERT_EQ(metrics_endpoint("http://localhost/other"), (size_t) TG_METHOD_COUNT);
+
+    task_free_all();
+    Task *t = task_and(task_const(RESULT_DONE), NULL, NULL);
+    ASSERT_EQ(metrics.task_live[TASK_KIND_AND], (size_t) 1);
+    ASSERT_EQ(metrics.task_live[TASK_KIND_PURE], (size_t) 1);
+    task_free(t->fst);
+    task_free(t);
+    ASSERT_EQ(metrics.task_live[TASK_KIND_AND], (size_t) 0);
+    ASSERT_GE(metrics.task_peak[TASK_KIND_AND], (size_t) 1);
+}
+
+UTEST(Task, metrics_http) {
+    task_free_all();
+    ASSERT_TRUE(reactor_init());
+    Context ctx = context_new();
+    const char *requests[] = {"GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n", "GET / HTTP/1.1\r\n\r\n"};
+    const char *expected[] = {"HTTP/1.1 200 OK\r\n", "HTTP/1.1 404 Not Found\r\n"};
+    for (size_t i=0; i<2; i++) {
+        int fds[2];
+        ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), 0);
+        Task *t = task_metrics_http(session_new(fds[0]));
+        // the request arrives in two parts
+        ASSERT_EQ(write(fds[1], requests[i], 10), 10);
+        ASSERT_EQ(task_poll(t, &ctx).state, STATE_PENDING);
+        ASSERT_EQ(write(fds[1], requests[i] + 10, strlen(requests[i]) - 10), (ssize_t) strlen(requests[i]) - 10);
+        ASSERT_EQ(task_poll(t, &ctx).state, STATE_DONE);
+        task_destroy(t);
+
+        static char reply[64*1024];
+        ssize_t n = read(fds[1], reply, sizeof(reply) - 1);
+        ASSERT_GT(n, 0);
+        reply[n] = '\0';
+        ASSERT_EQ(strncmp(reply, expected[i], strlen(expected[i])), 0);
+        if (i == 0) {
+            ASSERT_TRUE(strstr(reply, "\nribezal_commands_total ") != NULL);
+            ASSERT_TRUE(strstr(reply, "\nribezal_http_request_duration_seconds_bucket{method=\"getUpdates\",le=\"+Inf\"} ") != NULL);
+            ASSERT_TRUE(strstr(reply, "\nribezal_poll_duration_seconds_count ") != NULL);
+        }
+        close(fds[1]);
+    }
+    reactor_close();
+}
+
+UTEST(trace, task_lifecycle) {
+    task_free_all();
+    trace.enabled = true;
+    size_t first = trace.count;
+    Task *t = task_and(task_const(RESULT_DONE), NULL, NULL);
+    Context ctx = context_new();
+    task_poll(t->fst, &ctx);
+    uint32_t id = t->fst->id;
+    task_destroy(t->fst);
+    task_free(t);
+
+    Trace_Phase expected[] = {TRACE_ALLOC, TRACE_ALLOC, TRACE_FIRST_POLL, TRACE_POLL, TRACE_COMPLETE, TRACE_DESTROY, TRACE_DESTROY};
+    ASSERT_EQ(trace.count - first, sizeof(expected) / sizeof(expected[0]));
+    for (size_t i=0; i<sizeof(expected) / sizeof(expected[0]); i++) {
+        ASSERT_EQ(trace.events[(first + i) % TRACE_RING_CAPACITY].phase, (uint8_t) expected[i]);
+    }
+    Trace_Event *poll = &trace.events[(first + 3) % TRACE_RING_CAPACITY];
+    ASSERT_EQ(poll->task_id, id);
+    ASSERT_EQ(poll->parent_id, t->id);
+    ASSERT_EQ(poll->kind, (uint8_t) TASK_KIND_PURE);
+
+    FILE *f = tmpfile();
+    ASSERT_TRUE(f != NULL);
+    trace_write(f);
+    long size = ftell(f);
+    rewind(f);
+    char *json = malloc(size + 1);
+    ASSERT_EQ(fread(json, 1, size, f), (size_t) size);
+    json[size] = '\0';
+    fclose(f);
+    json_value_t *root = json_parse(json, size);
+    ASSERT_TRUE(root != NULL);
+    free(root);
+    ASSERT_TRUE(strstr(json, "\"ph\":\"X\"") != NULL);
+    free(json);
+
+    // nothing is recorded while tracing is off
+    trace.enabled = false;
+    first = trace.count;
+    task_free(task_const(RESULT_DONE));
+    ASSERT_EQ(trace.count, first);
+}
+
+UTEST(Task, pool_grows) {
+    task_free_all();
+
+    Task_Pool *pool = &task_pool[task_kind_size_class(TASK_KIND_PURE)];
+    size_t cap = pool->page_capacity;
+    size_t n = 2*cap + 1;
+    Task *tasks[n];
+    for (size_t i=0; i<n; i++) {
+        tasks[i] = task_const(RESULT_DONE);
+        ASSERT_TRUE(task_in_pool(tasks[i]));
+    }
+    ASSERT_EQ(task_pool_capacity(), 3*cap);
+    ASSERT_EQ(pool->live, n);
+    ASSERT_EQ(pool->peak, n);
+
+    // freed tasks are reused before the pool grows again
+    task_free(tasks[n-1]);
+    ASSERT_TRUE(task_const(RESULT_DONE) == tasks[n-1]);
+    ASSERT_EQ(task_pool_capacity(), 3*cap);
+
+    // an empty page is given back once another page has enough free blocks
+    for (size_t i=0; i<cap; i++) task_free(tasks[i]);
+    ASSERT_EQ(task_pool_capacity(), 3*cap);
+    task_free(tasks[n-1]);
+    for (size_t i=cap; i<2*cap; i++) task_free(tasks[i]);
+    ASSERT_EQ(task_pool_capacity(), cap);
+    ASSERT_EQ(pool->live, (size_t) 0);
+    ASSERT_EQ(pool->peak, n);
+
+    task_free_all();
+    ASSERT_EQ(task_pool_capacity(), (size_t) 0);
+}
+
+UTEST(Task, wake_parallel) {
+    task_free_all();
+    Context ctx = context_new();
+
+    Task *p = task_parallel();
+    Task *w1 = task_wait(10);
+    Task *w2 = task_wait(10);
+    task_par_append(p, w1);
+    task_par_append(p, w2);
+
+    // both subtasks are new so both are polled once
+    while (p->woken) {
+        Result r = task_poll(p, &ctx);
+        ASSERT_EQ(r.state, STATE_PENDING);
+    }
+    ASSERT_FALSE(w1->woken);
+    ASSERT_FALSE(w2->woken);
+
+    task_wake(w2);
+    ASSERT_TRUE(p->woken);
+    ASSERT_TRUE(p->par_ready.head == w2);
+    ASSERT_TRUE(p->par_ready.tail == w2);
+
+    task_destroy(w1);
+    task_destroy(w2);
+    task_destroy(p);
+    reactor_close();
+}
+
+UTEST(Task, parallel_polls_all_woken) {
+    task_free_all();
+    Context ctx = context_new();
+
+    Task *p = task_parallel();
+    size_t n = 3*task_pool[TASK_SIZE_CLASS_SMALL].page_capacity + 1;
+    for (size_t i=0; i<n; i++) {
+        task_par_append(p, task_const(result_int(i)));
+    }
+    ASSERT_EQ(p->par_count, n);
+
+    Result r = task_poll(p, &ctx);
+    ASSERT_EQ(r.state, STATE_DONE);
+    ASSERT_EQ(p->par_count, (size_t) 0);
+
+    task_destroy(p);
+}
+
+UTEST(curl_easy_pool, reuse) {
+    size_t hits_pre = curl_easy_pool.hits;
+
+    CURL *a = curl_easy_pool_acquire();
+    ASSERT_TRUE(a != NULL);
+    curl_easy_pool_release(a);
+    CURL *b = curl_easy_pool_acquire();
+    ASSERT_TRUE(a == b);
+    ASSERT_EQ(curl_easy_pool.hits, hits_pre + 1);
+
+    curl_easy_pool_release(b);
+    curl_easy_pool_free_all();
+    ASSERT_EQ(curl_easy_pool.count, (size_t) 0);
+}
+
 #define BOT_TOKEN "123456:ABC-DEF1234ghIkl-zyx57W2v1u123ew11"
 struct Build_URL_Fixture {
     Arena arena;
@@ -112,6 +623,11 @@ UTEST_F(Build_URL_Fixture, getUpdates) {
     utest_fixture->expectation = string_view_from_char_ptr(URL_PREFIX BOT_TOKEN "/getUpdates");
 }
 
+UTEST_F(Build_URL_Fixture, getUpdates_long_poll) {
+    utest_fixture->call = new_tg_api_call_get_updates_long_poll(BOT_TOKEN, 1001, 30);
+    utest_fixture->expectation = string_view_from_char_ptr(URL_PREFIX BOT_TOKEN "/getUpdates?offset=1001&timeout=30");
+}
+
 UTEST_F(Build_URL_Fixture, sendMessage) {
     Tg_Chat chat = {
         .id = 420,
@@ -120,79 +636,368 @@ UTEST_F(Build_URL_Fixture, sendMessage) {
     utest_fixture->expectation = string_view_from_char_ptr(URL_PREFIX BOT_TOKEN "/sendMessage?chat_id=420&text=Lorem\%20ipsum");
 }
 
+UTEST(build_url, url_prefix) {
+    Arena a = {0};
+    Tg_Method_Call call = new_tg_api_call_get_me(BOT_TOKEN);
+    url_prefix = "http://127.0.0.1:8089/bot";
+    String_View url = build_url(&a, &call);
+    url_prefix = URL_PREFIX;
+    const char *expectation = "http://127.0.0.1:8089/bot" BOT_TOKEN "/getMe";
+    ASSERT_EQ(strlen(expectation), url.count);
+    ASSERT_STRNEQ(expectation, url.str, url.count);
+    arena_free(&a);
+}
+
+UTEST(tg_poller, stop_all) {
+    Tg_Poller *p1 = tg_poller_new(BOT_TOKEN, 30, false);
+    // telegram answers concurrent getUpdates calls for one bot with 409 Conflict
+    ASSERT_TRUE(tg_poller_new(BOT_TOKEN, 30, true) == NULL);
+    Tg_Poller *p2 = tg_poller_new(BOT_TOKEN "2", 30, true);
+    tg_pollers_stop_all();
+    ASSERT_TRUE(p1->stopped);
+    ASSERT_TRUE(p2->stopped);
+
+    tg_poller_free(p1);
+    ASSERT_TRUE(tg_pollers == p2);
+    tg_poller_free(p2);
+    ASSERT_TRUE(tg_pollers == NULL);
+}
+
+UTEST(tg_poller, session_refused) {
+    task_free_all();
+    ASSERT_TRUE(reactor_init());
+    runner = task_parallel();
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), 0);
+    Task *t = task_session(session_new(fds[0]));
+    Context ctx = context_new();
+
+    const char *lines = BOT_TOKEN " tg-pollUpdates\n" BOT_TOKEN " tg-pollUpdatesPipelined\n";
+    ASSERT_EQ(write(fds[1], lines, strlen(lines)), (ssize_t) strlen(lines));
+    ASSERT_EQ(task_poll(t, &ctx).state, STATE_PENDING);
+    ASSERT_EQ(runner->par_count, (size_t) 1);
+
+    // the reason is replied instead of the advice to try again
+    char reply[128] = {0};
+    read(fds[1], reply, sizeof(reply));
+    ASSERT_STREQ(reply, "[ERROR] Updates of this bot are polled already\n");
+
+    close(fds[1]);
+    ASSERT_EQ(task_poll(t, &ctx).state, STATE_DONE);
+    task_destroy(t);
+    task_destroy(runner);
+    runner = NULL;
+    while (tg_pollers != NULL) tg_poller_free(tg_pollers);
+    program_cache_free_all();
+    reactor_close();
+}
+
+UTEST(json_index, scan_block) {
+    char block[JSON_INDEX_BLOCK_SIZE];
+    const char alphabet[] = "\"\\{}[]:, ax{\n\x01\x1f\x80\xff";
+    srand(161);
+    for (size_t round=0; round<256; round++) {
+        for (size_t i=0; i<JSON_INDEX_BLOCK_SIZE; i++) block[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+        Json_Block_Masks expected = json_index_scan_block_scalar(block);
+        Json_Block_Masks actual = json_index_scan_block(block);
+        ASSERT_EQ(expected.quote, actual.quote);
+        ASSERT_EQ(expected.backslash, actual.backslash);
+        ASSERT_EQ(expected.bracket, actual.bracket);
+        ASSERT_EQ(expected.control, actual.control);
+    }
+}
+
+UTEST(json_index, build) {
+    Arena a = {0};
+    // brackets and escaped quotes inside of strings are not part of the index
+    const char *src = "{\"a\\\"[\\\\\":[1,{}],\"b\":\"}\"}";
+    Json_Index index;
+    ASSERT_TRUE(json_index_build(&a, string_view_from_char_ptr((char *) src), &index));
+    uint32_t expected[] = {0, 1, 8, 10, 13, 14, 15, 17, 19, 21, 23, 24};
+    ASSERT_EQ(index.count, sizeof(expected)/sizeof(expected[0]));
+    for (size_t i=0; i<index.count; i++) {
+        ASSERT_EQ(index.items[i], expected[i]);
+    }
+
+    // a string that does not end
+    ASSERT_FALSE(json_index_build(&a, string_view_from_char_ptr("[\"abc]"), &index));
+    // control characters are whitespace outside of strings but not allowed inside
+    ASSERT_TRUE(json_index_build(&a, string_view_from_char_ptr("[1,\n2]"), &index));
+    ASSERT_FALSE(json_index_build(&a, string_view_from_char_ptr("[\"a\nb\"]"), &index));
+    arena_free(&a);
+}
+
+UTEST(json_index, build_matches_byte_by_byte) {
+    Arena a = {0};
+    char src[301];
+    const char alphabet[] = "\"\\\\{}[]ab";
+    srand(42);
+    for (size_t round=0; round<256; round++) {
+        for (size_t i=0; i<sizeof(src)-1; i++) src[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+        src[sizeof(src)-1] = '\0';
+        Json_Index index;
+        bool closed = json_index_build(&a, string_view_from_char_ptr(src), &index);
+
+        size_t n = 0;
+        bool in_string = false;
+        for (size_t i=0; i<sizeof(src)-1; i++) {
+            // backslashes outside of strings are invalid json, the index treats them like inside
+            if (src[i] == '\\') {
+                i++;
+            } else if (src[i] == '"') {
+                ASSERT_LT(n, index.count);
+                ASSERT_EQ(index.items[n], (uint32_t) i);
+                n++;
+                in_string = !in_string;
+            } else if (!in_string && strchr("{}[]", src[i]) != NULL) {
+                ASSERT_LT(n, index.count);
+                ASSERT_EQ(index.items[n], (uint32_t) i);
+                n++;
+            }
+        }
+        ASSERT_EQ(n, index.count);
+        ASSERT_EQ(closed, !in_string);
+        arena_reset(&a);
+    }
+    arena_free(&a);
+}
+
+UTEST(tg_decode, get_updates_response) {
+    Arena a = {0};
+    const char *src =
+        "{\"ok\":true,\"result\":[{\"update_id\":12,\"message\":{\"message_id\":3,"
+        "\"from\":{\"id\":5,\"is_bot\":false,\"first_name\":\"Al\",\"first\":[1,{\"x\":null}]},"
+        "\"chat\":{\"id\":-1001234567890,\"type\":\"group\"},\"date\":1.5e9,"
+        "\"text\":\"a \\\"b\\\"\\n\\u00e4\\ud83d\\udc4d\"}},{\"update_id\":13,\"edited_message\":{}}]}";
+    Result r = tg_decode_get_updates_response(&a, string_view_from_char_ptr((char *) src));
+    ASSERT_EQ(r.state, STATE_DONE);
+    ASSERT_EQ(r.kind, RESULT_KIND_TG_UPDATE_LIST);
+
+    Tg_Update_List *list = r.tg_update_list;
+    ASSERT_EQ(list->count, (size_t) 2);
+    Tg_Message *m = list->items[0].message;
+    ASSERT_EQ(list->items[0].update_id, 12);
+    ASSERT_EQ(m->message_id, 3);
+    ASSERT_EQ(m->chat->id, -1001234567890);
+    ASSERT_STREQ(m->from->first_name, "Al");
+    ASSERT_STREQ(m->text, "a \"b\"\n\xc3\xa4\xf0\x9f\x91\x8d");
+    ASSERT_EQ(list->items[1].update_id, 13);
+    ASSERT_TRUE(list->items[1].message == NULL);
+
+    // the decoder gives the same result without the structural index
+    Tg_Decoder d = tg_decoder_init(&a, string_view_from_char_ptr((char *) src), NULL);
+    Result r_scalar = tg_decode_get_updates(&d);
+    ASSERT_EQ(r_scalar.state, STATE_DONE);
+    ASSERT_EQ(r_scalar.tg_update_list->count, (size_t) 2);
+    ASSERT_STREQ(r_scalar.tg_update_list->items[0].message->text, m->text);
+
+    // the pipelined poller only reads the ids
+    Json_Index index;
+    ASSERT_TRUE(json_index_build(&a, string_view_from_char_ptr((char *) src), &index));
+    Tg_Decoder d_ids = tg_decoder_init(&a, string_view_from_char_ptr((char *) src), &index);
+    size_t count;
+    int64_t max_id;
+    ASSERT_TRUE(tg_decode_get_updates_ids(&d_ids, &count, &max_id));
+    ASSERT_EQ(count, (size_t) 2);
+    ASSERT_EQ(max_id, 13);
+
+    arena_free(&a);
+}
+
+UTEST(tg_decode, error_description) {
+    Arena a = {0};
+    const char *src = "{\"ok\":false,\"error_code\":401,\"description\":\"Unauthorized\"}";
+    Result r = tg_decode_get_updates_response(&a, string_view_from_char_ptr((char *) src));
+    ASSERT_EQ(r.state, STATE_ERROR);
+    ASSERT_EQ(r.kind, RESULT_KIND_STRING_VIEW);
+    ASSERT_TRUE(string_view_eq_cstr(r.string_view, "Unauthorized"));
+
+    arena_free(&a);
+}
+
+UTEST(tg_decode, malformed) {
+    Arena a = {0};
+    const char *srcs[] = {
+        "",
+        "{\"ok\":true,\"result\":[{\"update_id\":1}]",
+        "{\"ok\":true,\"result\":[{\"message\":{}}]}",
+        "{\"ok\":true,\"result\":[{\"update_id\":1,\"message\":{\"message_id\":1}}]}",
+        "{\"ok\":true,\"result\":[]} trailing",
+        "{\"ok\":true,\"result\":[{\"update_id\":9223372036854775808}]}",
+        "{\"ok\":true,\"result\":[{\"update_id\":1,\"message\":{\"message_id\":1,"
+        "\"chat\":{\"id\":1,\"type\":\"private\"},\"text\":\"a\\u0000b\"}}]}",
+        "{\"ok\":true,\"x\":\"a\tb\",\"result\":[]}",
+        "{\"ok\":true,\"x\":[1},\"result\":[]}",
+        "{\"ok\":true,\"x\":{\"y\":[]]},\"result\":[]}",
+    };
+    for (size_t i=0; i<sizeof(srcs)/sizeof(srcs[0]); i++) {
+        Result r = tg_decode_get_updates_response(&a, string_view_from_char_ptr((char *) srcs[i]));
+        ASSERT_EQ(r.state, STATE_ERROR);
+        ASSERT_EQ(r.kind, RESULT_KIND_VOID);
+
+        // the same without the structural index
+        Tg_Decoder d = tg_decoder_init(&a, string_view_from_char_ptr((char *) srcs[i]), NULL);
+        r = tg_decode_get_updates(&d);
+        ASSERT_EQ(r.state, STATE_ERROR);
+        ASSERT_EQ(r.kind, RESULT_KIND_VOID);
+    }
+
+    // the response object and the values in it may be nested TG_DECODE_MAX_DEPTH deep, not deeper
+    for (size_t n=TG_DECODE_MAX_DEPTH-1; n<=TG_DECODE_MAX_DEPTH; n++) {
+        char src[2*TG_DECODE_MAX_DEPTH + 64];
+        size_t len = (size_t) sprintf(src, "{\"ok\":true,\"x\":");
+        memset(src + len, '[', n);
+        memset(src + len + n, ']', n);
+        sprintf(src + len + 2*n, ",\"result\":[]}");
+        Result r = tg_decode_get_updates_response(&a, string_view_from_char_ptr(src));
+        ASSERT_EQ(r.state, n < TG_DECODE_MAX_DEPTH ? STATE_DONE : STATE_ERROR);
+        Tg_Decoder d = tg_decoder_init(&a, string_view_from_char_ptr(src), NULL);
+        r = tg_decode_get_updates(&d);
+        ASSERT_EQ(r.state, n < TG_DECODE_MAX_DEPTH ? STATE_DONE : STATE_ERROR);
+    }
+
+    arena_free(&a);
+}
+
+UTEST(tg_message, date_is_optional) {
+    Arena a = {0};
+    // a date that is no number is ignored like a missing one, the message is kept
+    const char *src = "{\"message_id\":1,\"chat\":{\"id\":2},\"date\":\"today\",\"text\":\"hi\"}";
+    json_value_t *root = json_parse(src, strlen(src));
+    ASSERT_TRUE(root != NULL);
+    Tg_Message *m = as_tg_message(&a, root);
+    ASSERT_TRUE(m != NULL);
+    ASSERT_EQ(m->date, 0);
+    ASSERT_STREQ(m->text, "hi");
+    free(root);
+    arena_free(&a);
+}
+
 UTEST(stack, int) {
     int x = 42;
 
-    size_t stack_count_pre = stack_count;
+    size_t stack_count_pre = session->stack_count;
     stack_push_int(x);
-    ASSERT_EQ(stack_count, stack_count_pre+1);
+    ASSERT_EQ(session->stack_count, stack_count_pre+1);
     ASSERT_TRUE(stack_int());
     ASSERT_EQ(x, STACK_TOP.x);
 
-    stack_count = 0;
+    session->stack_count = 0;
 }
 
 UTEST(stack, string) {
     char *str = "moin";
 
-    size_t stack_count_pre = stack_count;
+    size_t stack_count_pre = session->stack_count;
     stack_push_string(string_view_from_char_ptr(str));
-    ASSERT_EQ(stack_count, stack_count_pre+1);
+    ASSERT_EQ(session->stack_count, stack_count_pre+1);
     ASSERT_TRUE(stack_string());
     ASSERT_EQ(strlen(str), STACK_TOP.count);
     ASSERT_STRNEQ(str, STACK_TOP.str, STACK_TOP.count);
 
-    stack_count = 0;
+    session->stack_count = 0;
 }
 
 UTEST(execute, empty) {
-    size_t stack_count_pre = stack_count;
+    size_t stack_count_pre = session->stack_count;
     Reply_Kind r = execute(string_view_from_char_ptr(""));
     ASSERT_EQ(r, REPLY_ACK);
-    ASSERT_EQ(stack_count, stack_count_pre);
+    ASSERT_EQ(session->stack_count, stack_count_pre);
 
-    stack_count = 0;
+    session->stack_count = 0;
 }
 
 UTEST(execute, string) {
-    size_t stack_count_pre = stack_count;
+    size_t stack_count_pre = session->stack_count;
     Reply_Kind r = execute(string_view_from_char_ptr("hello"));
     ASSERT_EQ(r, REPLY_ACK);
-    ASSERT_EQ(stack_count, stack_count_pre + 1);
+    ASSERT_EQ(session->stack_count, stack_count_pre + 1);
     ASSERT_TRUE(stack_string());
 
-    stack_count = 0;
+    session->stack_count = 0;
+}
+
+UTEST(execute, keyword_prefix) {
+    // only whole keywords are commands, "t" used to run tg-getMe
+    size_t stack_count_pre = session->stack_count;
+    Reply_Kind r = execute(string_view_from_char_ptr("t tg-getMeX"));
+    ASSERT_EQ(r, REPLY_ACK);
+    ASSERT_EQ(session->stack_count, stack_count_pre + 2);
+
+    session->stack_count = 0;
+}
+
+UTEST(command, lookup) {
+    for (Command i=0; i<COMMAND_COUNT; i++) {
+        Command c;
+        ASSERT_TRUE(command_lookup(string_view_from_char_ptr((char *) command_keyword[i]), &c));
+        ASSERT_EQ(c, i);
+    }
+    Command c;
+    ASSERT_FALSE(command_lookup(string_view_from_char_ptr("hel"), &c));
+    ASSERT_FALSE(command_lookup(string_view_from_char_ptr("helpp"), &c));
+    ASSERT_FALSE(command_lookup(string_view_from_char_ptr(""), &c));
+}
+
+UTEST(command, hash_is_current) {
+    ASSERT_EQ(command_keywords_hash(), (uint32_t) COMMAND_HASH_KEYWORDS);
+}
+
+UTEST(program, compile) {
+    Program *p = program_compile(string_view_from_char_ptr("  12 abc\t+ \x01 print"));
+    ASSERT_EQ(p->code_count, (size_t) 5);
+    ASSERT_EQ(p->code[0].kind, INSTRUCTION_PUSH_INT);
+    ASSERT_EQ(p->code[0].x, 12);
+    ASSERT_EQ(p->code[1].kind, INSTRUCTION_PUSH_STRING);
+    ASSERT_TRUE(string_view_eq_cstr(p->code[1].str, "abc"));
+    ASSERT_EQ(p->code[2].kind, INSTRUCTION_COMMAND);
+    ASSERT_EQ(p->code[2].command, PLUS);
+    ASSERT_EQ(p->code[3].kind, INSTRUCTION_ERROR);
+    ASSERT_EQ(p->code[4].kind, INSTRUCTION_END);
+    free(p);
+}
+
+UTEST(program, cache) {
+    size_t hits_pre = program_cache.hits;
+    Program *p1 = program_cache_get(string_view_from_char_ptr("1 2 +"));
+    Program *p2 = program_cache_get(string_view_from_char_ptr("1 2 +"));
+    ASSERT_TRUE(p1 == p2);
+    ASSERT_EQ(program_cache.hits, hits_pre + 1);
+
+    Program *p3 = program_cache_get(string_view_from_char_ptr("1 2 -"));
+    ASSERT_TRUE(string_view_eq_cstr(p3->source, "1 2 -"));
+    program_cache_free_all();
 }
 
 UTEST(execute, int) {
-    size_t stack_count_pre = stack_count;
+    size_t stack_count_pre = session->stack_count;
     Reply_Kind r = execute(string_view_from_char_ptr("123"));
     ASSERT_EQ(r, REPLY_ACK);
-    ASSERT_EQ(stack_count, stack_count_pre + 1);
+    ASSERT_EQ(session->stack_count, stack_count_pre + 1);
     ASSERT_TRUE(stack_int());
 
-    stack_count = 0;
+    session->stack_count = 0;
 }
 
 UTEST(execute, quit) {
-    size_t stack_count_pre = stack_count;
+    size_t stack_count_pre = session->stack_count;
     Reply_Kind r = execute(string_view_from_char_ptr("quit"));
     ASSERT_EQ(r, REPLY_CLOSE);
-    ASSERT_EQ(stack_count, stack_count_pre);
+    ASSERT_EQ(session->stack_count, stack_count_pre);
 
-    stack_count = 0;
+    session->stack_count = 0;
 }
 
 UTEST(execute, drop) {
     stack_push_string(string_view_from_char_ptr("hello"));
     stack_push_string(string_view_from_char_ptr("world"));
     stack_push_int(-8);
-    size_t stack_count_pre = stack_count;
+    size_t stack_count_pre = session->stack_count;
     Reply_Kind r = execute(string_view_from_char_ptr("drop"));
     ASSERT_EQ(r, REPLY_ACK);
-    ASSERT_EQ(stack_count + 1, stack_count_pre);
+    ASSERT_EQ(session->stack_count + 1, stack_count_pre);
 
-    stack_count = 0;
+    session->stack_count = 0;
 }
 
 UTEST(execute, plus) {
@@ -202,14 +1007,14 @@ UTEST(execute, plus) {
     stack_push_int(x);
     stack_push_int(y);
     ASSERT_TRUE(stack_two_int());
-    size_t stack_count_pre = stack_count;
+    size_t stack_count_pre = session->stack_count;
     Reply_Kind r = execute(string_view_from_char_ptr("+"));
     ASSERT_EQ(r, REPLY_ACK);
-    ASSERT_EQ(stack_count + 1, stack_count_pre);
+    ASSERT_EQ(session->stack_count + 1, stack_count_pre);
     ASSERT_TRUE(stack_int());
     ASSERT_EQ(STACK_TOP.x, x + y);
 
-    stack_count = 0;
+    session->stack_count = 0;
 }
 
 UTEST(execute, minus) {
@@ -219,14 +1024,14 @@ UTEST(execute, minus) {
     stack_push_int(x);
     stack_push_int(y);
     ASSERT_TRUE(stack_two_int());
-    size_t stack_count_pre = stack_count;
+    size_t stack_count_pre = session->stack_count;
     Reply_Kind r = execute(string_view_from_char_ptr("-"));
     ASSERT_EQ(r, REPLY_ACK);
-    ASSERT_EQ(stack_count + 1, stack_count_pre);
+    ASSERT_EQ(session->stack_count + 1, stack_count_pre);
     ASSERT_TRUE(stack_int());
     ASSERT_EQ(STACK_TOP.x, x - y);
 
-    stack_count = 0;
+    session->stack_count = 0;
 }
 
 UTEST(execute, times) {
@@ -236,14 +1041,14 @@ UTEST(execute, times) {
     stack_push_int(x);
     stack_push_int(y);
     ASSERT_TRUE(stack_two_int());
-    size_t stack_count_pre = stack_count;
+    size_t stack_count_pre = session->stack_count;
     Reply_Kind r = execute(string_view_from_char_ptr("*"));
     ASSERT_EQ(r, REPLY_ACK);
-    ASSERT_EQ(stack_count + 1, stack_count_pre);
+    ASSERT_EQ(session->stack_count + 1, stack_count_pre);
     ASSERT_TRUE(stack_int());
     ASSERT_EQ(STACK_TOP.x, x * y);
 
-    stack_count = 0;
+    session->stack_count = 0;
 }
 
 UTEST(execute, divide) {
@@ -253,14 +1058,14 @@ UTEST(execute, divide) {
     stack_push_int(x);
     stack_push_int(y);
     ASSERT_TRUE(stack_two_int());
-    size_t stack_count_pre = stack_count;
+    size_t stack_count_pre = session->stack_count;
     Reply_Kind r = execute(string_view_from_char_ptr("/"));
     ASSERT_EQ(r, REPLY_ACK);
-    ASSERT_EQ(stack_count + 1, stack_count_pre);
+    ASSERT_EQ(session->stack_count + 1, stack_count_pre);
     ASSERT_TRUE(stack_int());
     ASSERT_EQ(STACK_TOP.x, x / y);
 
-    stack_count = 0;
+    session->stack_count = 0;
 }
 
 typedef struct {
@@ -1,6 +1,8 @@
 #ifndef TGAPI_H
 #define TGAPI_H
 
+#include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define URL_PREFIX "https://api.telegram.org/bot"
@@ -26,6 +28,8 @@ typedef struct {
     // OPTIONAL
     Tg_User *from;
     const char *text;
+    // unix time when the message was sent, 0 if unknown
+    int64_t date;
 } Tg_Message;
 
 typedef int32_t update_id_t;
@@ -37,13 +41,28 @@ typedef struct {
     Tg_Message *message;
 } Tg_Update;
 
+typedef struct {
+    Tg_Update *items;
+    size_t count;
+    size_t capacity;
+} Tg_Update_List;
+
 typedef enum {
     GET_ME,
     GET_UPDATES,
     SEND_MESSAGE,
     SET_MESSAGE_REACTION,
+    TG_METHOD_COUNT,
 } Tg_Method;
 
+const char *tg_method_name[] = {
+    [GET_ME]               = "getMe",
+    [GET_UPDATES]          = "getUpdates",
+    [SEND_MESSAGE]         = "sendMessage",
+    [SET_MESSAGE_REACTION] = "setMessageReaction",
+};
+static_assert(sizeof(tg_method_name) / sizeof(tg_method_name[0]) == TG_METHOD_COUNT);
+
 typedef struct {
     char *bot_token;
     Tg_Method method;
@@ -53,6 +72,9 @@ typedef struct {
     char *text;
     // REQUIRED for: SET_MESSAGE_REACTION
     message_id_t message_id;
+    // OPTIONAL for: GET_UPDATES
+    update_id_t offset;
+    int timeout;
 } Tg_Method_Call;
 
 Tg_Method_Call new_tg_api_call_get_me(char *bot_token) {
@@ -71,6 +93,17 @@ Tg_Method_Call new_tg_api_call_get_updates(char *bot_token) {
     return result;
 }
 
+// Telegram holds the request open for up to timeout seconds until there is an update with an id of at least offset
+Tg_Method_Call new_tg_api_call_get_updates_long_poll(char *bot_token, update_id_t offset, int timeout) {
+    Tg_Method_Call result = {
+        .bot_token = bot_token,
+        .method = GET_UPDATES,
+        .offset = offset,
+        .timeout = timeout,
+    };
+    return result;
+}
+
 Tg_Method_Call new_tg_api_call_send_message(char *bot_token, Tg_Chat *chat, char *text) {
     Tg_Method_Call result = {
         .bot_token = bot_token,